@@ -0,0 +1,342 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "db.h"
+
+/*
+ * 基准测试: 通过db.h的接口在进程内运行确定的负载
+ * 每个规模依次运行顺序插入、随机插入、点查、范围扫描、全表扫描和读写混合，
+ * 记录吞吐量和p50/p99/p999延迟，结果以JSON写到标准输出，方便比较不同的构建
+ * 同样的参数和种子总是生成同样的键序列
+ */
+
+#define BENCH_MAX_SIZES 16
+const uint32_t BENCH_DEFAULT_OPS = 100000;
+const uint64_t BENCH_DEFAULT_SEED = 42;
+const uint32_t BENCH_RANGE_ROWS = 100;
+// 读写混合负载中写操作的比例(百分比)
+const uint32_t BENCH_MIXED_WRITE_PERCENT = 10;
+
+/*
+ * 伪随机数生成器(xorshift64*)，不依赖libc的rand，保证各平台生成同样的序列
+ */
+typedef struct Random {
+  uint64_t state;
+}Random;
+
+uint64_t random_next(Random* random) {
+  random->state ^= random->state >> 12;
+  random->state ^= random->state << 25;
+  random->state ^= random->state >> 27;
+  return random->state * 2685821657736338717ULL;
+}
+
+// 返回[1, n]中的一个id
+uint32_t random_id(Random* random, uint32_t n) {
+  return (uint32_t)(random_next(random) % n) + 1;
+}
+
+uint64_t clock_nanoseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * 一个负载的测量结果
+ * latencies  每个操作的延迟(纳秒)
+ * num_ops    已经完成的操作数
+ * start      负载开始的时间
+ * rows       负载运行时表中的行数
+ */
+typedef struct Measurement {
+  uint64_t* latencies;
+  uint64_t num_ops;
+  uint64_t start;
+  uint32_t rows;
+}Measurement;
+
+void measurement_begin(Measurement* measurement, uint64_t capacity,
+                       uint32_t rows) {
+  measurement->latencies = malloc(sizeof(uint64_t) * capacity);
+  measurement->num_ops = 0;
+  measurement->rows = rows;
+  measurement->start = clock_nanoseconds();
+}
+
+void measurement_record(Measurement* measurement, uint64_t op_start) {
+  measurement->latencies[measurement->num_ops++] =
+      clock_nanoseconds() - op_start;
+}
+
+int compare_latency(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+// 最近秩法求百分位数，latencies已经排好序
+uint64_t percentile(uint64_t* latencies, uint64_t n, double p) {
+  if (n == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(p * n + 0.999999);
+  if (rank == 0) {
+    rank = 1;
+  }
+  return latencies[(rank > n ? n : rank) - 1];
+}
+
+/*
+ * 结束一个负载并输出一条JSON记录
+ * first为false时在前面加逗号
+ */
+void measurement_end(Measurement* measurement, const char* workload,
+                     bool first) {
+  double seconds = (clock_nanoseconds() - measurement->start) / 1e9;
+  uint64_t n = measurement->num_ops;
+  qsort(measurement->latencies, n, sizeof(uint64_t), compare_latency);
+
+  printf("%s\n    {\"workload\": \"%s\", \"rows\": %u, \"ops\": %" PRIu64
+         ", \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"p50_ns\": %" PRIu64
+         ", \"p99_ns\": %" PRIu64 ", \"p999_ns\": %" PRIu64
+         ", \"max_ns\": %" PRIu64 "}",
+         first ? "" : ",", workload, measurement->rows, n, seconds,
+         seconds > 0 ? n / seconds : 0.0,
+         percentile(measurement->latencies, n, 0.50),
+         percentile(measurement->latencies, n, 0.99),
+         percentile(measurement->latencies, n, 0.999),
+         n == 0 ? 0 : measurement->latencies[n - 1]);
+  fflush(stdout);
+  free(measurement->latencies);
+}
+
+void bench_fail(const char* workload, uint32_t id, ExecuteResult result) {
+  fprintf(stderr, "Benchmark %s failed at id %u with result %d\n", workload, id,
+          result);
+  exit(EXIT_FAILURE);
+}
+
+void fill_row(Row* row, uint32_t id, uint32_t version) {
+  row->id = id;
+  snprintf(row->username, sizeof(row->username), "user%u", id);
+  snprintf(row->email, sizeof(row->email), "person%u.%u@example.com", id,
+           version);
+}
+
+// 删除上一次运行留下的数据库文件和预写日志
+void remove_database(const char* filename) {
+  char wal_path[4096];
+  snprintf(wal_path, sizeof(wal_path), "%s-wal", filename);
+  unlink(filename);
+  unlink(wal_path);
+}
+
+/*
+ * 把keys中的id依次插入一个新的数据库
+ * direct为true时绕过内核页缓存打开数据库，测量真实的I/O开销
+ */
+Table* bench_insert(const char* filename, bool direct, const char* workload,
+                    uint32_t* keys, uint32_t rows, bool first) {
+  remove_database(filename);
+  Table* table =
+      direct ? db_open_direct(filename, false) : db_open(filename, false);
+
+  Measurement measurement;
+  measurement_begin(&measurement, rows, 0);
+  Row row;
+  for (uint32_t i = 0; i < rows; i++) {
+    fill_row(&row, keys[i], 0);
+    uint64_t op_start = clock_nanoseconds();
+    ExecuteResult result = db_insert(table, &row);
+    measurement_record(&measurement, op_start);
+    if (result != EXECUTE_SUCCESS) {
+      bench_fail(workload, keys[i], result);
+    }
+  }
+  measurement.rows = rows;
+  measurement_end(&measurement, workload, first);
+  return table;
+}
+
+void bench_point_lookup(Table* table, uint32_t rows, uint32_t ops,
+                        Random* random) {
+  Measurement measurement;
+  measurement_begin(&measurement, ops, rows);
+  Row row;
+  for (uint32_t i = 0; i < ops; i++) {
+    uint32_t id = random_id(random, rows);
+    uint64_t op_start = clock_nanoseconds();
+    ExecuteResult result = db_find(table, id, &row);
+    measurement_record(&measurement, op_start);
+    if (result != EXECUTE_SUCCESS) {
+      bench_fail("point_lookup", id, result);
+    }
+  }
+  measurement_end(&measurement, "point_lookup", false);
+}
+
+/*
+ * 从start_id开始扫描最多limit行，返回读到的行数
+ */
+uint32_t scan_rows(Table* table, uint32_t start_id, uint32_t limit) {
+  Scan* scan = db_scan_open_at(table, start_id);
+  Row row;
+  uint32_t count = 0;
+  while (count < limit && db_scan_next(scan, &row)) {
+    count++;
+  }
+  db_scan_close(scan);
+  return count;
+}
+
+/*
+ * 扫描负载，每次扫描是一个操作
+ * 扫描的总行数和点查的操作数大致相同，让各负载的运行时间在同一个量级
+ * 范围扫描每次从随机的id开始，保证后面还有limit行
+ */
+void bench_scan(Table* table, const char* workload, uint32_t rows,
+                uint32_t limit, uint32_t ops, Random* random) {
+  uint32_t window = limit < rows ? limit : rows;
+  uint32_t num_scans = window == 0 ? 1 : ops / window;
+  if (num_scans == 0) {
+    num_scans = 1;
+  }
+
+  Measurement measurement;
+  measurement_begin(&measurement, num_scans, rows);
+  for (uint32_t i = 0; i < num_scans; i++) {
+    uint32_t start_id = 1;
+    if (window < rows) {
+      start_id = random_id(random, rows - window + 1);
+    }
+    uint64_t op_start = clock_nanoseconds();
+    uint32_t count = scan_rows(table, start_id, limit);
+    measurement_record(&measurement, op_start);
+    if (count != window) {
+      bench_fail(workload, count, EXECUTE_KEY_NOT_FOUND);
+    }
+  }
+  measurement_end(&measurement, workload, false);
+}
+
+/*
+ * 读写混合: 大部分是点查，其余用db_replace覆盖已经存在的行，表的大小不变
+ */
+void bench_mixed(Table* table, uint32_t rows, uint32_t ops, Random* random) {
+  Measurement measurement;
+  measurement_begin(&measurement, ops, rows);
+  Row row;
+  for (uint32_t i = 0; i < ops; i++) {
+    uint32_t id = random_id(random, rows);
+    bool write = (random_next(random) % 100) < BENCH_MIXED_WRITE_PERCENT;
+    if (write) {
+      fill_row(&row, id, i + 1);
+    }
+    uint64_t op_start = clock_nanoseconds();
+    ExecuteResult result =
+        write ? db_replace(table, &row) : db_find(table, id, &row);
+    measurement_record(&measurement, op_start);
+    if (result != EXECUTE_SUCCESS) {
+      bench_fail("mixed", id, result);
+    }
+  }
+  measurement_end(&measurement, "mixed", false);
+}
+
+/*
+ * 一个规模下的全部负载
+ * 随机插入建好的表继续用于后面的读负载
+ */
+void bench_size(const char* filename, bool direct, uint32_t rows, uint32_t ops,
+                Random* random, bool first) {
+  uint32_t* keys = malloc(sizeof(uint32_t) * rows);
+  for (uint32_t i = 0; i < rows; i++) {
+    keys[i] = i + 1;
+  }
+  Table* table =
+      bench_insert(filename, direct, "seq_insert", keys, rows, first);
+  db_close(table);
+
+  // Fisher-Yates洗牌得到随机插入的顺序
+  for (uint32_t i = rows; i > 1; i--) {
+    uint32_t j = random_next(random) % i;
+    uint32_t key = keys[i - 1];
+    keys[i - 1] = keys[j];
+    keys[j] = key;
+  }
+  table = bench_insert(filename, direct, "random_insert", keys, rows, false);
+  free(keys);
+
+  bench_point_lookup(table, rows, ops, random);
+  bench_scan(table, "range_scan", rows, BENCH_RANGE_ROWS, ops, random);
+  bench_scan(table, "full_scan", rows, rows, ops, random);
+  bench_mixed(table, rows, ops, random);
+
+  db_close(table);
+  remove_database(filename);
+}
+
+void print_usage() {
+  printf(
+      "Usage: dbbench [--rows N[,N...]] [--ops N] [--seed N] [--file "
+      "path] [--direct]\n");
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t sizes[BENCH_MAX_SIZES];
+  uint32_t num_sizes = 0;
+  uint32_t ops = BENCH_DEFAULT_OPS;
+  uint64_t seed = BENCH_DEFAULT_SEED;
+  const char* filename = "bench.db";
+  bool direct = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+      char* saveptr;
+      char* size = strtok_r(argv[++i], ",", &saveptr);
+      while (size != NULL && num_sizes < BENCH_MAX_SIZES) {
+        sizes[num_sizes++] = strtoul(size, NULL, 10);
+        size = strtok_r(NULL, ",", &saveptr);
+      }
+    } else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) {
+      ops = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--file") == 0 && i + 1 < argc) {
+      filename = argv[++i];
+    } else if (strcmp(argv[i], "--direct") == 0) {
+      direct = true;
+    } else {
+      print_usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (num_sizes == 0) {
+    print_usage();
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t i = 0; i < num_sizes; i++) {
+    if (sizes[i] == 0) {
+      printf("Row counts must be positive.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // 种子为0时xorshift只会生成0
+  Random random = {seed == 0 ? BENCH_DEFAULT_SEED : seed};
+
+  printf("{\n  \"seed\": %" PRIu64 ",\n  \"ops\": %u,\n  \"direct\": %s,\n"
+         "  \"results\": [",
+         seed, ops, direct ? "true" : "false");
+  for (uint32_t i = 0; i < num_sizes; i++) {
+    bench_size(filename, direct, sizes[i], ops, &random, i == 0);
+  }
+  printf("\n  ]\n}\n");
+  return 0;
+}
@@ -1,31 +1,104 @@
+// Linux的fcntl.h只在定义了_GNU_SOURCE时声明O_DIRECT，必须在包含任何头文件之前定义
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "db.h"
+
+/*
+ * USDT静态探针(provider为libdb)，有sys/sdt.h时默认编译进去，定义DB_NO_USDT可以去掉
+ * 每个探针带一个信号量(libdb_<探针>_semaphore)，bpftrace、perf等附加时把它加一；
+ * 信号量为0时跳过探针，不计算参数，只给探针用的计时(clock_gettime)也不进行
+ *   page__hit(page_num)                         get_page命中缓存
+ *   page__miss(page_num, duration_ns)           get_page从文件或共享缓存加载一页
+ *   page__flush(page_num, duration_ns)          写回从page_num开始的一段连续页
+ *   leaf__split(page_num, new_page_num)         叶节点分裂
+ *   new__root(root_page_num, left_page_num)     根节点分裂
+ *   internal__insert(parent_page_num, child_page_num)  内部节点插入新的子节点
+ *   statement__start(type)                      语句开始执行
+ *   statement__finish(type, result, duration_ns)  语句执行结束
+ * 例如: bpftrace -e 'usdt:./db:libdb:page__miss { @[arg0] = hist(arg1); }'
+ */
+#if !defined(DB_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define DB_USDT 1
+#endif
+#endif
+
 /*
- * 键盘输入缓冲池
- * buffer        输入内容
- * buffer_length 缓冲区大小
- * input_length  输入返回值大小
+ * 编译时定义DB_IO_URING并且有linux/io_uring.h时，批量页I/O使用io_uring，否则使用线程池
+ * 直接使用系统调用，不依赖liburing；运行时内核不支持(或者禁用了)io_uring时同样退回线程池
  */
-typedef struct InputBuffer {
-  char* buffer;
-  size_t buffer_length;
-  ssize_t input_length;
-}InputBuffer;
+#if defined(DB_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define DB_URING 1
+#endif
+#endif
 
-typedef enum ExecuteResult { 
-  EXECUTE_SUCCESS,
-  EXECUTE_DUPLICATE_KEY,
-  EXECUTE_TABLE_FULL 
-}ExecuteResult;
+/*
+ * DB_PROBE_CLOCK(name)   探针name附加时返回当前时间，否则返回0
+ * DB_PROBE_ELAPSED(start)  从start到现在的纳秒数，start为0(开始时还没有附加)时返回0
+ * 没有编译探针时参数转成void，计时用的变量不会产生未使用的警告
+ */
+#ifdef DB_USDT
+#define DB_PROBE_SEMAPHORE(name) \
+  volatile unsigned short libdb_##name##_semaphore \
+      __attribute__((section(".probes")))
+DB_PROBE_SEMAPHORE(page__hit);
+DB_PROBE_SEMAPHORE(page__miss);
+DB_PROBE_SEMAPHORE(page__flush);
+DB_PROBE_SEMAPHORE(leaf__split);
+DB_PROBE_SEMAPHORE(new__root);
+DB_PROBE_SEMAPHORE(internal__insert);
+DB_PROBE_SEMAPHORE(statement__start);
+DB_PROBE_SEMAPHORE(statement__finish);
+
+#define DB_PROBE_ENABLED(name) __builtin_expect(libdb_##name##_semaphore != 0, 0)
+#define DB_PROBE1(name, a)               \
+  do {                                   \
+    if (DB_PROBE_ENABLED(name)) {        \
+      DTRACE_PROBE1(libdb, name, a);     \
+    }                                    \
+  } while (0)
+#define DB_PROBE2(name, a, b)            \
+  do {                                   \
+    if (DB_PROBE_ENABLED(name)) {        \
+      DTRACE_PROBE2(libdb, name, a, b);  \
+    }                                    \
+  } while (0)
+#define DB_PROBE3(name, a, b, c)           \
+  do {                                     \
+    if (DB_PROBE_ENABLED(name)) {          \
+      DTRACE_PROBE3(libdb, name, a, b, c); \
+    }                                      \
+  } while (0)
+#define DB_PROBE_CLOCK(name) (DB_PROBE_ENABLED(name) ? now_nanoseconds() : 0)
+#define DB_PROBE_ELAPSED(start) ((start) == 0 ? 0 : now_nanoseconds() - (start))
+#else
+#define DB_PROBE1(name, a) ((void)(a))
+#define DB_PROBE2(name, a, b) ((void)(a), (void)(b))
+#define DB_PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#define DB_PROBE_CLOCK(name) 0
+#define DB_PROBE_ELAPSED(start) (start)
+#endif
 
 typedef enum MetaCommandResult {
   META_COMMAND_SUCCESS,
+  META_COMMAND_EXIT,
   META_COMMAND_UNRECOGNIZED_COMMAND
 }MetaCommandResult;
 
@@ -35,26 +108,135 @@ typedef enum PrepareResult {
   PREPARE_NEGATIVE_ID,
   PREPARE_STRING_TOO_LONG,
   PREPARE_SYNTAX_ERROR,
-  PREPARE_UNRECOGNIZED_STATEMENT
+  PREPARE_UNRECOGNIZED_STATEMENT,
+  PREPARE_UNKNOWN_PREPARED_STATEMENT
 }PrepareResult;
 
-typedef enum StatementType { STATEMENT_INSERT, STATEMENT_SELECT }StatementType;
+typedef enum StatementType {
+  STATEMENT_INSERT,
+  STATEMENT_SELECT,
+  STATEMENT_UPDATE,
+  STATEMENT_BEGIN,
+  STATEMENT_COMMIT,
+  STATEMENT_ROLLBACK,
+  STATEMENT_VACUUM,
+  STATEMENT_TYPE_COUNT
+}StatementType;
+
+const char* const STATEMENT_TYPE_NAMES[] = {"insert", "select",   "update",
+                                            "begin",  "commit",   "rollback",
+                                            "vacuum"};
 
-const uint32_t COLUMN_USERNAME_SIZE = 32;
-const uint32_t COLUMN_EMAIL_SIZE = 255;
-struct Row_t {
-  uint32_t id;
-  char username[COLUMN_USERNAME_SIZE + 1];
-  char email[COLUMN_EMAIL_SIZE + 1];
-};
-typedef struct Row_t Row;
+/*
+ * 聚合函数
+ * AGGREGATE_NONE   普通查询，逐行打印
+ * AGGREGATE_COUNT  count(*)
+ * AGGREGATE_MIN    min(id)
+ * AGGREGATE_MAX    max(id)
+ * AGGREGATE_SUM    sum(id)
+ */
+typedef enum AggregateType {
+  AGGREGATE_NONE,
+  AGGREGATE_COUNT,
+  AGGREGATE_MIN,
+  AGGREGATE_MAX,
+  AGGREGATE_SUM
+}AggregateType;
+
+/*
+ * where子句中的过滤条件
+ * PREDICATE_NONE      没有过滤条件
+ * PREDICATE_EQUALS    column = 'x'
+ * PREDICATE_PREFIX    column like 'x%'
+ * PREDICATE_SUFFIX    column like '%x'
+ * PREDICATE_CONTAINS  column like '%x%'
+ * PREDICATE_ID_IN     id in (a, b, c) 或 id = a，按主键批量查找
+ */
+typedef enum PredicateType {
+  PREDICATE_NONE,
+  PREDICATE_EQUALS,
+  PREDICATE_PREFIX,
+  PREDICATE_SUFFIX,
+  PREDICATE_CONTAINS,
+  PREDICATE_ID_IN
+}PredicateType;
+
+#define PREDICATE_MAX_KEYS 1024
+
+/*
+ * 过滤条件
+ * column_offset   要比较的字段在序列化后的行中的偏移位
+ * column_size     该字段的大小
+ * pattern         去掉引号和通配符后的比较内容
+ * pattern_length  比较内容的长度
+ * like            运算符是like，比较内容是参数时绑定的值也按通配符解析
+ * keys            id in (...)中的主键列表
+ * num_keys        主键数量
+ */
+typedef struct Predicate {
+  PredicateType type;
+  uint32_t column_offset;
+  uint32_t column_size;
+  char pattern[COLUMN_EMAIL_SIZE + 1];
+  uint32_t pattern_length;
+  bool like;
+  uint32_t keys[PREDICATE_MAX_KEYS];
+  uint32_t num_keys;
+}Predicate;
+
+/*
+ * 预编译语句中的参数(?)
+ * PARAMETER_ID        insert/update的id
+ * PARAMETER_USERNAME  insert/update的username
+ * PARAMETER_EMAIL     insert/update的email
+ * PARAMETER_KEY       where id = ? 或 id in (?, ...)中的主键，key_index是它在keys中的位置
+ * PARAMETER_PATTERN   where username/email = ? 或 like ?中的比较内容，like时绑定的值可以带通配符
+ */
+typedef enum ParameterType {
+  PARAMETER_ID,
+  PARAMETER_USERNAME,
+  PARAMETER_EMAIL,
+  PARAMETER_KEY,
+  PARAMETER_PATTERN
+}ParameterType;
+
+typedef struct Parameter {
+  ParameterType type;
+  uint32_t key_index;
+}Parameter;
+
+#define STATEMENT_MAX_PARAMETERS 32
 
 struct Statement_t {
   StatementType type;
-  Row row_to_insert;  // only used by insert statement
+  Row row_to_insert;  // used by insert and update statements
+  bool replace;  // only used by insert statement: insert or replace
+  bool update_username;  // only used by update statement
+  bool update_email;  // only used by update statement
+  AggregateType aggregate;  // only used by select statement
+  Predicate predicate;  // only used by select statement
+  Parameter parameters[STATEMENT_MAX_PARAMETERS];  // ? placeholders in order
+  uint32_t num_parameters;
+  uint32_t max_relocations;  // only used by vacuum: 0 rebuilds the whole tree
 };
 typedef struct Statement_t Statement;
 
+/*
+ * 预编译语句: 解析好的语句模板，执行前只需要把参数值填进去
+ */
+struct PreparedStatement {
+  Statement statement;
+};
+
+/*
+ * REPL中用prepare命名的预编译语句，属于会话
+ */
+typedef struct NamedStatement {
+  char* name;
+  PreparedStatement* prepared;
+  struct NamedStatement* next;
+}NamedStatement;
+
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
 
 const uint32_t ID_SIZE = size_of_attribute(Row, id);
@@ -66,48 +248,487 @@ const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
 const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
 
 const uint32_t PAGE_SIZE = 4096;
-const uint32_t TABLE_MAX_PAGES = 100;
+// 页表按页号分三级: 低10位是页表块内的下标，再往上10位是中间目录的下标，剩下的12位是根目录的下标
+const uint32_t PAGE_TABLE_CHUNK_BITS = 10;
+const uint32_t PAGE_TABLE_DIRECTORY_BITS = 10;
+// 共享页缓存的帧数
+#define SHARED_CACHE_PAGES 4096
+#define BTREE_MAX_DEPTH 32
+const uint32_t WAL_CHECKPOINT_FRAMES = 1000;
+// 一次write追加到预写日志的帧数，提交很多页时分批写，缓冲区大小固定
+#define WAL_BATCH_FRAMES 64
+const uint32_t FRAME_CHUNK_PAGES = 512;
+// 页缓存默认最多保存的页数(64MB)，db_set_cache_pages可以修改
+const uint32_t PAGE_CACHE_PAGES = 16384;
+// 放入一页时淘汰最多检查的缓存页数，缓存中都是不能淘汰的页时每次放入的开销有上限
+const uint32_t PAGE_CACHE_EVICT_SCAN = 64;
+#define TRANSACTION_INLINE_DIRTY_PAGES 16
+// 顺序扫描时每次预读的叶节点数，同时在途的异步预读批数
+#define READAHEAD_LEAVES 32
+const uint32_t READAHEAD_SLOTS = 8;
+// 线程池后端的I/O线程数，io_uring的队列深度，一个I/O请求最多读写的连续页数
+const uint32_t IO_POOL_THREADS = 4;
+const uint32_t IO_URING_ENTRIES = 64;
+const uint32_t IO_MAX_REQUEST_PAGES = 256;
+const size_t ARENA_BLOCK_SIZE = 64 * 1024;
+
+/*
+ * 延迟直方图的桶(HDR风格，对数分段后每段再线性细分)
+ * 小于HISTOGRAM_SUB_BUCKETS纳秒的值每纳秒一个桶，
+ * 更大的值每个2的幂区间分成HISTOGRAM_SUB_BUCKETS个桶，相对误差不超过1/32
+ */
+const uint32_t HISTOGRAM_SUB_BUCKET_BITS = 5;
+const uint32_t HISTOGRAM_SUB_BUCKETS = 32;
+#define HISTOGRAM_BUCKETS ((64 - 5 + 1) * 32)
+
+/*
+ * 多进程访问时用fcntl锁住数据库文件末尾之外的几个字节，不影响数据本身
+ * 页号是32位的，数据库文件不会超过2^44字节
+ * LOCK_OPEN_BYTE    打开期间持有: 默认独占(写锁)，共享模式下所有进程持有读锁
+ * LOCK_WRITER_BYTE  共享模式下写语句/显式事务持有写锁，同一时间只有一个进程在写
+ * LOCK_DATA_BYTE    共享模式下语句执行期间持有读锁，发布修改时持有写锁
+ */
+const off_t LOCK_OPEN_BYTE = (off_t)1 << 44;
+const off_t LOCK_WRITER_BYTE = ((off_t)1 << 44) + 1;
+const off_t LOCK_DATA_BYTE = ((off_t)1 << 44) + 2;
+
+/*
+ * 页锁(读写锁)的模式
+ * LATCH_SHARED     读锁，多个读线程可以同时持有
+ * LATCH_EXCLUSIVE  写锁，修改页内容时必须持有
+ */
+typedef enum LatchMode { LATCH_SHARED, LATCH_EXCLUSIVE }LatchMode;
+
+/*
+ * 页的旧版本(MVCC)
+ * 写操作从不修改已经发布的页，而是复制一份草稿，提交时用草稿替换最新版本，
+ * 被替换下来的页如果还有快照需要就挂到旧版本链上
+ * seq           这个版本是哪次提交产生的
+ * end_seq       这个版本在哪次提交时被替换，快照序号在[seq, end_seq)之间时看到的是它
+ * older         同一页更旧的版本
+ * next_retired  回收队列中的下一个版本，队列按end_seq从小到大排列
+ */
+typedef struct PageVersion {
+  void* data;
+  uint64_t seq;
+  uint64_t end_seq;
+  uint32_t page_num;
+  struct PageVersion* older;
+  struct PageVersion* next_retired;
+}PageVersion;
+
+/*
+ * 页表项: 一页在进程内的全部状态
+ * page      已经提交的最新版本，不在缓存中时为NULL
+ * draft     写事务还没有提交的草稿，只有持有该页写锁的事务能访问
+ * seq       page是哪次提交产生的，从文件读入的页为0
+ * versions  旧版本链，从新到旧
+ * reading   这一页正在被预读，读完之前get_page等它而不是再读一次，由Pager的lock保护
+ * referenced  放入缓存或命中之后置位，时钟淘汰扫过时先清除它，给这一页第二次机会
+ * latch     页锁，写操作访问页内容前需要先加锁
+ */
+typedef struct PageEntry {
+  void* page;
+  void* draft;
+  uint64_t seq;
+  PageVersion* versions;
+  bool reading;
+  bool referenced;
+  pthread_rwlock_t latch;
+}PageEntry;
+
+/*
+ * 页号列表，记录一段时间内提交过的页，提交时只看列表而不用遍历整个页表
+ */
+typedef struct PageList {
+  uint32_t* page_nums;
+  uint32_t count;
+  uint32_t capacity;
+}PageList;
+
+/*
+ * 事务
+ * 只读事务在开始时固定一个快照，之后读到的每一页都是快照时已经提交的版本，不需要加页锁
+ * 写事务修改页之前先复制草稿，提交时一次性发布所有草稿
+ * snapshot_seq     快照序号，只能看到序号不超过它的提交
+ * read_only        是否是只读事务
+ * autocommit       单条语句的事务，语句结束时自动提交；begin开始的事务要等到commit
+ * num_pages_at_begin  事务开始时的页数，回滚时丢弃事务中新分配的页
+ * dirty_pages      复制过草稿的页，先用inline_dirty_pages，页数多时再到堆上分配
+ * prev/next        活跃快照链表，按开始的先后排列
+ * evict_slot       事务开始时所在的淘汰纪元(奇偶)，见pager_advance_epoch
+ */
+typedef struct Transaction {
+  uint64_t snapshot_seq;
+  bool read_only;
+  bool autocommit;
+  uint32_t num_pages_at_begin;
+  uint32_t* dirty_pages;
+  uint32_t num_dirty_pages;
+  uint32_t dirty_pages_capacity;
+  uint32_t inline_dirty_pages[TRANSACTION_INLINE_DIRTY_PAGES];
+  struct Transaction* prev;
+  struct Transaction* next;
+  uint32_t evict_slot;
+}Transaction;
+
+/*
+ * 共享页缓存中的一帧，页号对SHARED_CACHE_PAGES取余决定放在哪一帧，后来的页替换原来的页
+ * sequence  顺序锁: 0表示空，奇数表示正在写入，非零偶数表示帧中是page_num这一页的完整内容
+ */
+typedef struct SharedFrame {
+  uint32_t page_num;
+  uint32_t sequence;
+}SharedFrame;
+
+/*
+ * 共享模式下所有进程映射的共享内存(shm_open)的头部，后面跟着共享页缓存
+ * change_counter  每次有进程发布修改时加一，其他进程据此判断自己的私有缓存是否过期
+ * num_pages       所有进程看到的页数
+ * frames          共享页缓存中每一帧的状态，一页被任何一个进程读过之后，在被替换之前其他进程都能直接命中
+ */
+typedef struct SharedHeader {
+  uint64_t change_counter;
+  uint32_t num_pages;
+  SharedFrame frames[SHARED_CACHE_PAGES];
+}SharedHeader;
+
+/*
+ * 一个页I/O请求: 从offset开始读写iov中的连续几页
+ * result  读写的字节数，出错时是-errno
+ */
+typedef struct IoRequest {
+  bool write;
+  off_t offset;
+  struct iovec* iov;
+  uint32_t num_iov;
+  ssize_t result;
+}IoRequest;
+
+/*
+ * 线程池队列中的一批请求
+ * next      下一个还没有被领走的请求
+ * num_done  已经完成的请求数
+ * complete  异步提交的一批全部完成后，由完成最后一个请求的线程调用；同步提交时为NULL
+ */
+typedef struct IoBatch {
+  IoRequest* requests;
+  uint32_t num_requests;
+  uint32_t next;
+  uint32_t num_done;
+  struct IoBatch* next_batch;
+  void (*complete)(struct IoBatch* batch);
+}IoBatch;
+
+/*
+ * 一批预读，最多READAHEAD_LEAVES页
+ * 同步预读用栈上的Readahead；异步预读从Pager的空闲链表中领取，I/O线程读完后放入页缓存并归还
+ * batch      必须是第一个成员，完成时从IoBatch找回Readahead
+ * seqs       iov中每一页在提交时的页表项seq，读的过程中这一页被加载、修改过时seq会变，读到的内容作废
+ */
+typedef struct Readahead {
+  IoBatch batch;
+  struct Pager* pager;
+  IoRequest requests[READAHEAD_LEAVES];
+  struct iovec iov[READAHEAD_LEAVES];
+  uint64_t seqs[READAHEAD_LEAVES];
+  uint32_t num_requests;
+  uint32_t num_iov;
+  struct Readahead* next_free;
+}Readahead;
+
+/*
+ * 批量页I/O的后端，一批请求一起提交，全部完成后返回
+ * uring=true时用io_uring: 整批放进提交队列，一次io_uring_enter提交并等待，在完成队列中收割，
+ * sq_*和cq_*是映射进来的两个环，uring_lock保证同一时间只有一批在使用环；
+ * 否则用线程池: threads和提交的线程一起从队列中领取请求，用preadv/pwritev并行执行；
+ * 异步预读总是交给线程池，所以io_uring模式下也有线程池
+ * lock保护队列，work通知有新的请求或者要退出，done通知有一批完成
+ */
+typedef struct IoBackend {
+  int fd;
+  bool uring;
+#ifdef DB_URING
+  int uring_fd;
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  uint32_t* sq_tail;
+  uint32_t* sq_mask;
+  uint32_t* sq_array;
+  uint32_t* cq_head;
+  uint32_t* cq_tail;
+  uint32_t* cq_mask;
+  struct io_uring_cqe* cqes;
+  pthread_mutex_t uring_lock;
+#endif
+  pthread_t* threads;
+  uint32_t num_threads;
+  IoBatch* queue_head;
+  IoBatch* queue_tail;
+  bool stopping;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+}IoBackend;
 
 /*
  * Pager            页面调度程序
  * file_descriptor  已经打开的文件描述 
  * file_length      文件大小
  * num_pages        目前存储了多少页
- * pages            存储对象列表
+ * page_table       页表的根目录，见page_entry
+ * page_table_limit 已经分配的页表块覆盖到的页号上限，遍历页表时用
+ * page_table_lock  分配页表的目录和块时使用的锁
+ * lock             缓存未命中时加载新页、分配新页时使用的锁
+ * readahead_done   预读的页放入缓存时通知等待这些页的get_page，和lock一起使用
+ * commit_seq       最近一次提交的序号
+ * snapshots        活跃快照链表的头(最旧)和尾(最新)
+ * retired_head     等待回收的旧版本队列
+ * version_lock     保护上面的版本信息
+ * wal_file_descriptor  预写日志(<文件名>-wal)，显式事务提交时追加并同步一次
+ * wal_path         预写日志的路径
+ * wal_num_frames   预写日志中的帧数，超过WAL_CHECKPOINT_FRAMES时做检查点
+ * durable_seq      已经持久化(写入数据库文件或预写日志)的最大提交序号
+ * checkpoint_seq   已经写回数据库文件的最大提交序号，写回时跳过在这之后没有提交过的页
+ * unsynced_pages   durable_seq之后提交过的页，显式事务提交时写入预写日志的就是这些页
+ *                  提交时在version_lock内追加，持久化和写回时调用者独占写权限
+ * unwritten_pages  checkpoint_seq之后提交过的页，独占模式写回时只写这些页；
+ *                  共享模式每次提交都已经写回文件，不记录
+ * num_writers      正在执行的自动提交写语句数
+ * exclusive_writer 是否有显式事务正在进行，显式事务与其他写操作互斥
+ * writer_lock/writer_cond  保护上面两项
+ * shared           是否是多进程共享模式
+ * direct           是否绕过内核页缓存直接读写数据库文件(O_DIRECT)
+ * shared_header    共享内存的头部，shared_frames是共享页缓存
+ * shm_name         共享内存的名字
+ * seen_change_counter  私有缓存对应的change_counter
+ * num_data_readers 本进程中正在执行的语句数，决定什么时候真正加锁、解锁LOCK_DATA_BYTE
+ * num_file_writers 本进程中持有LOCK_WRITER_BYTE的写操作数
+ * data_lock/file_writer_lock  保护上面两个计数；分开两把锁，等待写锁时不会挡住其他线程释放读锁
+ * free_frames      页帧池中空闲的帧，链表指针存在帧的开头
+ * frame_chunks     页帧池向系统申请的大块，最后一块用掉了frame_chunk_used帧
+ * frame_lock       保护页帧池
+ * free_versions    回收后可以复用的PageVersion，由version_lock保护
+ * stats            I/O和缓存计数，用原子操作累加
+ * io               批量读写页(预读、批量查找、写回)的I/O后端
+ * readaheads       异步预读用的READAHEAD_SLOTS个Readahead，空闲的在free_readaheads中，由lock保护
+ * vacuum_position  vacuum <n>下一次从叶节点链表的第几个叶节点继续，前面的叶节点已经在第1页开始的连续页中
+ * vacuum_seq       记录vacuum_position时的提交序号，之后有过其他提交就从头开始
+ * cache_pages      页缓存最多保存的页数，超出后用时钟算法淘汰干净的页，见pager_evict
+ * num_cached_pages 页缓存中的页数，用原子操作修改
+ * clock_hand       时钟算法下一次从哪一页开始扫描，由lock保护
+ * evict_epoch      淘汰纪元，被淘汰的页帧可能还在被不加页锁的读者使用，见pager_advance_epoch
+ * epoch_transactions  奇偶两个纪元中开始、还没有结束的事务数
+ * evicted_frames   奇偶两个纪元中被淘汰、还没有放回页帧池的页帧
+ *                  读者可能还在读这些帧，不能像页帧池那样把链表指针存在帧里，单独放在数组中
+ * num_evicted_frames / evicted_frames_capacity  两个数组的长度和容量
+ * evict_lock       保护上面几项
  */
 typedef struct Pager {
   int file_descriptor;
-  uint32_t file_length;
+  off_t file_length;
   uint32_t num_pages;
-  void* pages[TABLE_MAX_PAGES];
+  PageEntry*** page_table;
+  uint64_t page_table_limit;
+  pthread_mutex_t page_table_lock;
+  pthread_mutex_t lock;
+  pthread_cond_t readahead_done;
+  uint64_t commit_seq;
+  Transaction* snapshots_head;
+  Transaction* snapshots_tail;
+  PageVersion* retired_head;
+  PageVersion* retired_tail;
+  pthread_mutex_t version_lock;
+  int wal_file_descriptor;
+  char* wal_path;
+  uint32_t wal_num_frames;
+  uint64_t durable_seq;
+  uint64_t checkpoint_seq;
+  PageList unsynced_pages;
+  PageList unwritten_pages;
+  uint32_t num_writers;
+  bool exclusive_writer;
+  pthread_mutex_t writer_lock;
+  pthread_cond_t writer_cond;
+  bool shared;
+  bool direct;
+  SharedHeader* shared_header;
+  void* shared_frames;
+  char* shm_name;
+  uint64_t seen_change_counter;
+  uint32_t num_data_readers;
+  uint32_t num_file_writers;
+  pthread_mutex_t data_lock;
+  pthread_mutex_t file_writer_lock;
+  void* free_frames;
+  uint8_t** frame_chunks;
+  uint32_t num_frame_chunks;
+  uint32_t frame_chunk_used;
+  pthread_mutex_t frame_lock;
+  PageVersion* free_versions;
+  PagerStats stats;
+  IoBackend io;
+  Readahead* readaheads;
+  Readahead* free_readaheads;
+  uint32_t vacuum_position;
+  uint64_t vacuum_seq;
+  uint32_t cache_pages;
+  uint32_t num_cached_pages;
+  uint64_t clock_hand;
+  uint64_t evict_epoch;
+  uint32_t epoch_transactions[2];
+  void** evicted_frames[2];
+  uint32_t num_evicted_frames[2];
+  uint32_t evicted_frames_capacity[2];
+  pthread_mutex_t evict_lock;
 }Pager;
 
+/*
+ * 预写日志中每一帧的头部，后面跟着一整页数据
+ * commit    1表示这是一个事务的最后一帧，恢复时只重放以它结尾的完整事务
+ * checksum  页号、commit和页数据的校验和，用来识别写了一半的帧
+ */
+typedef struct WalFrameHeader {
+  uint32_t page_num;
+  uint32_t commit;
+  uint64_t checksum;
+}WalFrameHeader;
+
+/*
+ * 分批追加到预写日志的一个事务，缓冲区最多放WAL_BATCH_FRAMES帧，放满就写出
+ * num_remaining  这个事务还没有放进缓冲区的帧数，放入最后一帧时把它标记为commit
+ */
+typedef struct WalBatch {
+  Pager* pager;
+  uint8_t* frames;
+  uint32_t num_frames;
+  uint32_t num_remaining;
+}WalBatch;
+
+/*
+ * 语句级的内存池(arena)
+ * 语句执行期间的游标和临时数组从这里分配，语句结束时整体退回到开始时的位置，
+ * 不用逐个free，提前返回的路径也不会泄漏
+ * 内存按块向系统申请，退回后块留在链表中给后面的语句复用，稳定运行时不再调用malloc
+ * 每个会话一个arena，会话同时只在一个线程中执行语句，所以不加锁
+ * current  正在分配的块，链表中它后面的块都是空闲的
+ */
+typedef struct ArenaBlock {
+  struct ArenaBlock* next;
+  size_t capacity;
+  size_t used;
+}ArenaBlock;
+
+typedef struct Arena {
+  ArenaBlock* head;
+  ArenaBlock* current;
+}Arena;
+
+typedef struct ArenaMark {
+  ArenaBlock* block;
+  size_t used;
+}ArenaMark;
+
+const size_t ARENA_BLOCK_HEADER_SIZE = (sizeof(ArenaBlock) + 15) & ~(size_t)15;
+
+/*
+ * 延迟直方图，单位纳秒
+ * 多个会话并发记录，计数用原子操作累加，不加锁
+ */
+typedef struct LatencyHistogram {
+  uint64_t count;
+  uint64_t total;
+  uint64_t max;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+}LatencyHistogram;
+
+/*
+ * 每种语句解析(prepare_statement)和执行(execute_statement)的耗时
+ * 同一个数据库的所有会话共用一份
+ */
+typedef struct StatementStats {
+  LatencyHistogram parse[STATEMENT_TYPE_COUNT];
+  LatencyHistogram execute[STATEMENT_TYPE_COUNT];
+}StatementStats;
+
+/*
+ * explain analyze收集的单条语句的I/O统计，并行扫描的线程一起累加
+ * leaf_level       叶节点所在的层，根是第0层，第一次访问叶节点时计算
+ * pages_per_level  每层访问的页数，从一页移动到另一页算一次访问
+ * cache_misses     访问时不在进程内页缓存中的页数
+ * rows_examined    读取过的行数(包括不满足过滤条件的行)
+ */
+const uint32_t PROFILE_LEVEL_UNKNOWN = UINT32_MAX;
+
+typedef struct QueryProfile {
+  uint32_t leaf_level;
+  uint64_t pages_per_level[BTREE_MAX_DEPTH];
+  uint64_t cache_misses;
+  uint64_t rows_examined;
+}QueryProfile;
+
 /*
  * 数据结构
  * BTree部分
- * root_page_num   根节点对应的页码
+ * root_page_num     根节点对应的页码
+ * num_scan_threads  全表扫描最多使用多少个线程
+ * transaction       语句所在的事务，每条语句使用带事务的Table副本，
+ *                   为NULL时直接读写最新提交的页(打开、关闭数据库和.btree)
+ * named_statements  会话中用prepare命名的预编译语句
+ * arena             会话的语句级内存池，Table副本共用同一个
+ * statement_stats   语句耗时统计，所有会话共用
+ * timer             为true时每条语句执行后输出解析和执行的耗时(.timer on)
+ * nowait            为true时写操作不等待其他会话的显式事务，直接返回EXECUTE_BUSY
+ * profile           explain analyze执行期间不为NULL，记录语句访问的页
  */
-typedef struct Table {
+struct Table {
   Pager* pager;
   uint32_t root_page_num;
-}Table;
+  uint32_t num_scan_threads;
+  Transaction* transaction;
+  NamedStatement* named_statements;
+  Arena* arena;
+  StatementStats* statement_stats;
+  bool timer;
+  bool nowait;
+  QueryProfile* profile;
+};
 
 /*
  * 游标
  * page_num      哪一页(位置)
  * cell_num      哪条数据(位置)
  * end_of_table  是否是表格末尾
+ * readahead_marker  上一批预读的叶节点中间的一页，游标离开这一页时预读下一批，0表示还没有开始预读
+ * 游标打开期间一直持有page_num这一页的页锁，用完后调用cursor_close释放
  */
 typedef struct Cursor {
   Table* table;
   uint32_t page_num;
   uint32_t cell_num;
   bool end_of_table;
+  uint32_t readahead_marker;
 }Cursor;
 
+/*
+ * 写操作持有的页锁，按加锁的顺序排列: 先是从根到叶节点的查找路径，
+ * 分割内部节点时再加上父节点指针被修改的子节点
+ * 先用inline_page_nums，页数多时再到堆上分配
+ */
+typedef struct LatchSet {
+  uint32_t* page_nums;
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t inline_page_nums[BTREE_MAX_DEPTH];
+}LatchSet;
 
-void print_row(Row* row) {
-  printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+
+void print_row(FILE* output, Row* row) {
+  fprintf(output, "(%d, %s, %s)\n", row->id, row->username, row->email);
 }
 
 enum NodeType_t { NODE_INTERNAL, NODE_LEAF };
@@ -192,7 +813,7 @@ const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CELL_SIZE =
     INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
-const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
+#define INTERNAL_NODE_MAX_CELLS 3
 
 
 /*
@@ -219,6 +840,10 @@ void* leaf_node_value(void* node, uint32_t cell_num) {
   return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
 }
 
+uint32_t* leaf_node_next_leaf(void*node){
+  return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+}
+
 NodeType get_node_type(void* node){
   uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET));
   return (NodeType)value;
@@ -232,9 +857,21 @@ void set_node_type(void* node, NodeType type){
 /*
  * 初始化叶节点
  */
+bool is_node_root(void*node){
+  uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
+  return (bool)value;
+}
+
+void set_node_root(void*node, bool is_root){
+  uint8_t value = is_root;
+  *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
+}
+
 void initialize_leaf_node(void* node){
   set_node_type(node, NODE_LEAF);
+  set_node_root(node, false);
   *leaf_node_num_cells(node) = 0;
+  *leaf_node_next_leaf(node) = 0;  // 0表示没有下一个叶节点
 }
 
 /*
@@ -279,10 +916,6 @@ uint32_t* internal_node_key(void* node, uint32_t key_num) {
   return (void*)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
 }
 
-uint32_t* leaf_node_next_leaf(void*node){
-  return node + LEAF_NODE_NEXT_LEAF_OFFSET;
-}
-
 /*
 * 返回该节点最多能存放多少数据
 */
@@ -302,18 +935,18 @@ uint32_t get_node_max_key(void* node){
 uint32_t* node_parent(void* node) { return node + PARENT_POINTER_OFFSET; } 
 
 
-void print_constants() {
-  printf("ROW_SIZE: %d\n", ROW_SIZE);
-  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+void print_constants(FILE* output) {
+  fprintf(output, "ROW_SIZE: %d\n", ROW_SIZE);
+  fprintf(output, "COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+  fprintf(output, "LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+  fprintf(output, "LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
+  fprintf(output, "LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+  fprintf(output, "LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
 }
 
-void indent(uint32_t level){
+void indent(FILE* output, uint32_t level){
   for(uint32_t i = 0; i< level; i++){
-    printf("  ");
+    fprintf(output, "  ");
   }
 }
 
@@ -336,688 +969,5203 @@ void deserialize_row(void* source, Row* destination) {
   memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
 }
 
+ArenaBlock* arena_block_new(size_t capacity) {
+  ArenaBlock* block = malloc(ARENA_BLOCK_HEADER_SIZE + capacity);
+  block->next = NULL;
+  block->capacity = capacity;
+  block->used = 0;
+  return block;
+}
 
-uint32_t get_unused_page_num(Pager*pager){ return pager->num_pages;}
+Arena* arena_new() {
+  Arena* arena = malloc(sizeof(Arena));
+  arena->head = arena_block_new(ARENA_BLOCK_SIZE);
+  arena->current = arena->head;
+  return arena;
+}
 
-/*从存储器中获取某一页数据*/
-void* get_page(Pager* pager, uint32_t page_num) {
-  if (page_num > TABLE_MAX_PAGES) {
-    printf("Tried to fetch page number out of bounds. %d > %d\n", page_num,
-           TABLE_MAX_PAGES);
-    exit(EXIT_FAILURE);
+void arena_free(Arena* arena) {
+  ArenaBlock* block = arena->head;
+  while (block != NULL) {
+    ArenaBlock* next = block->next;
+    free(block);
+    block = next;
   }
+  free(arena);
+}
 
-  
-  if (pager->pages[page_num] == NULL) {
-    // 如果请求的页超出目前存储页数的范围则另外创建
-    void* page = malloc(PAGE_SIZE);
-    uint32_t num_pages = pager->file_length / PAGE_SIZE;
-
-    // 将它存放在文件末尾
-    if (pager->file_length % PAGE_SIZE) {
-      num_pages += 1;
-    }
-
-    //读取该页数据
-    if (page_num <= num_pages) {
-      lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-      ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-      if (bytes_read == -1) {
-        printf("Error reading file: %d\n", errno);
-        exit(EXIT_FAILURE);
-      }
-    }
-
-    pager->pages[page_num] = page;
-    
-    //更新page_num
-    if (page_num >= pager->num_pages) {
-      pager->num_pages = page_num + 1;
+/*
+ * 从arena分配size字节，按16字节对齐
+ * 当前块放不下时用后面的空闲块，空闲块也放不下时插入一个新块
+ */
+void* arena_alloc(Arena* arena, size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  ArenaBlock* block = arena->current;
+  while (block->used + size > block->capacity) {
+    ArenaBlock* next = block->next;
+    if (next == NULL || next->capacity < size) {
+      ArenaBlock* new_block =
+          arena_block_new(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+      new_block->next = next;
+      block->next = new_block;
+      next = new_block;
     }
+    next->used = 0;
+    block = next;
   }
+  arena->current = block;
+  void* pointer = (uint8_t*)block + ARENA_BLOCK_HEADER_SIZE + block->used;
+  block->used += size;
+  return pointer;
+}
 
-  return pager->pages[page_num];
+/*
+ * 记下当前位置，之后用arena_release把这之后分配的内存一次退回
+ */
+ArenaMark arena_mark(Arena* arena) {
+  ArenaMark mark;
+  mark.block = arena->current;
+  mark.used = arena->current->used;
+  return mark;
 }
 
+void arena_release(Arena* arena, ArenaMark mark) {
+  arena->current = mark.block;
+  arena->current->used = mark.used;
+}
 
+uint64_t now_nanoseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
 
-Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
-  void* node = get_page(table->pager, page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
+uint32_t histogram_bucket(uint64_t value) {
+  if (value < HISTOGRAM_SUB_BUCKETS) {
+    return value;
+  }
+  uint32_t shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BUCKET_BITS;
+  return (shift + 1) * HISTOGRAM_SUB_BUCKETS +
+         ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
 
-  Cursor* cursor = malloc(sizeof(Cursor));
-  cursor->table = table;
-  cursor->page_num = page_num;
+// 桶中最大的值
+uint64_t histogram_bucket_limit(uint32_t bucket) {
+  if (bucket < HISTOGRAM_SUB_BUCKETS) {
+    return bucket;
+  }
+  uint32_t shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+  uint64_t sub_bucket = bucket % HISTOGRAM_SUB_BUCKETS;
+  return ((HISTOGRAM_SUB_BUCKETS + sub_bucket + 1) << shift) - 1;
+}
 
-  // 二分查找
-  uint32_t start = 0;
-  uint32_t end = num_cells;
-  while (start != end) {
-    uint32_t index = (start + end) / 2;
-    uint32_t key_at_index = *leaf_node_key(node, index);
-    if (key == key_at_index) {
-      cursor->cell_num = index;
-      return cursor;
-    }
-    if (key < key_at_index) {
-      end = index;
-    } else {
-      start = index + 1;
+void histogram_record(LatencyHistogram* histogram, uint64_t value) {
+  __atomic_add_fetch(&(histogram->buckets[histogram_bucket(value)]), 1,
+                     __ATOMIC_RELAXED);
+  __atomic_add_fetch(&(histogram->count), 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&(histogram->total), value, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&(histogram->max), __ATOMIC_RELAXED);
+  while (value > max &&
+         !__atomic_compare_exchange_n(&(histogram->max), &max, value, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+/*
+ * 第fraction分位的延迟，返回所在桶的上界(不超过记录到的最大值)
+ * 读的同时可能有会话在记录，结果是近似值
+ */
+uint64_t histogram_percentile(LatencyHistogram* histogram, double fraction) {
+  uint64_t count = __atomic_load_n(&(histogram->count), __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&(histogram->max), __ATOMIC_RELAXED);
+  uint64_t rank = (uint64_t)(fraction * count + 0.999999);
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += __atomic_load_n(&(histogram->buckets[i]), __ATOMIC_RELAXED);
+    if (seen >= rank) {
+      uint64_t limit = histogram_bucket_limit(i);
+      return limit < max ? limit : max;
     }
   }
-  
-  cursor->cell_num = start;
-  return cursor;
+  return max;
 }
 
- uint32_t internal_node_find_child(void* node, uint32_t key){
-  /*
+void print_histogram(FILE* output, const char* type, const char* phase,
+                     LatencyHistogram* histogram) {
+  uint64_t count = __atomic_load_n(&(histogram->count), __ATOMIC_RELAXED);
+  if (count == 0) {
+    return;
+  }
+  uint64_t total = __atomic_load_n(&(histogram->total), __ATOMIC_RELAXED);
+  fprintf(output,
+          "%s %s: count %llu, avg %.1f, p50 %.1f, p90 %.1f, p99 %.1f, "
+          "p999 %.1f, max %.1f\n",
+          type, phase, (unsigned long long)count, total / 1e3 / count,
+          histogram_percentile(histogram, 0.50) / 1e3,
+          histogram_percentile(histogram, 0.90) / 1e3,
+          histogram_percentile(histogram, 0.99) / 1e3,
+          histogram_percentile(histogram, 0.999) / 1e3,
+          __atomic_load_n(&(histogram->max), __ATOMIC_RELAXED) / 1e3);
+}
 
-  */
+/*
+ * .stats输出每种语句解析和执行耗时的分布，单位微秒
+ */
+void print_statement_stats(FILE* output, StatementStats* stats) {
+  fprintf(output, "Statement latency (us):\n");
+  for (uint32_t type = 0; type < STATEMENT_TYPE_COUNT; type++) {
+    print_histogram(output, STATEMENT_TYPE_NAMES[type], "parse",
+                    &(stats->parse[type]));
+    print_histogram(output, STATEMENT_TYPE_NAMES[type], "execute",
+                    &(stats->execute[type]));
+  }
+}
 
-  uint32_t num_keys = *internal_node_num_keys(node);
-  uint32_t low = 0;
-  uint32_t high = num_keys;
 
-  while (low != high){
-    uint32_t mid = (low + high) / 2;
-    uint32_t key_to_right = *internal_node_key(node, mid);
-    if (key_to_right >= key){
-      high = mid;
-    }else{
-      low = mid + 1;
-    }
-  }
+/*
+ * 分配一个新页，多个写线程同时分配时不会拿到同一页
+ */
+void pager_count(uint64_t* counter, uint64_t value) {
+  __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
 
-  return low;
+uint32_t get_unused_page_num(Pager* pager) {
+  pager_count(&(pager->stats.pages_allocated), 1);
+  pthread_mutex_lock(&(pager->lock));
+  // 页号0同时表示没有下一个叶节点，页号不能绕回去
+  if (pager->num_pages == UINT32_MAX) {
+    printf("Database is full.\n");
+    exit(EXIT_FAILURE);
+  }
+  uint32_t page_num = pager->num_pages;
+  pager->num_pages += 1;
+  pthread_mutex_unlock(&(pager->lock));
+  return page_num;
 }
 
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key) {
-  void* node = get_page(table->pager, page_num);
+/*
+ * 页表: 按页号找到一页的页表项
+ * 页号依次索引根目录、中间目录和页表块，目录和块在第一次用到时才分配，
+ * 数据库再大也只为访问过的页占用内存；分配后直到关闭都不释放，所以查找不加锁
+ */
+PageEntry* page_entry(Pager* pager, uint32_t page_num) {
+  uint32_t chunk_pages = 1 << PAGE_TABLE_CHUNK_BITS;
+  PageEntry*** root_slot = &(pager->page_table[page_num >> (PAGE_TABLE_CHUNK_BITS +
+                                                           PAGE_TABLE_DIRECTORY_BITS)]);
+  uint32_t directory_index = (page_num >> PAGE_TABLE_CHUNK_BITS) &
+                             ((1 << PAGE_TABLE_DIRECTORY_BITS) - 1);
+  PageEntry** directory = __atomic_load_n(root_slot, __ATOMIC_ACQUIRE);
+  if (directory != NULL) {
+    PageEntry* chunk =
+        __atomic_load_n(&(directory[directory_index]), __ATOMIC_ACQUIRE);
+    if (chunk != NULL) {
+      return &(chunk[page_num & (chunk_pages - 1)]);
+    }
+  }
 
-  uint32_t child_index = internal_node_find_child(node, key);
-  uint32_t child_num = *internal_node_child(node, child_index);
-  void* child = get_page(table->pager, child_num);
-  switch (get_node_type(child)) {
-    case NODE_LEAF:
-      return leaf_node_find(table, child_num, key);
-    case NODE_INTERNAL:
-      return internal_node_find(table, child_num, key);
+  pthread_mutex_lock(&(pager->page_table_lock));
+  directory = *root_slot;
+  if (directory == NULL) {
+    directory = calloc(1 << PAGE_TABLE_DIRECTORY_BITS, sizeof(PageEntry*));
+    __atomic_store_n(root_slot, directory, __ATOMIC_RELEASE);
+  }
+  PageEntry* chunk = directory[directory_index];
+  if (chunk == NULL) {
+    chunk = calloc(chunk_pages, sizeof(PageEntry));
+    for (uint32_t i = 0; i < chunk_pages; i++) {
+      pthread_rwlock_init(&(chunk[i].latch), NULL);
+    }
+    __atomic_store_n(&(directory[directory_index]), chunk, __ATOMIC_RELEASE);
+    uint64_t chunk_end = (uint64_t)(page_num & ~(chunk_pages - 1)) + chunk_pages;
+    if (chunk_end > pager->page_table_limit) {
+      pager->page_table_limit = chunk_end;
+    }
   }
+  pthread_mutex_unlock(&(pager->page_table_lock));
+  return &(chunk[page_num & (chunk_pages - 1)]);
 }
 
-bool is_node_root(void*node){
-  uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
-  return (bool)value;
+/*
+ * 从first_page_num开始的一个页表块，还没有分配时返回NULL
+ * 遍历缓存中的页时按块跳过从来没有访问过的页号
+ */
+PageEntry* page_table_chunk(Pager* pager, uint64_t first_page_num) {
+  PageEntry** directory = __atomic_load_n(
+      &(pager->page_table[first_page_num >>
+                          (PAGE_TABLE_CHUNK_BITS + PAGE_TABLE_DIRECTORY_BITS)]),
+      __ATOMIC_ACQUIRE);
+  if (directory == NULL) {
+    return NULL;
+  }
+  return __atomic_load_n(
+      &(directory[(first_page_num >> PAGE_TABLE_CHUNK_BITS) &
+                  ((1 << PAGE_TABLE_DIRECTORY_BITS) - 1)]),
+      __ATOMIC_ACQUIRE);
 }
 
-void set_node_root(void*node, bool is_root){
-  uint8_t value = is_root;
-  *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
+void page_table_free(Pager* pager) {
+  uint32_t root_entries =
+      1 << (32 - PAGE_TABLE_CHUNK_BITS - PAGE_TABLE_DIRECTORY_BITS);
+  uint32_t directory_entries = 1 << PAGE_TABLE_DIRECTORY_BITS;
+  uint32_t chunk_pages = 1 << PAGE_TABLE_CHUNK_BITS;
+  for (uint32_t i = 0; i < root_entries; i++) {
+    PageEntry** directory = pager->page_table[i];
+    for (uint32_t j = 0; directory != NULL && j < directory_entries; j++) {
+      PageEntry* chunk = directory[j];
+      for (uint32_t k = 0; chunk != NULL && k < chunk_pages; k++) {
+        pthread_rwlock_destroy(&(chunk[k].latch));
+      }
+      free(chunk);
+    }
+    free(directory);
+  }
+  free(pager->page_table);
+  pthread_mutex_destroy(&(pager->page_table_lock));
 }
 
-void initialize_internal_node(void* node) {
-  set_node_type(node, NODE_INTERNAL);
-  set_node_root(node, false);
-  *internal_node_num_keys(node) = 0;
-  *leaf_node_next_leaf(node) = 0;
+/*
+ * 共享页缓存
+ * 读: 帧中是这一页时直接复制，复制前后sequence不变才有效；
+ * 填充: 把自己从文件读到的页放进对应的帧，替换原来的页，别的进程正在写这一帧时放弃
+ * 发布修改时持有LOCK_DATA_BYTE的写锁，这时其他进程都不会读写共享缓存，publish为true时直接覆盖，
+ * 本进程内的加载和发布都在pager->lock下进行
+ */
+bool shared_cache_read(Pager* pager, uint32_t page_num, void* page) {
+  uint32_t index = page_num % SHARED_CACHE_PAGES;
+  SharedFrame* frame = &(pager->shared_header->frames[index]);
+  uint32_t sequence = __atomic_load_n(&(frame->sequence), __ATOMIC_ACQUIRE);
+  if (sequence == 0 || sequence % 2 == 1 ||
+      __atomic_load_n(&(frame->page_num), __ATOMIC_RELAXED) != page_num) {
+    return false;
+  }
+  memcpy(page, pager->shared_frames + (size_t)index * PAGE_SIZE, PAGE_SIZE);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&(frame->sequence), __ATOMIC_RELAXED) == sequence;
 }
 
+void shared_cache_fill(Pager* pager, uint32_t page_num, void* page,
+                       bool publish) {
+  uint32_t index = page_num % SHARED_CACHE_PAGES;
+  SharedFrame* frame = &(pager->shared_header->frames[index]);
+  uint32_t sequence = __atomic_load_n(&(frame->sequence), __ATOMIC_RELAXED);
+  if (publish) {
+    // 上次写这一帧的进程可能中途退出，留下奇数
+    sequence |= 1;
+    __atomic_store_n(&(frame->sequence), sequence, __ATOMIC_RELAXED);
+  } else {
+    if (sequence % 2 == 1 ||
+        (sequence != 0 &&
+         __atomic_load_n(&(frame->page_num), __ATOMIC_RELAXED) == page_num) ||
+        !__atomic_compare_exchange_n(&(frame->sequence), &sequence,
+                                     sequence + 1, false, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED)) {
+      return;
+    }
+    sequence += 1;
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&(frame->page_num), page_num, __ATOMIC_RELAXED);
+  memcpy(pager->shared_frames + (size_t)index * PAGE_SIZE, page, PAGE_SIZE);
+  __atomic_store_n(&(frame->sequence), sequence + 1, __ATOMIC_RELEASE);
+}
 
 /*
- * 创建新的根节点
+ * 页帧池
+ * 页缓存、草稿和旧版本的页都从这里分配: 每次用mmap向系统申请FRAME_CHUNK_PAGES个页对齐的帧，
+ * 按需切出，释放的帧挂回空闲链表复用，稳定运行时不再调用malloc/free
+ * 系统支持透明大页时建议内核用大页映射整块，减少TLB缺失
  */
-void create_new_root(Table*table, uint32_t right_child_page_num){
-
-  /*
-  * 分割旧的根节点，为旧节点创建新的page变为左子节点，剩余部分变为右子节点
-  * 重新生成一个带有左右子树的新节点
-  * 
-  */
+void* frame_alloc(Pager* pager) {
+  pthread_mutex_lock(&(pager->frame_lock));
+  void* frame = pager->free_frames;
+  if (frame != NULL) {
+    pager->free_frames = *(void**)frame;
+    pthread_mutex_unlock(&(pager->frame_lock));
+    return frame;
+  }
 
-  void* root = get_page(table->pager, table->root_page_num);
-  void* right_child = get_page(table->pager, right_child_page_num);
-  uint32_t left_child_page_num = get_unused_page_num(table->pager);
-  void* left_child = get_page(table->pager, left_child_page_num);
-
-  /*为旧节点创建新的page变为左子节点*/
-  memcpy(left_child, root, PAGE_SIZE);
-  set_node_root(left_child, false);
-
-  /*
-   * 初始化为内部节点
-   */
-  initialize_internal_node(root);
-  set_node_root(root, true);
-  *internal_node_num_keys(root) = 1;
-  *internal_node_child(root, 0) = left_child_page_num;
-  uint32_t left_child_max_key = get_node_max_key(left_child);
-  *internal_node_key(root, 0) = left_child_max_key;
-  *internal_node_right_child(root) = right_child_page_num;
-  *node_parent(left_child) = table->root_page_num;
-  *node_parent(right_child) = table->root_page_num;
+  if (pager->num_frame_chunks == 0 ||
+      pager->frame_chunk_used == FRAME_CHUNK_PAGES) {
+    size_t chunk_size = (size_t)FRAME_CHUNK_PAGES * PAGE_SIZE;
+    uint8_t* chunk = mmap(NULL, chunk_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED) {
+      printf("Error allocating page frames: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(chunk, chunk_size, MADV_HUGEPAGE);
+#endif
+    pager->frame_chunks =
+        realloc(pager->frame_chunks,
+                (pager->num_frame_chunks + 1) * sizeof(uint8_t*));
+    pager->frame_chunks[pager->num_frame_chunks] = chunk;
+    pager->num_frame_chunks += 1;
+    pager->frame_chunk_used = 0;
+  }
+  frame = pager->frame_chunks[pager->num_frame_chunks - 1] +
+          (size_t)pager->frame_chunk_used * PAGE_SIZE;
+  pager->frame_chunk_used += 1;
+  pthread_mutex_unlock(&(pager->frame_lock));
+  return frame;
 }
 
-Cursor* table_find(Table*table, uint32_t key){
-  uint32_t root_page_num = table->root_page_num;
-  void* root_node = get_page(table->pager, root_page_num);
-
-  if (get_node_type(root_node) == NODE_LEAF){
-    return leaf_node_find(table, root_page_num, key);
-  }else{
-    return internal_node_find(table, root_page_num, key);
+void frame_free(Pager* pager, void* frame) {
+  if (frame == NULL) {
+    return;
   }
+  pthread_mutex_lock(&(pager->frame_lock));
+  *(void**)frame = pager->free_frames;
+  pager->free_frames = frame;
+  pthread_mutex_unlock(&(pager->frame_lock));
 }
 
-void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num){
-  void* parent = get_page(table->pager, parent_page_num);
-  void* child = get_page(table->pager, child_page_num);
-  uint32_t child_max_key = get_node_max_key(child);
-  uint32_t index = internal_node_find_child(parent, child_max_key);
+ssize_t io_request_run(int fd, IoRequest* request) {
+  ssize_t result =
+      request->write
+          ? pwritev(fd, request->iov, request->num_iov, request->offset)
+          : preadv(fd, request->iov, request->num_iov, request->offset);
+  return result == -1 ? -errno : result;
+}
 
-  uint32_t original_num_keys = *internal_node_num_keys(parent);
-  *internal_node_num_keys(parent) = original_num_keys + 1;
-  if(original_num_keys >= INTERNAL_NODE_MAX_CELLS){
-    printf("Need to implement splitting internal node\n");
-    exit(EXIT_FAILURE);
+/*
+ * 线程池: 领取队列头部那一批中的下一个请求并执行，调用前后都持有io->lock
+ */
+void io_run_queued(IoBackend* io) {
+  IoBatch* batch = io->queue_head;
+  IoRequest* request = &(batch->requests[batch->next]);
+  batch->next += 1;
+  if (batch->next == batch->num_requests) {
+    io->queue_head = batch->next_batch;
+    if (io->queue_head == NULL) {
+      io->queue_tail = NULL;
+    }
   }
+  pthread_mutex_unlock(&(io->lock));
+  request->result = io_request_run(io->fd, request);
+  pthread_mutex_lock(&(io->lock));
+  batch->num_done += 1;
+  if (batch->num_done == batch->num_requests) {
+    if (batch->complete != NULL) {
+      // 这一批已经出队，其他线程不会再访问它
+      pthread_mutex_unlock(&(io->lock));
+      batch->complete(batch);
+      pthread_mutex_lock(&(io->lock));
+    } else {
+      pthread_cond_broadcast(&(io->done));
+    }
+  }
+}
 
-  uint32_t right_child_page_num = *internal_node_right_child(parent);
-  void* right_child = get_page(table->pager, right_child_page_num);
+void* io_worker(void* argument) {
+  IoBackend* io = argument;
+  pthread_mutex_lock(&(io->lock));
+  while (true) {
+    while (io->queue_head == NULL && !io->stopping) {
+      pthread_cond_wait(&(io->work), &(io->lock));
+    }
+    if (io->queue_head == NULL) {
+      break;
+    }
+    io_run_queued(io);
+  }
+  pthread_mutex_unlock(&(io->lock));
+  return NULL;
+}
 
-  if(child_max_key > get_node_max_key(right_child)){
-    *internal_node_child(parent, original_num_keys) = right_child_page_num;
-    *internal_node_key(parent, original_num_keys) = get_node_max_key(right_child);
-    *internal_node_right_child(parent) = child_page_num;
-  }else{
-    for (uint32_t i = original_num_keys; i > index; i--) {
-      void* destination = internal_node_cell(parent, i);
-      void* source = internal_node_cell(parent, i - 1);
-      memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
+/*
+ * 线程池: 把一批请求放进队列，提交的线程也一起执行队列中的请求，直到自己这一批全部完成
+ */
+void io_pool_submit(IoBackend* io, IoRequest* requests, uint32_t num_requests) {
+  IoBatch batch = {requests, num_requests, 0, 0, NULL, NULL};
+  pthread_mutex_lock(&(io->lock));
+  if (io->queue_tail == NULL) {
+    io->queue_head = &batch;
+  } else {
+    io->queue_tail->next_batch = &batch;
+  }
+  io->queue_tail = &batch;
+  pthread_cond_broadcast(&(io->work));
+  while (batch.num_done < num_requests) {
+    if (io->queue_head != NULL) {
+      io_run_queued(io);
+    } else {
+      pthread_cond_wait(&(io->done), &(io->lock));
     }
-    *internal_node_child(parent, index) = child_page_num;
-    *internal_node_key(parent, index) = child_max_key;
   }
+  pthread_mutex_unlock(&(io->lock));
 }
 
-void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key) {
-  uint32_t old_child_index = internal_node_find_child(node, old_key);
-  *internal_node_key(node, old_child_index) = new_key;
+/*
+ * 线程池: 把一批请求放进队列后马上返回，全部完成后I/O线程调用batch->complete
+ */
+void io_pool_submit_async(IoBackend* io, IoBatch* batch) {
+  pthread_mutex_lock(&(io->lock));
+  batch->next_batch = NULL;
+  if (io->queue_tail == NULL) {
+    io->queue_head = batch;
+  } else {
+    io->queue_tail->next_batch = batch;
+  }
+  io->queue_tail = batch;
+  pthread_cond_broadcast(&(io->work));
+  pthread_mutex_unlock(&(io->lock));
 }
 
+#ifdef DB_URING
 /*
- * 初始化游标
- * 返回一个指向初始位置的游标
+ * 建立io_uring，映射提交队列、完成队列和SQE数组，失败时返回false
  */
-Cursor* table_start(Table* table) {
-  Cursor*cursor = table_find(table, 0);
+bool io_uring_open(IoBackend* io) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  io->uring_fd = syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &params);
+  if (io->uring_fd < 0) {
+    return false;
+  }
 
-  void* node = get_page(table->pager, cursor->page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  cursor->end_of_table = (num_cells == 0);
+  io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  io->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  // 新内核中两个环在同一块映射里
+  bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap && io->cq_ring_size > io->sq_ring_size) {
+    io->sq_ring_size = io->cq_ring_size;
+  }
+  io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, io->uring_fd, IORING_OFF_SQ_RING);
+  if (io->sq_ring == MAP_FAILED) {
+    close(io->uring_fd);
+    return false;
+  }
+  io->cq_ring = io->sq_ring;
+  if (!single_mmap) {
+    io->cq_ring =
+        mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, io->uring_fd, IORING_OFF_CQ_RING);
+  }
+  io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, io->uring_fd, IORING_OFF_SQES);
+  if (io->cq_ring == MAP_FAILED || io->sqes == MAP_FAILED) {
+    printf("Error mapping io_uring: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
 
-  return cursor;
+  uint8_t* sq = io->sq_ring;
+  io->sq_tail = (uint32_t*)(sq + params.sq_off.tail);
+  io->sq_mask = (uint32_t*)(sq + params.sq_off.ring_mask);
+  io->sq_array = (uint32_t*)(sq + params.sq_off.array);
+  uint8_t* cq = io->cq_ring;
+  io->cq_head = (uint32_t*)(cq + params.cq_off.head);
+  io->cq_tail = (uint32_t*)(cq + params.cq_off.tail);
+  io->cq_mask = (uint32_t*)(cq + params.cq_off.ring_mask);
+  io->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  pthread_mutex_init(&(io->uring_lock), NULL);
+  return true;
 }
 
 /*
- * 返回游标所指的键值对中的值
+ * io_uring: 每轮把还没提交的请求尽量放满提交队列，提交并至少等待一个完成，再收割完成队列
+ * 在途的请求数不超过队列深度，完成队列(是提交队列的两倍大)不会溢出
  */
-void* cursor_value(Cursor* cursor) {
-  uint32_t page_num = cursor->page_num;
-  void* page = get_page(cursor->table->pager, page_num);
-  return leaf_node_value(page, cursor->cell_num);
-}
+void io_uring_submit(IoBackend* io, IoRequest* requests, uint32_t num_requests) {
+  pthread_mutex_lock(&(io->uring_lock));
+  uint32_t num_submitted = 0;
+  uint32_t num_completed = 0;
+  uint32_t num_pending = 0;
+  while (num_completed < num_requests) {
+    uint32_t tail = *(io->sq_tail);
+    while (num_submitted < num_requests &&
+           num_submitted - num_completed < IO_URING_ENTRIES) {
+      IoRequest* request = &(requests[num_submitted]);
+      uint32_t index = tail & *(io->sq_mask);
+      struct io_uring_sqe* sqe = &(io->sqes[index]);
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+      sqe->fd = io->fd;
+      sqe->off = request->offset;
+      sqe->addr = (uint64_t)(uintptr_t)request->iov;
+      sqe->len = request->num_iov;
+      sqe->user_data = num_submitted;
+      io->sq_array[index] = index;
+      tail += 1;
+      num_submitted += 1;
+      num_pending += 1;
+    }
+    __atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
 
-void cursor_advance(Cursor* cursor) {
-  uint32_t page_num = cursor->page_num;
-  void* node = get_page(cursor->table->pager, page_num);
+    int submitted = syscall(__NR_io_uring_enter, io->uring_fd, num_pending, 1,
+                            IORING_ENTER_GETEVENTS, NULL, 0);
+    if (submitted < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Error submitting io_uring requests: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    num_pending -= submitted;
+
+    uint32_t head = *(io->cq_head);
+    uint32_t cq_tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != cq_tail) {
+      struct io_uring_cqe* cqe = &(io->cqes[head & *(io->cq_mask)]);
+      requests[cqe->user_data].result = cqe->res;
+      head += 1;
+      num_completed += 1;
+    }
+    __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&(io->uring_lock));
+}
+#endif
+
+void io_backend_open(IoBackend* io, int fd) {
+  io->fd = fd;
+  io->uring = false;
+  io->threads = NULL;
+  io->num_threads = 0;
+  io->queue_head = NULL;
+  io->queue_tail = NULL;
+  io->stopping = false;
+  pthread_mutex_init(&(io->lock), NULL);
+  pthread_cond_init(&(io->work), NULL);
+  pthread_cond_init(&(io->done), NULL);
+#ifdef DB_URING
+  io->uring = io_uring_open(io);
+#endif
+  io->threads = malloc(IO_POOL_THREADS * sizeof(pthread_t));
+  for (uint32_t i = 0; i < IO_POOL_THREADS; i++) {
+    if (pthread_create(&(io->threads[i]), NULL, io_worker, io) != 0) {
+      break;
+    }
+    io->num_threads += 1;
+  }
+}
 
-  cursor->cell_num += 1;
-  if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
-    uint32_t next_page_num = *leaf_node_next_leaf(node);
-    if (next_page_num == 0){
-      cursor->end_of_table = true;
-    }else{
-      cursor->page_num = next_page_num;
-      cursor->cell_num = 0;
+void io_backend_close(IoBackend* io) {
+  pthread_mutex_lock(&(io->lock));
+  io->stopping = true;
+  pthread_cond_broadcast(&(io->work));
+  pthread_mutex_unlock(&(io->lock));
+  for (uint32_t i = 0; i < io->num_threads; i++) {
+    pthread_join(io->threads[i], NULL);
+  }
+  free(io->threads);
+#ifdef DB_URING
+  if (io->uring) {
+    munmap(io->sqes, io->sqes_size);
+    if (io->cq_ring != io->sq_ring) {
+      munmap(io->cq_ring, io->cq_ring_size);
     }
-    
+    munmap(io->sq_ring, io->sq_ring_size);
+    close(io->uring_fd);
+    pthread_mutex_destroy(&(io->uring_lock));
   }
+#endif
+  pthread_mutex_destroy(&(io->lock));
+  pthread_cond_destroy(&(io->work));
+  pthread_cond_destroy(&(io->done));
 }
 
 /*
- * 打开数据库文件
- * 将文件转成Pager对象
+ * 提交一批页I/O请求，全部完成后返回，每个请求的结果在result中
+ * 只有一个请求时直接在当前线程执行
  */
-Pager* pager_open(const char* filename) {
-  int fd = open(filename,
-                O_RDWR |      
-                    O_CREAT,  
-                S_IWUSR |     
-                    S_IRUSR   
-                );
-
-  if (fd == -1) {
-    printf("Unable to open file\n");
-    exit(EXIT_FAILURE);
+void pager_submit(Pager* pager, IoRequest* requests, uint32_t num_requests) {
+  IoBackend* io = &(pager->io);
+  if (num_requests == 0) {
+    return;
   }
-
-  off_t file_length = lseek(fd, 0, SEEK_END);
-
-  Pager* pager = malloc(sizeof(Pager));
-  pager->file_descriptor = fd;
-  pager->file_length = file_length;
-  pager->num_pages = (file_length / PAGE_SIZE);
-
-  if (file_length % PAGE_SIZE != 0) {
-    printf("Db file is not a whole number of pages. Corrupt file.\n");
-    exit(EXIT_FAILURE);
+#ifdef DB_URING
+  if (io->uring) {
+    io_uring_submit(io, requests, num_requests);
+    return;
+  }
+#endif
+  if (num_requests == 1 || io->num_threads == 0) {
+    for (uint32_t i = 0; i < num_requests; i++) {
+      requests[i].result = io_request_run(io->fd, &(requests[i]));
+    }
+    return;
   }
+  io_pool_submit(io, requests, num_requests);
+}
 
-  // 将缓存清空为NULL
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    pager->pages[i] = NULL;
+/*
+ * 推进淘汰纪元，调用时持有evict_lock
+ * 快照读不加页锁，页帧被淘汰之后，淘汰之前开始的事务可能还在读它，所以不能马上放回页帧池:
+ * 淘汰的页帧挂在当前纪元上，每个事务在开始时登记自己所在的纪元；
+ * 上一个纪元开始的事务都结束后纪元才能推进，这时上一个纪元淘汰的页帧已经没有事务能读到，放回页帧池
+ * 长时间不结束的事务(打开的游标、显式事务)会推迟回收，和快照推迟回收旧版本一样
+ */
+bool pager_advance_epoch(Pager* pager) {
+  uint32_t previous = (pager->evict_epoch + 1) & 1;
+  if (pager->epoch_transactions[previous] != 0) {
+    return false;
+  }
+  for (uint32_t i = 0; i < pager->num_evicted_frames[previous]; i++) {
+    frame_free(pager, pager->evicted_frames[previous][i]);
   }
+  pager->num_evicted_frames[previous] = 0;
+  pager->evict_epoch += 1;
+  return true;
+}
 
-  return pager;
+/*
+ * 页缓存超出cache_pages时用时钟算法淘汰页，直到回到上限以内或者检查了max_steps个缓存中的页，调用时持有lock
+ * 最近访问过的页清除referenced后跳过；只淘汰干净的页，以下几种都跳过:
+ * 有草稿或旧版本的页、正在预读的页、提交后还没有写回文件的页(seq > checkpoint_seq)、
+ * 文件中还没有的页，以及加了页锁的页(用trywrlock判断，淘汰期间拿着写锁)
+ * seq留在页表项中，之后重新读入时预读和快照读仍然知道这一页是哪次提交的版本
+ * 找不到可以淘汰的页时缓存暂时超出上限，下一次从时钟指针停下的位置继续
+ */
+void pager_evict(Pager* pager, uint64_t max_steps) {
+  uint32_t chunk_pages = 1 << PAGE_TABLE_CHUNK_BITS;
+  uint64_t file_pages = pager->file_length / PAGE_SIZE;
+  uint64_t limit = pager->page_table_limit;
+  pthread_mutex_lock(&(pager->evict_lock));
+  uint32_t current = pager->evict_epoch & 1;
+  bool evicted = false;
+  uint64_t steps = 0;
+  for (uint64_t visited = 0; steps < max_steps && visited < 2 * limit &&
+                             __atomic_load_n(&(pager->num_cached_pages),
+                                             __ATOMIC_RELAXED) > pager->cache_pages;
+       visited++) {
+    if (pager->clock_hand >= limit) {
+      pager->clock_hand = 0;
+    }
+    uint64_t page_num = pager->clock_hand;
+    pager->clock_hand += 1;
+    PageEntry* chunk = page_table_chunk(pager, page_num & ~(uint64_t)(chunk_pages - 1));
+    if (chunk == NULL) {
+      // 整块都不在缓存中，跳到下一块
+      pager->clock_hand = (page_num | (chunk_pages - 1)) + 1;
+      continue;
+    }
+    PageEntry* entry = &(chunk[page_num & (chunk_pages - 1)]);
+    void* page = __atomic_load_n(&(entry->page), __ATOMIC_ACQUIRE);
+    if (page == NULL) {
+      continue;
+    }
+    steps += 1;
+    if (__atomic_load_n(&(entry->referenced), __ATOMIC_RELAXED)) {
+      __atomic_store_n(&(entry->referenced), false, __ATOMIC_RELAXED);
+      continue;
+    }
+    if (__atomic_load_n(&(entry->draft), __ATOMIC_ACQUIRE) != NULL ||
+        entry->versions != NULL || entry->reading || page_num >= file_pages ||
+        __atomic_load_n(&(entry->seq), __ATOMIC_ACQUIRE) > pager->checkpoint_seq ||
+        pthread_rwlock_trywrlock(&(entry->latch)) != 0) {
+      continue;
+    }
+    __atomic_store_n(&(entry->page), NULL, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&(entry->latch));
+    __atomic_sub_fetch(&(pager->num_cached_pages), 1, __ATOMIC_RELAXED);
+    pager_count(&(pager->stats.cache_evictions), 1);
+    if (pager->num_evicted_frames[current] ==
+        pager->evicted_frames_capacity[current]) {
+      pager->evicted_frames_capacity[current] =
+          pager->evicted_frames_capacity[current]
+              ? pager->evicted_frames_capacity[current] * 2
+              : 64;
+      pager->evicted_frames[current] =
+          realloc(pager->evicted_frames[current],
+                  pager->evicted_frames_capacity[current] * sizeof(void*));
+    }
+    pager->evicted_frames[current][pager->num_evicted_frames[current]] = page;
+    pager->num_evicted_frames[current] += 1;
+    evicted = true;
+  }
+  for (uint32_t i = 0; evicted && i < 2 && pager_advance_epoch(pager); i++) {
+  }
+  pthread_mutex_unlock(&(pager->evict_lock));
 }
 
 /*
- * 打开数据库文件，将其封装成Pager对象
- * 再将Pager对象封装成Table对象
+ * 一页放入缓存之后调用，调用时持有lock
  */
-Table* db_open(const char* filename) {
-  Pager* pager = pager_open(filename);
+void pager_cache_insert(Pager* pager, PageEntry* entry) {
+  __atomic_store_n(&(entry->referenced), true, __ATOMIC_RELAXED);
+  if (__atomic_add_fetch(&(pager->num_cached_pages), 1, __ATOMIC_RELAXED) >
+      pager->cache_pages) {
+    pager_evict(pager, PAGE_CACHE_EVICT_SCAN);
+  }
+}
 
-  Table* table = malloc(sizeof(Table));
-  table->pager = pager;
-  table->root_page_num = 0;
+/*从存储器中获取某一页数据*/
+void* get_page(Pager* pager, uint32_t page_num) {
+  PageEntry* entry = page_entry(pager, page_num);
+
+  // 命中缓存时不加锁，多个读线程可以同时访问
+  void* page = __atomic_load_n(&(entry->page), __ATOMIC_ACQUIRE);
+  if (page != NULL) {
+    // 已经置位时不再写，热点页的缓存行不会在线程之间来回传递
+    if (!__atomic_load_n(&(entry->referenced), __ATOMIC_RELAXED)) {
+      __atomic_store_n(&(entry->referenced), true, __ATOMIC_RELAXED);
+    }
+    pager_count(&(pager->stats.cache_hits), 1);
+    DB_PROBE1(page__hit, page_num);
+    return page;
+  }
 
-  if (pager->num_pages == 0) {
-    //如果是一个空文件则自动创建一页作为BTree的根节点
-    void* root_node = get_page(pager, 0);
-    initialize_leaf_node(root_node);
-    set_node_root(root_node, true);
+  pthread_mutex_lock(&(pager->lock));
+  while (entry->page == NULL && entry->reading) {
+    pthread_cond_wait(&(pager->readahead_done), &(pager->lock));
   }
+  if (entry->page == NULL) {
+    pager_count(&(pager->stats.cache_misses), 1);
+    uint64_t probe_start = DB_PROBE_CLOCK(page__miss);
+    // 如果请求的页超出目前存储页数的范围则另外创建
+    page = frame_alloc(pager);
+    off_t num_pages = pager->file_length / PAGE_SIZE;
 
-  return table;
-}
+    // 将它存放在文件末尾
+    if (pager->file_length % PAGE_SIZE) {
+      num_pages += 1;
+    }
 
+    //读取该页数据
+    if (pager->shared && shared_cache_read(pager, page_num, page)) {
+      // 其他进程已经读过这一页
+    } else if (page_num <= num_pages) {
+      ssize_t bytes_read = pread(pager->file_descriptor, page, PAGE_SIZE,
+                                 (off_t)page_num * PAGE_SIZE);
+      if (bytes_read == -1) {
+        printf("Error reading file: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+      pager_count(&(pager->stats.file_reads), 1);
+      pager_count(&(pager->stats.file_read_bytes), bytes_read);
+      if (pager->shared && bytes_read == PAGE_SIZE) {
+        shared_cache_fill(pager, page_num, page, false);
+      }
+    }
 
-InputBuffer* new_input_buffer() {
-  InputBuffer* input_buffer = malloc(sizeof(InputBuffer));
-  input_buffer->buffer = NULL;
-  input_buffer->buffer_length = 0;
-  input_buffer->input_length = 0;
+    __atomic_store_n(&(entry->page), page, __ATOMIC_RELEASE);
+    DB_PROBE2(page__miss, page_num, DB_PROBE_ELAPSED(probe_start));
+    
+    //更新page_num
+    if (page_num >= pager->num_pages) {
+      pager->num_pages = page_num + 1;
+    }
+    // 缓存中都是不能淘汰的页时，扫描第二圈可能把刚放入的页也淘汰掉，返回局部变量中的页
+    pager_cache_insert(pager, entry);
+  } else {
+    page = entry->page;
+  }
+  pthread_mutex_unlock(&(pager->lock));
 
-  return input_buffer;
+  return page;
 }
 
-void print_prompt() { printf("db > "); }
 
 /*
- * 分词器Tokenizer
+ * 页锁
+ * 查找时从根往下"螃蟹式"加锁: 先锁住子节点再释放父节点
  */
-void read_input(InputBuffer* input_buffer) {
-  // 从输入流中读取一行内容
-  ssize_t bytes_read =
-      getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
-
-  if (bytes_read <= 0) {
-    printf("Error reading input\n");
-    exit(EXIT_FAILURE);
+void pager_latch(Pager* pager, uint32_t page_num, LatchMode mode) {
+  PageEntry* entry = page_entry(pager, page_num);
+  if (mode == LATCH_SHARED) {
+    pthread_rwlock_rdlock(&(entry->latch));
+  } else {
+    pthread_rwlock_wrlock(&(entry->latch));
   }
-
-  // 去掉换行部分
-  input_buffer->input_length = bytes_read - 1;
-  input_buffer->buffer[bytes_read - 1] = 0;
 }
 
-/*
- * 写入数据到磁盘
- */
-void pager_flush(Pager* pager, uint32_t page_num) {
-  if (pager->pages[page_num] == NULL) {
-    printf("Tried to flush null page\n");
-    exit(EXIT_FAILURE);
-  }
+void pager_unlatch(Pager* pager, uint32_t page_num) {
+  pthread_rwlock_unlock(&(page_entry(pager, page_num)->latch));
+}
 
-  off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+void latch_set_init(LatchSet* latches) {
+  latches->page_nums = latches->inline_page_nums;
+  latches->count = 0;
+  latches->capacity = BTREE_MAX_DEPTH;
+}
 
-  if (offset == -1) {
-    printf("Error seeking: %d\n", errno);
-    exit(EXIT_FAILURE);
+void latch_set_push(LatchSet* latches, uint32_t page_num) {
+  if (latches->count == latches->capacity) {
+    latches->capacity *= 2;
+    uint32_t* page_nums = malloc(latches->capacity * sizeof(uint32_t));
+    memcpy(page_nums, latches->page_nums, latches->count * sizeof(uint32_t));
+    if (latches->page_nums != latches->inline_page_nums) {
+      free(latches->page_nums);
+    }
+    latches->page_nums = page_nums;
   }
+  latches->page_nums[latches->count] = page_num;
+  latches->count += 1;
+}
 
-  ssize_t bytes_written =
-      write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
-
-  if (bytes_written == -1) {
-    printf("Error writing: %d\n", errno);
-    exit(EXIT_FAILURE);
+bool latch_set_contains(LatchSet* latches, uint32_t page_num) {
+  for (uint32_t i = 0; i < latches->count; i++) {
+    if (latches->page_nums[i] == page_num) {
+      return true;
+    }
   }
+  return false;
 }
 
-void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level){
-  void* node = get_page(pager, page_num);
-  uint32_t num_keys, child;
-
-  switch (get_node_type(node)) {
-    case (NODE_LEAF):
-      num_keys = *leaf_node_num_cells(node);
-      indent(indentation_level);
-      printf("- leaf (size %d)\n", num_keys);
-      for (uint32_t i = 0; i < num_keys; i++) {
-        indent(indentation_level + 1);
-        printf("- %d\n", *leaf_node_key(node, i));
-      }
-      break;
-    case (NODE_INTERNAL):
-      num_keys = *internal_node_num_keys(node);
-      indent(indentation_level);
-      printf("- internal (size %d)\n", num_keys);
-      for (uint32_t i = 0; i < num_keys; i++) {
-        child = *internal_node_child(node, i);
-        print_tree(pager, child, indentation_level + 1);
-
-        indent(indentation_level + 1);
-        printf("- key %d\n", *internal_node_key(node, i));
-      }
-      child = *internal_node_right_child(node);
-      print_tree(pager, child, indentation_level + 1);
-      break;
+void latch_set_release(Pager* pager, LatchSet* latches) {
+  for (uint32_t i = 0; i < latches->count; i++) {
+    pager_unlatch(pager, latches->page_nums[i]);
+  }
+  if (latches->page_nums != latches->inline_page_nums) {
+    free(latches->page_nums);
   }
+  latch_set_init(latches);
 }
 
 /*
- * 写入数据到磁盘并释放
- * 关闭数据库文件
- * 释放pager
+ * 在快照中读取一页: 最新版本对快照可见时直接返回，否则沿旧版本链往回找
+ * 返回的页不会再被修改，快照结束前也不会被回收
+ * 提交时先写seq再发布page，所以先读page再读seq时，seq不会比page所属的提交旧:
+ * 读到的seq对快照可见，page就一定是快照应该看到的版本，不用加version_lock
  */
-void db_close(Table* table) {
-  Pager* pager = table->pager;
+void* snapshot_get_page(Pager* pager, uint32_t page_num, uint64_t snapshot_seq) {
+  // get_page返回之后页表项中的页可能已经被淘汰，用返回的页，它在事务结束前不会被回收
+  void* page = get_page(pager, page_num);
+  PageEntry* entry = page_entry(pager, page_num);
 
-  for (uint32_t i = 0; i < pager->num_pages; i++) {
-    if (pager->pages[i] == NULL) {
-      continue;
-    }
-    pager_flush(pager, i);
-    free(pager->pages[i]);
-    pager->pages[i] = NULL;
+  if (__atomic_load_n(&(entry->seq), __ATOMIC_ACQUIRE) <= snapshot_seq) {
+    return page;
   }
 
-  int result = close(pager->file_descriptor);
-  if (result == -1) {
-    printf("Error closing db file.\n");
-    exit(EXIT_FAILURE);
-  }
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    void* page = pager->pages[i];
-    if (page) {
-      free(page);
-      pager->pages[i] = NULL;
+  // 最新版本比快照新，要在锁内沿旧版本链查找
+  pthread_mutex_lock(&(pager->version_lock));
+  if (entry->seq > snapshot_seq) {
+    PageVersion* version = entry->versions;
+    while (version != NULL && version->seq > snapshot_seq) {
+      version = version->older;
+    }
+    if (version != NULL) {
+      page = version->data;
     }
   }
-  free(pager);
+  pthread_mutex_unlock(&(pager->version_lock));
+
+  return page;
 }
 
 /*
- * 解析器Parser 
+ * 按事务读取一页
+ * 只读事务读快照；写事务先看自己的草稿，没有草稿时读最新提交的版本
  */
-MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
-  if (strcmp(input_buffer->buffer, ".exit") == 0) {
-    db_close(table);
-    exit(EXIT_SUCCESS);
-  } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
-    printf("Tree:\n");
-    print_tree(table->pager, 0, 0);
-    return META_COMMAND_SUCCESS;
-  } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
-    printf("Constants:\n");
-    print_constants();
-    return META_COMMAND_SUCCESS;
-  } else {
-    return META_COMMAND_UNRECOGNIZED_COMMAND;
+void* table_get_page(Table* table, uint32_t page_num) {
+  Transaction* transaction = table->transaction;
+  if (transaction != NULL && transaction->read_only) {
+    return snapshot_get_page(table->pager, page_num, transaction->snapshot_seq);
+  }
+  if (transaction != NULL) {
+    void* draft = page_entry(table->pager, page_num)->draft;
+    if (draft != NULL) {
+      return draft;
+    }
   }
+  return get_page(table->pager, page_num);
 }
 
-PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
-  statement->type = STATEMENT_INSERT;
-
-  char* keyword = strtok(input_buffer->buffer, " ");
-  char* id_string = strtok(NULL, " ");
-  char* username = strtok(NULL, " ");
-  char* email = strtok(NULL, " ");
-
-  if (id_string == NULL || username == NULL || email == NULL) {
-    return PREPARE_SYNTAX_ERROR;
+/*
+ * 写事务修改一页之前调用，调用时持有该页的写锁(新分配的页除外)
+ * 第一次修改时复制一份草稿，之后都修改这份草稿
+ */
+void* table_get_page_for_write(Table* table, uint32_t page_num) {
+  Pager* pager = table->pager;
+  Transaction* transaction = table->transaction;
+  PageEntry* entry = page_entry(pager, page_num);
+  if (entry->draft == NULL) {
+    // 先在lock内登记草稿再读最新版本，淘汰时跳过有草稿的页，提交时被替换的页一定还在缓存中
+    void* draft = frame_alloc(pager);
+    pthread_mutex_lock(&(pager->lock));
+    entry->draft = draft;
+    pthread_mutex_unlock(&(pager->lock));
+    memcpy(draft, get_page(pager, page_num), PAGE_SIZE);
+
+    // 大多数语句只改几页，放在事务自带的数组里，超出后再到堆上扩容
+    if (transaction->num_dirty_pages == transaction->dirty_pages_capacity) {
+      if (transaction->dirty_pages_capacity == 0) {
+        transaction->dirty_pages = transaction->inline_dirty_pages;
+        transaction->dirty_pages_capacity = TRANSACTION_INLINE_DIRTY_PAGES;
+      } else {
+        transaction->dirty_pages_capacity *= 2;
+        uint32_t* dirty_pages =
+            malloc(transaction->dirty_pages_capacity * sizeof(uint32_t));
+        memcpy(dirty_pages, transaction->dirty_pages,
+               transaction->num_dirty_pages * sizeof(uint32_t));
+        if (transaction->dirty_pages != transaction->inline_dirty_pages) {
+          free(transaction->dirty_pages);
+        }
+        transaction->dirty_pages = dirty_pages;
+      }
+    }
+    transaction->dirty_pages[transaction->num_dirty_pages] = page_num;
+    transaction->num_dirty_pages += 1;
   }
+  return entry->draft;
+}
 
-  int id = atoi(id_string);
-  if (id < 0) {
-    return PREPARE_NEGATIVE_ID;
+/*
+ * explain analyze: 记录语句访问的一页，在加页锁之后调用，每移动到一页正好加一次锁
+ * 层数沿父节点指针数到根为止；内部节点都是从根往下找到的，路径上的页都在缓存中，
+ * 叶节点都在同一层，只在第一次访问叶节点时计算
+ */
+void profile_page_visit(Table* table, uint32_t page_num) {
+  QueryProfile* profile = table->profile;
+  if (__atomic_load_n(&(page_entry(table->pager, page_num)->page),
+                      __ATOMIC_ACQUIRE) == NULL) {
+    __atomic_add_fetch(&(profile->cache_misses), 1, __ATOMIC_RELAXED);
   }
-  if (strlen(username) > COLUMN_USERNAME_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+  void* node = table_get_page(table, page_num);
+  bool leaf = (get_node_type(node) == NODE_LEAF);
+  uint32_t level = PROFILE_LEVEL_UNKNOWN;
+  if (leaf) {
+    level = __atomic_load_n(&(profile->leaf_level), __ATOMIC_RELAXED);
   }
-  if (strlen(email) > COLUMN_EMAIL_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+  if (level == PROFILE_LEVEL_UNKNOWN) {
+    level = 0;
+    while (!is_node_root(node) && level + 1 < BTREE_MAX_DEPTH) {
+      node = table_get_page(table, *node_parent(node));
+      level += 1;
+    }
+    if (leaf) {
+      __atomic_store_n(&(profile->leaf_level), level, __ATOMIC_RELAXED);
+    }
   }
-
-  statement->row_to_insert.id = id;
-  strcpy(statement->row_to_insert.username, username);
-  strcpy(statement->row_to_insert.email, email);
-
-  return PREPARE_SUCCESS;
+  __atomic_add_fetch(&(profile->pages_per_level[level]), 1, __ATOMIC_RELAXED);
 }
 
 /*
- * 解析器
- * SQL Command Processor
+ * 只读事务不加页锁
  */
-PrepareResult prepare_statement(InputBuffer* input_buffer,
-                                Statement* statement) {
-  if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
-    return prepare_insert(input_buffer, statement); 
+void table_latch(Table* table, uint32_t page_num, LatchMode mode) {
+  if (table->profile != NULL) {
+    profile_page_visit(table, page_num);
   }
-  if (strcmp(input_buffer->buffer, "select") == 0) {
-    statement->type = STATEMENT_SELECT;
-    return PREPARE_SUCCESS;
+  if (table->transaction != NULL && table->transaction->read_only) {
+    return;
   }
-
-  return PREPARE_UNRECOGNIZED_STATEMENT;
+  pager_latch(table->pager, page_num, mode);
+}
+
+void table_unlatch(Table* table, uint32_t page_num) {
+  if (table->transaction != NULL && table->transaction->read_only) {
+    return;
+  }
+  pager_unlatch(table->pager, page_num);
+}
+
+/*
+ * 回收已经没有快照需要的旧版本，调用时持有version_lock
+ */
+void pager_collect_versions(Pager* pager) {
+  uint64_t oldest_snapshot_seq = UINT64_MAX;
+  if (pager->snapshots_head != NULL) {
+    oldest_snapshot_seq = pager->snapshots_head->snapshot_seq;
+  }
+
+  while (pager->retired_head != NULL &&
+         pager->retired_head->end_seq <= oldest_snapshot_seq) {
+    PageVersion* version = pager->retired_head;
+    pager->retired_head = version->next_retired;
+    if (pager->retired_head == NULL) {
+      pager->retired_tail = NULL;
+    }
+
+    // 回收队列按end_seq排列，所以它一定是这一页最旧的版本
+    PageVersion** link = &(page_entry(pager, version->page_num)->versions);
+    while (*link != version) {
+      link = &((*link)->older);
+    }
+    *link = NULL;
+
+    frame_free(pager, version->data);
+    version->older = pager->free_versions;
+    pager->free_versions = version;
+  }
+}
+
+/*
+ * 开始一个事务，只读事务在这里固定快照
+ */
+void transaction_begin(Table* table, Transaction* transaction, bool read_only) {
+  Pager* pager = table->pager;
+  memset(transaction, 0, sizeof(Transaction));
+  transaction->read_only = read_only;
+  transaction->autocommit = true;
+  // 事务结束之前，它读到的页即使被淘汰，页帧也不会被放回页帧池
+  pthread_mutex_lock(&(pager->evict_lock));
+  transaction->evict_slot = pager->evict_epoch & 1;
+  pager->epoch_transactions[transaction->evict_slot] += 1;
+  pthread_mutex_unlock(&(pager->evict_lock));
+  if (!read_only) {
+    return;
+  }
+
+  pthread_mutex_lock(&(pager->version_lock));
+  transaction->snapshot_seq = pager->commit_seq;
+  transaction->prev = pager->snapshots_tail;
+  if (pager->snapshots_tail == NULL) {
+    pager->snapshots_head = transaction;
+  } else {
+    pager->snapshots_tail->next = transaction;
+  }
+  pager->snapshots_tail = transaction;
+  pthread_mutex_unlock(&(pager->version_lock));
+}
+
+void page_list_add(PageList* list, uint32_t page_num) {
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 64;
+    list->page_nums =
+        realloc(list->page_nums, list->capacity * sizeof(uint32_t));
+  }
+  list->page_nums[list->count] = page_num;
+  list->count += 1;
+}
+
+/*
+ * page_num将要换成seq之前的版本是old_seq，记录到还没有持久化、还没有写回的页中
+ * 上次持久化(写回)之后第一次提交时才加入，同一页不会重复，调用时持有version_lock
+ */
+void pager_track_page(Pager* pager, uint32_t page_num, uint64_t old_seq) {
+  if (old_seq <= pager->durable_seq) {
+    page_list_add(&(pager->unsynced_pages), page_num);
+  }
+  if (!pager->shared && old_seq <= pager->checkpoint_seq) {
+    page_list_add(&(pager->unwritten_pages), page_num);
+  }
+}
+
+/*
+ * 用page替换page_num最新提交的版本，被替换的版本还有快照需要时挂到旧版本链上
+ * 调用时持有version_lock
+ */
+void pager_commit_page(Pager* pager, uint32_t page_num, void* page,
+                       uint64_t seq) {
+  PageEntry* entry = page_entry(pager, page_num);
+  void* old_page = entry->page;
+  if (old_page == NULL) {
+    __atomic_add_fetch(&(pager->num_cached_pages), 1, __ATOMIC_RELAXED);
+  }
+
+  if (pager->snapshots_tail != NULL &&
+      pager->snapshots_tail->snapshot_seq >= entry->seq) {
+    PageVersion* version = pager->free_versions;
+    if (version != NULL) {
+      pager->free_versions = version->older;
+    } else {
+      version = malloc(sizeof(PageVersion));
+    }
+    version->data = old_page;
+    version->seq = entry->seq;
+    version->end_seq = seq;
+    version->page_num = page_num;
+    version->older = entry->versions;
+    version->next_retired = NULL;
+    entry->versions = version;
+    if (pager->retired_tail == NULL) {
+      pager->retired_head = version;
+    } else {
+      pager->retired_tail->next_retired = version;
+    }
+    pager->retired_tail = version;
+  } else {
+    frame_free(pager, old_page);
+  }
+
+  pager_track_page(pager, page_num, entry->seq);
+  // 先写seq再发布page，snapshot_get_page不加锁时依赖这个顺序
+  __atomic_store_n(&(entry->seq), seq, __ATOMIC_RELEASE);
+  __atomic_store_n(&(entry->page), page, __ATOMIC_RELEASE);
+}
+
+/*
+ * 提交写事务: 用草稿替换最新版本
+ * 必须在释放页锁之前调用，其他写操作拿到页锁后总是看到已经提交的页
+ */
+void transaction_commit(Table* table, Transaction* transaction) {
+  Pager* pager = table->pager;
+  if (transaction->num_dirty_pages == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&(pager->version_lock));
+  pager->commit_seq += 1;
+  uint64_t seq = pager->commit_seq;
+  for (uint32_t i = 0; i < transaction->num_dirty_pages; i++) {
+    PageEntry* entry = page_entry(pager, transaction->dirty_pages[i]);
+    pager_commit_page(pager, transaction->dirty_pages[i], entry->draft, seq);
+    // 淘汰时看到草稿已经清空，就一定看到新的seq，不会把还没有写回的页当成干净的页
+    __atomic_store_n(&(entry->draft), NULL, __ATOMIC_RELEASE);
+  }
+  pager_collect_versions(pager);
+  pthread_mutex_unlock(&(pager->version_lock));
+}
+
+/*
+ * 结束事务: 只读事务释放快照并回收不再需要的旧版本
+ */
+void transaction_end(Table* table, Transaction* transaction) {
+  Pager* pager = table->pager;
+  if (transaction->dirty_pages != transaction->inline_dirty_pages) {
+    free(transaction->dirty_pages);
+  }
+  pthread_mutex_lock(&(pager->evict_lock));
+  pager->epoch_transactions[transaction->evict_slot] -= 1;
+  for (uint32_t i = 0; i < 2 && pager_advance_epoch(pager); i++) {
+  }
+  pthread_mutex_unlock(&(pager->evict_lock));
+  if (!transaction->read_only) {
+    return;
+  }
+
+  pthread_mutex_lock(&(pager->version_lock));
+  if (transaction->prev == NULL) {
+    pager->snapshots_head = transaction->next;
+  } else {
+    transaction->prev->next = transaction->next;
+  }
+  if (transaction->next == NULL) {
+    pager->snapshots_tail = transaction->prev;
+  } else {
+    transaction->next->prev = transaction->prev;
+  }
+  pager_collect_versions(pager);
+  pthread_mutex_unlock(&(pager->version_lock));
+}
+
+/*
+ * fcntl文件锁，锁住offset这一个字节
+ * 内核按进程做死锁检测，本进程另一个线程马上会释放的锁也算进去，
+ * 锁的顺序固定(WRITER在DATA之前)，不会真的死锁，EDEADLK时稍等重试
+ */
+bool file_lock(int fd, off_t offset, short type, bool wait) {
+  struct flock lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = type;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = offset;
+  lock.l_len = 1;
+  while (fcntl(fd, wait ? F_SETLKW : F_SETLK, &lock) == -1) {
+    if (wait && errno == EDEADLK) {
+      usleep(1000);
+    } else if (errno != EINTR) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void file_lock_or_exit(int fd, off_t offset, short type) {
+  if (!file_lock(fd, offset, type, true)) {
+    printf("Error locking db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * 其他进程发布过修改，丢掉整个私有缓存
+ * 调用时本进程没有正在执行的语句，也没有快照和草稿
+ */
+void pager_invalidate(Pager* pager) {
+  pthread_mutex_lock(&(pager->lock));
+  uint32_t chunk_pages = 1 << PAGE_TABLE_CHUNK_BITS;
+  for (uint64_t first = 0; first < pager->page_table_limit;
+       first += chunk_pages) {
+    PageEntry* chunk = page_table_chunk(pager, first);
+    for (uint32_t i = 0; chunk != NULL && i < chunk_pages; i++) {
+      frame_free(pager, chunk[i].page);
+      chunk[i].page = NULL;
+      chunk[i].seq = 0;
+    }
+  }
+  pager->num_cached_pages = 0;
+  pager->num_pages = pager->shared_header->num_pages;
+  pager->file_length = lseek(pager->file_descriptor, 0, SEEK_END);
+  pager->vacuum_position = 0;
+  pthread_mutex_unlock(&(pager->lock));
+
+  // 页表项的seq都清零了，列表中的页重新提交时会再加入
+  pthread_mutex_lock(&(pager->version_lock));
+  pager->unsynced_pages.count = 0;
+  pager_collect_versions(pager);
+  pthread_mutex_unlock(&(pager->version_lock));
+}
+
+/*
+ * 共享模式下每条语句执行期间持有LOCK_DATA_BYTE的读锁
+ * 文件锁属于整个进程，所以只在本进程第一条语句开始时加锁，顺便检查私有缓存是否过期
+ */
+void pager_lock_shared(Pager* pager) {
+  if (!pager->shared) {
+    return;
+  }
+  pthread_mutex_lock(&(pager->data_lock));
+  if (pager->num_data_readers == 0) {
+    file_lock_or_exit(pager->file_descriptor, LOCK_DATA_BYTE, F_RDLCK);
+    uint64_t change_counter = __atomic_load_n(
+        &(pager->shared_header->change_counter), __ATOMIC_ACQUIRE);
+    if (change_counter != pager->seen_change_counter) {
+      pager_invalidate(pager);
+      pager->seen_change_counter = change_counter;
+    }
+  }
+  pager->num_data_readers += 1;
+  pthread_mutex_unlock(&(pager->data_lock));
+}
+
+void pager_unlock_shared(Pager* pager) {
+  if (!pager->shared) {
+    return;
+  }
+  pthread_mutex_lock(&(pager->data_lock));
+  pager->num_data_readers -= 1;
+  if (pager->num_data_readers == 0) {
+    file_lock_or_exit(pager->file_descriptor, LOCK_DATA_BYTE, F_UNLCK);
+  }
+  pthread_mutex_unlock(&(pager->data_lock));
+}
+
+/*
+ * 共享模式下写操作持有LOCK_WRITER_BYTE，进程之间的写操作互相排斥，
+ * 进程内的自动提交写语句仍然靠页锁并发
+ */
+void pager_lock_writer(Pager* pager) {
+  if (!pager->shared) {
+    return;
+  }
+  pthread_mutex_lock(&(pager->file_writer_lock));
+  if (pager->num_file_writers == 0) {
+    file_lock_or_exit(pager->file_descriptor, LOCK_WRITER_BYTE, F_WRLCK);
+  }
+  pager->num_file_writers += 1;
+  pthread_mutex_unlock(&(pager->file_writer_lock));
+}
+
+void pager_unlock_writer(Pager* pager) {
+  if (!pager->shared) {
+    return;
+  }
+  pthread_mutex_lock(&(pager->file_writer_lock));
+  pager->num_file_writers -= 1;
+  if (pager->num_file_writers == 0) {
+    file_lock_or_exit(pager->file_descriptor, LOCK_WRITER_BYTE, F_UNLCK);
+  }
+  pthread_mutex_unlock(&(pager->file_writer_lock));
+}
+
+/*
+ * 共享模式下提交后把修改过的页写回文件和共享页缓存，再增加change_counter
+ * 等其他进程的语句都结束(LOCK_DATA_BYTE写锁)后才写，其他进程不会读到一半的修改
+ */
+void pager_publish(Pager* pager, uint32_t* page_nums, uint32_t num_pages) {
+  if (!pager->shared || num_pages == 0) {
+    return;
+  }
+  pthread_mutex_lock(&(pager->data_lock));
+  file_lock_or_exit(pager->file_descriptor, LOCK_DATA_BYTE, F_WRLCK);
+
+  pthread_mutex_lock(&(pager->lock));
+  for (uint32_t i = 0; i < num_pages; i++) {
+    uint32_t page_num = page_nums[i];
+    void* page = page_entry(pager, page_num)->page;
+    if (pwrite(pager->file_descriptor, page, PAGE_SIZE,
+               (off_t)page_num * PAGE_SIZE) == -1) {
+      printf("Error writing: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    pager_count(&(pager->stats.file_writes), 1);
+    pager_count(&(pager->stats.file_write_bytes), PAGE_SIZE);
+    shared_cache_fill(pager, page_num, page, true);
+  }
+  if (pager->num_pages > pager->shared_header->num_pages) {
+    pager->shared_header->num_pages = pager->num_pages;
+  }
+  // 发布之后已经提交的页都在文件中了，可以淘汰；
+  // 其他自动提交的写语句提交了还没有发布的页仍然被它们锁着，不会被淘汰
+  pager->checkpoint_seq = pager->commit_seq;
+  if (pager->file_length < (off_t)pager->num_pages * PAGE_SIZE) {
+    pager->file_length = (off_t)pager->num_pages * PAGE_SIZE;
+  }
+  pager->seen_change_counter = __atomic_add_fetch(
+      &(pager->shared_header->change_counter), 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&(pager->lock));
+
+  file_lock_or_exit(pager->file_descriptor, LOCK_DATA_BYTE,
+                    pager->num_data_readers > 0 ? F_RDLCK : F_UNLCK);
+  pthread_mutex_unlock(&(pager->data_lock));
+}
+
+/*
+ * 写语句结束: 自动提交的事务先提交再释放页锁
+ * 显式事务的草稿留到commit时再发布，期间其他写操作都在等待，不会访问这些页
+ */
+void release_write_latches(Table* table, LatchSet* latches) {
+  Transaction* transaction = table->transaction;
+  if (transaction->autocommit) {
+    transaction_commit(table, transaction);
+    pager_publish(table->pager, transaction->dirty_pages,
+                  transaction->num_dirty_pages);
+    transaction->num_dirty_pages = 0;
+  }
+  latch_set_release(table->pager, latches);
+}
+
+/*
+ * 写操作之间的互斥
+ * 自动提交的写语句之间靠页锁并发执行；显式事务从begin到commit/rollback独占，
+ * 可能跨越多个工作线程，所以不能用pthread读写锁
+ * 显式事务要等客户端发来commit才结束，wait为false时遇到它直接返回false；
+ * 自动提交的写语句很快就会结束，begin总是等它们
+ */
+bool writer_enter(Pager* pager, bool exclusive, bool wait) {
+  pthread_mutex_lock(&(pager->writer_lock));
+  while (pager->exclusive_writer || (exclusive && pager->num_writers > 0)) {
+    if (pager->exclusive_writer && !wait) {
+      pthread_mutex_unlock(&(pager->writer_lock));
+      return false;
+    }
+    pthread_cond_wait(&(pager->writer_cond), &(pager->writer_lock));
+  }
+  if (exclusive) {
+    pager->exclusive_writer = true;
+  } else {
+    pager->num_writers += 1;
+  }
+  pthread_mutex_unlock(&(pager->writer_lock));
+  return true;
+}
+
+void writer_exit(Pager* pager, bool exclusive) {
+  pthread_mutex_lock(&(pager->writer_lock));
+  if (exclusive) {
+    pager->exclusive_writer = false;
+  } else {
+    pager->num_writers -= 1;
+  }
+  pthread_cond_broadcast(&(pager->writer_cond));
+  pthread_mutex_unlock(&(pager->writer_lock));
+}
+
+/*
+ * 回滚显式事务: 丢弃所有草稿和事务中新分配的页，已经发布的页没有被修改过
+ */
+void transaction_rollback(Table* table) {
+  Pager* pager = table->pager;
+  Transaction* transaction = table->transaction;
+  for (uint32_t i = 0; i < transaction->num_dirty_pages; i++) {
+    PageEntry* entry = page_entry(pager, transaction->dirty_pages[i]);
+    frame_free(pager, entry->draft);
+    entry->draft = NULL;
+  }
+  for (uint32_t i = transaction->num_pages_at_begin; i < pager->num_pages; i++) {
+    PageEntry* entry = page_entry(pager, i);
+    if (entry->page != NULL) {
+      __atomic_sub_fetch(&(pager->num_cached_pages), 1, __ATOMIC_RELAXED);
+    }
+    frame_free(pager, entry->page);
+    entry->page = NULL;
+  }
+  pager->num_pages = transaction->num_pages_at_begin;
+
+  pager_unlock_writer(pager);
+  writer_exit(pager, true);
+  transaction_end(table, transaction);
+  free(transaction);
+  table->transaction = NULL;
+}
+
+Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
+  void* node = table_get_page(table, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  Cursor* cursor = arena_alloc(table->arena, sizeof(Cursor));
+  cursor->table = table;
+  cursor->page_num = page_num;
+  cursor->readahead_marker = 0;
+
+  // 二分查找
+  uint32_t start = 0;
+  uint32_t end = num_cells;
+  while (start != end) {
+    uint32_t index = (start + end) / 2;
+    uint32_t key_at_index = *leaf_node_key(node, index);
+    if (key == key_at_index) {
+      cursor->cell_num = index;
+      return cursor;
+    }
+    if (key < key_at_index) {
+      end = index;
+    } else {
+      start = index + 1;
+    }
+  }
+  
+  cursor->cell_num = start;
+  return cursor;
+}
+
+ uint32_t internal_node_find_child(void* node, uint32_t key){
+  /*
+
+  */
+
+  uint32_t num_keys = *internal_node_num_keys(node);
+  uint32_t low = 0;
+  uint32_t high = num_keys;
+
+  while (low != high){
+    uint32_t mid = (low + high) / 2;
+    uint32_t key_to_right = *internal_node_key(node, mid);
+    if (key_to_right >= key){
+      high = mid;
+    }else{
+      low = mid + 1;
+    }
+  }
+
+  return low;
+}
+
+/*
+ * 调用前page_num这一页已经加了读锁
+ * 锁住子节点后释放当前节点，最后返回的游标持有叶节点的读锁
+ */
+Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key) {
+  void* node = table_get_page(table, page_num);
+
+  uint32_t child_index = internal_node_find_child(node, key);
+  uint32_t child_num = *internal_node_child(node, child_index);
+  table_latch(table, child_num, LATCH_SHARED);
+  table_unlatch(table, page_num);
+  void* child = table_get_page(table, child_num);
+  switch (get_node_type(child)) {
+    case NODE_LEAF:
+      return leaf_node_find(table, child_num, key);
+    case NODE_INTERNAL:
+      return internal_node_find(table, child_num, key);
+  }
+}
+
+void initialize_internal_node(void* node) {
+  set_node_type(node, NODE_INTERNAL);
+  set_node_root(node, false);
+  *internal_node_num_keys(node) = 0;
+  *leaf_node_next_leaf(node) = 0;
+}
+
+
+/*
+ * 修改子节点的父节点指针，分割内部节点时被移到别的节点下的子节点调用
+ * 修改前要持有子节点的写锁: 不在latches中的加锁后放进latches，提交后和查找路径上的锁一起释放
+ * 这些子节点都在查找路径上的节点下面，写操作总是从上往下加锁，
+ * 持有它们的其他写操作不会再去等待路径上的页，不会死锁
+ */
+void set_node_parent(Table* table, LatchSet* latches, uint32_t page_num,
+                     uint32_t parent_page_num) {
+  if (!latch_set_contains(latches, page_num)) {
+    pager_latch(table->pager, page_num, LATCH_EXCLUSIVE);
+    latch_set_push(latches, page_num);
+  }
+  void* node = table_get_page_for_write(table, page_num);
+  *node_parent(node) = parent_page_num;
+}
+
+/*
+ * 创建新的根节点
+ * 根分割成了两半: 左边一半还在根页中，最大key是left_child_max_key，右边一半在right_child_page_num
+ */
+void create_new_root(Table* table, LatchSet* latches,
+                     uint32_t left_child_max_key,
+                     uint32_t right_child_page_num) {
+
+  /*
+  * 分割旧的根节点，为旧节点创建新的page变为左子节点，剩余部分变为右子节点
+  * 重新生成一个带有左右子树的新节点
+  * 
+  */
+
+  void* root = table_get_page_for_write(table, table->root_page_num);
+  void* right_child = table_get_page_for_write(table, right_child_page_num);
+  uint32_t left_child_page_num = get_unused_page_num(table->pager);
+  void* left_child = table_get_page_for_write(table, left_child_page_num);
+  pager_count(&(table->pager->stats.root_splits), 1);
+  DB_PROBE2(new__root, table->root_page_num, left_child_page_num);
+
+  /*为旧节点创建新的page变为左子节点*/
+  memcpy(left_child, root, PAGE_SIZE);
+  set_node_root(left_child, false);
+  // 根是内部节点时，左边一半的子节点跟着搬到了新页
+  if (get_node_type(left_child) == NODE_INTERNAL) {
+    uint32_t num_keys = *internal_node_num_keys(left_child);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+      set_node_parent(table, latches, *internal_node_child(left_child, i),
+                      left_child_page_num);
+    }
+  }
+
+  /*
+   * 初始化为内部节点
+   */
+  initialize_internal_node(root);
+  set_node_root(root, true);
+  *internal_node_num_keys(root) = 1;
+  *internal_node_child(root, 0) = left_child_page_num;
+  *internal_node_key(root, 0) = left_child_max_key;
+  *internal_node_right_child(root) = right_child_page_num;
+  *node_parent(left_child) = table->root_page_num;
+  *node_parent(right_child) = table->root_page_num;
+}
+
+/*
+ * 查找key所在的位置，返回的游标持有叶节点的读锁
+ */
+Cursor* table_find(Table*table, uint32_t key){
+  uint32_t root_page_num = table->root_page_num;
+  table_latch(table, root_page_num, LATCH_SHARED);
+  void* root_node = table_get_page(table, root_page_num);
+
+  if (get_node_type(root_node) == NODE_LEAF){
+    return leaf_node_find(table, root_page_num, key);
+  }else{
+    return internal_node_find(table, root_page_num, key);
+  }
+}
+
+/*
+ * 节点是否"安全": 再插入一条数据也不会分割，不会修改父节点
+ */
+bool is_node_safe(void* node) {
+  if (get_node_type(node) == NODE_LEAF) {
+    return *leaf_node_num_cells(node) < LEAF_NODE_MAX_CELLS;
+  }
+  return *internal_node_num_keys(node) < INTERNAL_NODE_MAX_CELLS;
+}
+
+/*
+ * 为写操作查找key所在的位置，叶节点总是加写锁
+ * 乐观模式: 内部节点只加读锁并且逐层释放，适用于不会分割叶节点的情况
+ * 悲观模式: 从根开始全部加写锁，遇到安全的节点时释放它上面所有的锁，
+ *           分割时需要修改的父节点都还在latches中
+ * 页在提交时会被替换，所以总是先加锁再读页: 乐观模式先加读锁，
+ * 发现是叶节点再换成写锁；只有根节点会从叶节点变成内部节点，换锁后对内部节点持有写锁也是安全的
+ */
+uint32_t latch_for_write(Table* table, uint32_t page_num, bool pessimistic) {
+  if (pessimistic) {
+    pager_latch(table->pager, page_num, LATCH_EXCLUSIVE);
+    if (table->profile != NULL) {
+      profile_page_visit(table, page_num);
+    }
+    return page_num;
+  }
+  pager_latch(table->pager, page_num, LATCH_SHARED);
+  if (get_node_type(table_get_page(table, page_num)) == NODE_LEAF) {
+    pager_unlatch(table->pager, page_num);
+    pager_latch(table->pager, page_num, LATCH_EXCLUSIVE);
+  }
+  if (table->profile != NULL) {
+    profile_page_visit(table, page_num);
+  }
+  return page_num;
+}
+
+Cursor* table_find_for_write(Table* table, uint32_t key, LatchSet* latches,
+                             bool pessimistic) {
+  Pager* pager = table->pager;
+  latch_set_init(latches);
+
+  uint32_t page_num = latch_for_write(table, table->root_page_num, pessimistic);
+  void* node = table_get_page(table, page_num);
+  latch_set_push(latches, page_num);
+
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_index = internal_node_find_child(node, key);
+    uint32_t child_num = latch_for_write(
+        table, *internal_node_child(node, child_index), pessimistic);
+    void* child = table_get_page(table, child_num);
+    if (!pessimistic || is_node_safe(child)) {
+      latch_set_release(pager, latches);
+    }
+    latch_set_push(latches, child_num);
+    page_num = child_num;
+    node = child;
+  }
+
+  // leaf_node_find只做二分查找，锁已经在latches中
+  return leaf_node_find(table, page_num, key);
+}
+
+/*
+ * 把split_page_num分割出来的新节点child_page_num插入父节点，新节点总是紧跟在被分割的节点后面
+ * split_max_key是分割后留在split_page_num中的最大key；新节点接替被分割节点原来的key，
+ * 或者成为最右边的子节点
+ * 调用时持有父节点和被分割节点的写锁；只根据这两页决定插入位置，
+ * 不读取可能正在被其他写线程修改的兄弟节点
+ * 父节点已满时把它也分割: 子节点按顺序排好后左边一半留在原页，右边一半移到新页，
+ * 再把新页插入更上一层，直到某一层放得下或者分割到根
+ */
+void internal_node_insert(Table* table, LatchSet* latches,
+                          uint32_t parent_page_num, uint32_t split_page_num,
+                          uint32_t split_max_key, uint32_t child_page_num) {
+  DB_PROBE2(internal__insert, parent_page_num, child_page_num);
+  void* parent = table_get_page_for_write(table, parent_page_num);
+  uint32_t num_keys = *internal_node_num_keys(parent);
+
+  if (num_keys < INTERNAL_NODE_MAX_CELLS) {
+    uint32_t index = internal_node_find_child(parent, split_max_key);
+    *internal_node_num_keys(parent) = num_keys + 1;
+    if (split_page_num == *internal_node_right_child(parent)) {
+      *internal_node_child(parent, num_keys) = split_page_num;
+      *internal_node_key(parent, num_keys) = split_max_key;
+      *internal_node_right_child(parent) = child_page_num;
+    } else {
+      for (uint32_t i = num_keys; i > index; i--) {
+        void* destination = internal_node_cell(parent, i);
+        void* source = internal_node_cell(parent, i - 1);
+        memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
+      }
+      *internal_node_key(parent, index) = split_max_key;
+      *internal_node_child(parent, index + 1) = child_page_num;
+    }
+    return;
+  }
+
+  // 全部子节点和它们之间的key，比节点能容纳的多一个子节点
+  uint32_t children[INTERNAL_NODE_MAX_CELLS + 2];
+  uint32_t keys[INTERNAL_NODE_MAX_CELLS + 1];
+  uint32_t count = 0;
+  for (uint32_t i = 0; i <= num_keys; i++) {
+    children[count] = *internal_node_child(parent, i);
+    if (i < num_keys) {
+      keys[count] = *internal_node_key(parent, i);
+    }
+    count += 1;
+    if (children[count - 1] == split_page_num) {
+      if (i < num_keys) {
+        keys[count] = keys[count - 1];
+      }
+      keys[count - 1] = split_max_key;
+      children[count] = child_page_num;
+      count += 1;
+    }
+  }
+
+  uint32_t left_count = count - count / 2;
+  uint32_t new_page_num = get_unused_page_num(table->pager);
+  void* new_node = table_get_page_for_write(table, new_page_num);
+  initialize_internal_node(new_node);
+  *node_parent(new_node) = *node_parent(parent);
+  *internal_node_num_keys(new_node) = count - left_count - 1;
+  for (uint32_t i = left_count; i < count; i++) {
+    if (i + 1 < count) {
+      *internal_node_child(new_node, i - left_count) = children[i];
+      *internal_node_key(new_node, i - left_count) = keys[i];
+    } else {
+      *internal_node_right_child(new_node) = children[i];
+    }
+    set_node_parent(table, latches, children[i], new_page_num);
+  }
+
+  *internal_node_num_keys(parent) = left_count - 1;
+  for (uint32_t i = 0; i + 1 < left_count; i++) {
+    *internal_node_child(parent, i) = children[i];
+    *internal_node_key(parent, i) = keys[i];
+  }
+  *internal_node_right_child(parent) = children[left_count - 1];
+
+  if (is_node_root(parent)) {
+    create_new_root(table, latches, keys[left_count - 1], new_page_num);
+  } else {
+    internal_node_insert(table, latches, *node_parent(parent), parent_page_num,
+                         keys[left_count - 1], new_page_num);
+  }
+}
+
+/*
+ * 释放游标持有的页锁
+ */
+void cursor_close(Cursor* cursor) {
+  table_unlatch(cursor->table, cursor->page_num);
+}
+
+int compare_keys(const void* a, const void* b) {
+  uint32_t key_a = *(const uint32_t*)a;
+  uint32_t key_b = *(const uint32_t*)b;
+  return (key_a > key_b) - (key_a < key_b);
+}
+
+/*
+ * 把一组排好序的页(最多READAHEAD_LEAVES页)整理成readahead中的请求:
+ * 跳过已经在缓存中、正在被预读和超出文件范围的页，物理上连续的页合并成一个请求，每页读进新分配的页帧
+ * 共享模式下页可能已经在共享缓存中，只提示内核异步读取(直接I/O时除外)
+ */
+void readahead_prepare(Pager* pager, Readahead* readahead, uint32_t* page_nums,
+                       uint32_t count) {
+  off_t file_pages = pager->file_length / PAGE_SIZE;
+  readahead->pager = pager;
+  readahead->num_requests = 0;
+  readahead->num_iov = 0;
+  pthread_mutex_lock(&(pager->lock));
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t page_num = page_nums[i];
+    PageEntry* entry = page_entry(pager, page_num);
+    if (page_num >= file_pages || (i > 0 && page_num == page_nums[i - 1]) ||
+        entry->page != NULL || entry->reading) {
+      continue;
+    }
+    pager_count(&(pager->stats.readahead_pages), 1);
+    // 直接I/O不经过内核缓存，提示没有意义，和独占模式一样读进私有缓存
+    if (pager->shared && !pager->direct) {
+#ifdef POSIX_FADV_WILLNEED
+      posix_fadvise(pager->file_descriptor, (off_t)page_num * PAGE_SIZE,
+                    PAGE_SIZE, POSIX_FADV_WILLNEED);
+#endif
+      continue;
+    }
+
+    uint32_t index = readahead->num_iov;
+    readahead->iov[index].iov_base = frame_alloc(pager);
+    readahead->iov[index].iov_len = PAGE_SIZE;
+    readahead->seqs[index] = entry->seq;
+    entry->reading = true;
+    IoRequest* last = readahead->num_requests > 0
+                          ? &(readahead->requests[readahead->num_requests - 1])
+                          : NULL;
+    if (last != NULL && last->num_iov < IO_MAX_REQUEST_PAGES &&
+        last->offset + (off_t)last->num_iov * PAGE_SIZE ==
+            (off_t)page_num * PAGE_SIZE) {
+      last->num_iov += 1;
+    } else {
+      IoRequest request = {false, (off_t)page_num * PAGE_SIZE,
+                           &(readahead->iov[index]), 1, 0};
+      readahead->requests[readahead->num_requests] = request;
+      readahead->num_requests += 1;
+    }
+    readahead->num_iov += 1;
+  }
+  pthread_mutex_unlock(&(pager->lock));
+}
+
+/*
+ * 把读完的页放入页缓存，调用时持有pager->lock
+ * 读的过程中其他线程可能已经加载了其中的页，以先放入缓存的为准
+ */
+void readahead_install(Pager* pager, Readahead* readahead) {
+  for (uint32_t i = 0; i < readahead->num_requests; i++) {
+    IoRequest* request = &(readahead->requests[i]);
+    if (request->result < 0) {
+      printf("Error reading file: %d\n", (int)-request->result);
+      exit(EXIT_FAILURE);
+    }
+    pager_count(&(pager->stats.file_reads), 1);
+    pager_count(&(pager->stats.file_read_bytes), request->result);
+    uint32_t first_page_num = request->offset / PAGE_SIZE;
+    uint32_t first_index = request->iov - readahead->iov;
+    for (uint32_t j = 0; j < request->num_iov; j++) {
+      void* frame = request->iov[j].iov_base;
+      PageEntry* entry = page_entry(pager, first_page_num + j);
+      entry->reading = false;
+      if ((ssize_t)(j + 1) * PAGE_SIZE > request->result ||
+          entry->page != NULL || entry->seq != readahead->seqs[first_index + j]) {
+        frame_free(pager, frame);
+        continue;
+      }
+      if (pager->shared) {
+        shared_cache_fill(pager, first_page_num + j, frame, false);
+      }
+      __atomic_store_n(&(entry->page), frame, __ATOMIC_RELEASE);
+      pager_cache_insert(pager, entry);
+    }
+  }
+  pthread_cond_broadcast(&(pager->readahead_done));
+}
+
+/*
+ * 异步预读完成，在I/O线程中调用
+ */
+void readahead_complete(IoBatch* batch) {
+  Readahead* readahead = (Readahead*)batch;
+  Pager* pager = readahead->pager;
+  pthread_mutex_lock(&(pager->lock));
+  readahead_install(pager, readahead);
+  readahead->next_free = pager->free_readaheads;
+  pager->free_readaheads = readahead;
+  pthread_mutex_unlock(&(pager->lock));
+}
+
+/*
+ * 预读一组页，会修改传入的数组
+ * wait为true时整批交给I/O后端，读完放入页缓存后返回，用于马上就要读这些页的时候；
+ * 否则交给I/O线程异步读取，读完后由I/O线程放入缓存，调用者继续处理当前的页，
+ * 没有空闲的Readahead时放弃这次预读
+ * 共享模式下语句结束后其他进程可能修改文件，读到的页必须在语句内放入缓存，总是等待
+ */
+void pager_readahead(Pager* pager, uint32_t* page_nums, uint32_t count,
+                     bool wait) {
+  qsort(page_nums, count, sizeof(uint32_t), compare_keys);
+  wait = wait || pager->shared || pager->io.num_threads == 0;
+
+  Readahead local;
+  for (uint32_t start = 0; start < count; start += READAHEAD_LEAVES) {
+    uint32_t num_pages = count - start < READAHEAD_LEAVES ? count - start
+                                                          : READAHEAD_LEAVES;
+    Readahead* readahead = &local;
+    if (!wait) {
+      pthread_mutex_lock(&(pager->lock));
+      readahead = pager->free_readaheads;
+      if (readahead != NULL) {
+        pager->free_readaheads = readahead->next_free;
+      }
+      pthread_mutex_unlock(&(pager->lock));
+      if (readahead == NULL) {
+        return;
+      }
+    }
+
+    readahead_prepare(pager, readahead, page_nums + start, num_pages);
+    if (wait || readahead->num_requests == 0) {
+      pager_submit(pager, readahead->requests, readahead->num_requests);
+      pthread_mutex_lock(&(pager->lock));
+      readahead_install(pager, readahead);
+      if (readahead != &local) {
+        readahead->next_free = pager->free_readaheads;
+        pager->free_readaheads = readahead;
+      }
+      pthread_mutex_unlock(&(pager->lock));
+      continue;
+    }
+
+    IoBatch batch = {readahead->requests, readahead->num_requests, 0, 0, NULL,
+                     readahead_complete};
+    readahead->batch = batch;
+    io_pool_submit_async(&(pager->io), &(readahead->batch));
+  }
+}
+
+/*
+ * 从根往下找到key所在的叶节点的页号，不加页锁，只用来决定预读哪些页
+ * 内部节点不记录子节点的类型: *depth为PROFILE_LEVEL_UNKNOWN时读到叶节点为止，并记下经过的内部节点层数；
+ * 之后按这个层数往下走，不用读叶节点本身
+ */
+uint32_t table_find_leaf_hint(Table* table, uint32_t key, uint32_t* depth) {
+  uint32_t page_num = table->root_page_num;
+  void* node = table_get_page(table, page_num);
+  uint32_t level = 0;
+  while (level < *depth && level < BTREE_MAX_DEPTH &&
+         get_node_type(node) == NODE_INTERNAL) {
+    page_num = *internal_node_child(node, internal_node_find_child(node, key));
+    level += 1;
+    if (level < *depth) {
+      node = table_get_page(table, page_num);
+    }
+  }
+  if (*depth == PROFILE_LEVEL_UNKNOWN) {
+    *depth = level;
+  }
+  return page_num;
+}
+
+/*
+ * 批量查找
+ * 先把keys排序去重(会修改传入的数组)，找出所有key所在的叶节点后一起预读，
+ * 每个叶节点只从根往下查找一次，落在同一个叶节点里的key在一次二分查找的扫描中完成
+ * 返回找到的行数，结果按key从小到大写入rows
+ */
+uint32_t table_multi_get(Table* table, uint32_t* keys, uint32_t num_keys,
+                         Row* rows) {
+  if (num_keys == 0) {
+    return 0;
+  }
+  qsort(keys, num_keys, sizeof(uint32_t), compare_keys);
+  uint32_t num_unique = 1;
+  for (uint32_t i = 1; i < num_keys; i++) {
+    if (keys[i] != keys[num_unique - 1]) {
+      keys[num_unique] = keys[i];
+      num_unique += 1;
+    }
+  }
+
+  // 叶节点不在缓存中时，各自的读取作为一批同时提交
+  if (num_unique > 1) {
+    uint32_t* leaves = arena_alloc(table->arena, num_unique * sizeof(uint32_t));
+    uint32_t num_leaves = 0;
+    uint32_t depth = PROFILE_LEVEL_UNKNOWN;
+    for (uint32_t i = 0; i < num_unique; i++) {
+      uint32_t page_num = table_find_leaf_hint(table, keys[i], &depth);
+      if (num_leaves == 0 || leaves[num_leaves - 1] != page_num) {
+        leaves[num_leaves] = page_num;
+        num_leaves += 1;
+      }
+    }
+    pager_readahead(table->pager, leaves, num_leaves, true);
+  }
+
+  uint32_t num_found = 0;
+  uint32_t i = 0;
+  while (i < num_unique) {
+    Cursor* cursor = table_find(table, keys[i]);
+    void* node = table_get_page(table, cursor->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t start = cursor->cell_num;
+
+    uint32_t max_key = (num_cells > 0) ? get_node_max_key(node) : 0;
+
+    // 在同一个叶节点中继续查找后面的key，每次二分查找都从上一个位置开始
+    while (true) {
+      uint32_t end = num_cells;
+      while (start != end) {
+        uint32_t index = (start + end) / 2;
+        if (*leaf_node_key(node, index) < keys[i]) {
+          start = index + 1;
+        } else {
+          end = index;
+        }
+      }
+      if (start < num_cells && *leaf_node_key(node, start) == keys[i]) {
+        deserialize_row(leaf_node_value(node, start), &rows[num_found]);
+        num_found += 1;
+      }
+      if (table->profile != NULL) {
+        table->profile->rows_examined += 1;
+      }
+
+      i += 1;
+      if (i == num_unique || num_cells == 0 || keys[i] > max_key) {
+        break;
+      }
+    }
+    cursor_close(cursor);
+  }
+
+  return num_found;
+}
+
+/*
+ * 初始化游标
+ * 返回一个指向初始位置的游标
+ */
+Cursor* table_start(Table* table) {
+  Cursor*cursor = table_find(table, 0);
+
+  void* node = table_get_page(table, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  cursor->end_of_table = (num_cells == 0);
+
+  return cursor;
+}
+
+/*
+ * 返回游标所指的键值对中的值
+ */
+void* cursor_value(Cursor* cursor) {
+  if (cursor->table->profile != NULL) {
+    __atomic_add_fetch(&(cursor->table->profile->rows_examined), 1,
+                       __ATOMIC_RELAXED);
+  }
+  uint32_t page_num = cursor->page_num;
+  void* page = table_get_page(cursor->table, page_num);
+  return leaf_node_value(page, cursor->cell_num);
+}
+
+/*
+ * 按key顺序把page_num为根、高度为height的子树中的叶节点追加到leaves，最多max个
+ * 只读内部节点，不需要读叶节点本身
+ */
+uint32_t collect_subtree_leaves(Table* table, uint32_t page_num, uint32_t height,
+                                uint32_t* leaves, uint32_t count, uint32_t max) {
+  if (height == 0) {
+    leaves[count] = page_num;
+    return count + 1;
+  }
+  void* node = table_get_page(table, page_num);
+  uint32_t num_keys = *internal_node_num_keys(node);
+  for (uint32_t i = 0; i <= num_keys && count < max; i++) {
+    count = collect_subtree_leaves(table, *internal_node_child(node, i),
+                                   height - 1, leaves, count, max);
+  }
+  return count;
+}
+
+/*
+ * 找出叶节点page_num之后的最多max个叶节点
+ * 沿父节点指针往上，依次收集每一层中右边兄弟子树的叶节点，叶节点的页号都在父节点中，不用沿链表逐个读
+ * 不加页锁: 已经提交的页不会再被修改，读到的即使是过时的树也只影响预读的效果
+ */
+uint32_t collect_next_leaves(Table* table, uint32_t page_num, uint32_t* leaves,
+                             uint32_t max) {
+  uint32_t count = 0;
+  uint32_t child = page_num;
+  void* node = table_get_page(table, page_num);
+  for (uint32_t height = 1; count < max && !is_node_root(node) &&
+                            height < BTREE_MAX_DEPTH;
+       height++) {
+    uint32_t parent_page_num = *node_parent(node);
+    void* parent = table_get_page(table, parent_page_num);
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    uint32_t index = 0;
+    while (index <= num_keys && *internal_node_child(parent, index) != child) {
+      index += 1;
+    }
+    for (uint32_t i = index + 1; i <= num_keys && count < max; i++) {
+      count = collect_subtree_leaves(table, *internal_node_child(parent, i),
+                                     height - 1, leaves, count, max);
+    }
+    child = parent_page_num;
+    node = parent;
+  }
+  return count;
+}
+
+/*
+ * 顺序预读，在游标离开当前叶节点之前调用
+ * 游标第一次沿叶节点链表移动时认为是顺序扫描，预读后面的READAHEAD_LEAVES个叶节点(包括马上要读的下一个)，
+ * 马上要读的页就在这一批中，所以等这一批读完；
+ * 之后每离开上一批的中间一页时异步预读下一批，游标处理后半批的同时I/O线程在读，读到那一批末尾时后面的页已经在缓存中
+ */
+void cursor_readahead(Cursor* cursor) {
+  if (cursor->readahead_marker != 0 &&
+      cursor->readahead_marker != cursor->page_num) {
+    return;
+  }
+  bool wait = (cursor->readahead_marker == 0);
+  uint32_t leaves[READAHEAD_LEAVES];
+  uint32_t count = collect_next_leaves(cursor->table, cursor->page_num, leaves,
+                                       READAHEAD_LEAVES);
+  cursor->readahead_marker = count > 0 ? leaves[count / 2] : 0;
+  pager_readahead(cursor->table->pager, leaves, count, wait);
+}
+
+/*
+ * 游标停在叶节点page_num的开头
+ * 不逐行读取的遍历(count(*)、vacuum、.analyze)也用游标记录在叶节点链表上的位置
+ */
+void cursor_init(Cursor* cursor, Table* table, uint32_t page_num) {
+  cursor->table = table;
+  cursor->page_num = page_num;
+  cursor->cell_num = 0;
+  cursor->end_of_table = false;
+  cursor->readahead_marker = 0;
+}
+
+/*
+ * 沿叶节点链表移动到下一个叶节点的开头，移动之前预读
+ * 返回下一个叶节点的页号，0表示已经是最后一个叶节点；页锁由调用者负责
+ */
+uint32_t cursor_next_leaf(Cursor* cursor) {
+  void* node = table_get_page(cursor->table, cursor->page_num);
+  uint32_t next_page_num = *leaf_node_next_leaf(node);
+  if (next_page_num == 0) {
+    cursor->end_of_table = true;
+    return 0;
+  }
+  cursor_readahead(cursor);
+  cursor->page_num = next_page_num;
+  cursor->cell_num = 0;
+  return next_page_num;
+}
+
+void cursor_advance(Cursor* cursor) {
+  uint32_t page_num = cursor->page_num;
+  void* node = table_get_page(cursor->table, page_num);
+
+  cursor->cell_num += 1;
+  if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
+    uint32_t next_page_num = cursor_next_leaf(cursor);
+    if (next_page_num != 0) {
+      // 先锁住下一个叶节点再释放当前叶节点
+      table_latch(cursor->table, next_page_num, LATCH_SHARED);
+      table_unlatch(cursor->table, page_num);
+    }
+  }
+}
+
+/*
+ * 返回指向第一个key不小于key的行的游标
+ * key比所在叶节点中所有的key都大时，从下一个叶节点的开头开始
+ */
+Cursor* table_seek(Table* table, uint32_t key) {
+  Cursor* cursor = table_find(table, key);
+
+  void* node = table_get_page(table, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  cursor->end_of_table = (num_cells == 0);
+  if (num_cells > 0 && cursor->cell_num >= num_cells) {
+    cursor->cell_num = num_cells - 1;
+    cursor_advance(cursor);
+  }
+
+  return cursor;
+}
+
+uint64_t wal_checksum(WalFrameHeader* header, void* page) {
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  uint8_t* bytes = (uint8_t*)header;
+  for (uint32_t i = 0; i < 2 * sizeof(uint32_t); i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211ULL;
+  }
+  bytes = page;
+  for (uint32_t i = 0; i < PAGE_SIZE; i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+/*
+ * 崩溃恢复: 把预写日志中完整提交的事务写回数据库文件，然后清空日志
+ * 最后一个事务没有写完(没有commit帧或者校验和不对)时丢弃它
+ */
+void wal_recover(int fd, int wal_fd) {
+  size_t frame_size = sizeof(WalFrameHeader) + PAGE_SIZE;
+  uint8_t* pending = NULL;
+  uint32_t num_pending = 0;
+  uint32_t pending_capacity = 0;
+  bool applied = false;
+
+  lseek(wal_fd, 0, SEEK_SET);
+  while (true) {
+    if (num_pending == pending_capacity) {
+      pending_capacity = pending_capacity ? pending_capacity * 2 : 16;
+      pending = realloc(pending, pending_capacity * frame_size);
+    }
+    uint8_t* frame = pending + num_pending * frame_size;
+    if (read(wal_fd, frame, frame_size) != (ssize_t)frame_size) {
+      break;
+    }
+    WalFrameHeader* header = (WalFrameHeader*)frame;
+    if (header->checksum != wal_checksum(header, frame + sizeof(WalFrameHeader))) {
+      break;
+    }
+    num_pending += 1;
+    if (!header->commit) {
+      continue;
+    }
+
+    for (uint32_t i = 0; i < num_pending; i++) {
+      uint8_t* committed = pending + i * frame_size;
+      uint32_t page_num = ((WalFrameHeader*)committed)->page_num;
+      if (pwrite(fd, committed + sizeof(WalFrameHeader), PAGE_SIZE,
+                 (off_t)page_num * PAGE_SIZE) == -1) {
+        printf("Error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+    }
+    num_pending = 0;
+    applied = true;
+  }
+  free(pending);
+
+  if (applied) {
+    fsync(fd);
+  }
+  if (ftruncate(wal_fd, 0) == -1) {
+    printf("Error truncating write-ahead log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  lseek(wal_fd, 0, SEEK_SET);
+}
+
+/*
+ * 映射共享内存，名字由数据库文件的设备号和inode决定，打开同一个文件的进程映射同一块内存
+ * 第一个打开的进程负责清空里面上一次留下的内容
+ */
+void shared_memory_open(Pager* pager, bool first_opener) {
+  struct stat file_stat;
+  fstat(pager->file_descriptor, &file_stat);
+  pager->shm_name = malloc(64);
+  snprintf(pager->shm_name, 64, "/db-%llx-%llx",
+           (unsigned long long)file_stat.st_dev,
+           (unsigned long long)file_stat.st_ino);
+
+  int shm_fd = shm_open(pager->shm_name, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+  size_t header_size = (sizeof(SharedHeader) + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+  size_t size = header_size + (size_t)SHARED_CACHE_PAGES * PAGE_SIZE;
+  if (shm_fd == -1 || (first_opener && ftruncate(shm_fd, size) == -1)) {
+    printf("Unable to open shared memory: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  if (memory == MAP_FAILED) {
+    printf("Unable to map shared memory: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pager->shared_header = memory;
+  pager->shared_frames = memory + header_size;
+
+  if (first_opener) {
+    memset(pager->shared_header, 0, sizeof(SharedHeader));
+    pager->shared_header->num_pages = pager->num_pages;
+    file_lock_or_exit(pager->file_descriptor, LOCK_OPEN_BYTE, F_RDLCK);
+  }
+  pager->seen_change_counter = pager->shared_header->change_counter;
+  pager->num_pages = pager->shared_header->num_pages;
+}
+
+/*
+ * 让之后对fd的读写绕过内核页缓存
+ * 直接I/O要求缓冲区、偏移和长度按块对齐: 页帧从mmap的整块中按页切出，
+ * 每次读写整页，偏移都是PAGE_SIZE的倍数，满足512字节和4 KiB的逻辑块
+ * 预写日志是追加写的小帧，仍然经过内核缓存
+ */
+bool file_set_direct(int fd) {
+#if defined(O_DIRECT)
+  int flags = fcntl(fd, F_GETFL);
+  return flags != -1 && fcntl(fd, F_SETFL, flags | O_DIRECT) != -1;
+#elif defined(F_NOCACHE)
+  return fcntl(fd, F_NOCACHE, 1) != -1;
+#else
+  errno = EINVAL;
+  return false;
+#endif
+}
+
+/*
+ * 打开数据库文件
+ * 将文件转成Pager对象
+ */
+Pager* pager_open(const char* filename, bool shared, bool direct) {
+  int fd = open(filename,
+                O_RDWR |      
+                    O_CREAT,  
+                S_IWUSR |     
+                    S_IRUSR   
+                );
+
+  if (fd == -1) {
+    printf("Unable to open file\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // 默认独占整个文件；共享模式下第一个打开的进程先独占，做完恢复和初始化后再降级
+  bool first_opener = file_lock(fd, LOCK_OPEN_BYTE, F_WRLCK, false);
+  bool locked = first_opener;
+  // 可能有另一个共享模式的进程正在初始化，稍等一会儿
+  for (int i = 0; shared && !locked && i < 100; i++) {
+    locked = file_lock(fd, LOCK_OPEN_BYTE, F_RDLCK, false);
+    if (!locked) {
+      usleep(10000);
+    }
+  }
+  if (!locked) {
+    printf("Database is locked by another process.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  char* wal_path = malloc(strlen(filename) + 5);
+  sprintf(wal_path, "%s-wal", filename);
+  int wal_fd = open(wal_path, O_RDWR | O_CREAT | (shared ? O_APPEND : 0),
+                    S_IWUSR | S_IRUSR);
+  if (wal_fd == -1) {
+    printf("Unable to open write-ahead log\n");
+    exit(EXIT_FAILURE);
+  }
+  if (first_opener) {
+    wal_recover(fd, wal_fd);
+  }
+  // 恢复时从日志拷贝的页不对齐，恢复完成后才切换到直接I/O
+  if (direct && !file_set_direct(fd)) {
+    printf("Direct I/O is not supported for this file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  off_t file_length = lseek(fd, 0, SEEK_END);
+
+  Pager* pager = malloc(sizeof(Pager));
+  pager->shared = shared;
+  pager->direct = direct;
+  pager->shared_header = NULL;
+  pager->shared_frames = NULL;
+  pager->shm_name = NULL;
+  pager->seen_change_counter = 0;
+  pager->num_data_readers = 0;
+  pager->num_file_writers = 0;
+  pthread_mutex_init(&(pager->data_lock), NULL);
+  pthread_mutex_init(&(pager->file_writer_lock), NULL);
+  pager->free_frames = NULL;
+  pager->frame_chunks = NULL;
+  pager->num_frame_chunks = 0;
+  pager->frame_chunk_used = 0;
+  pthread_mutex_init(&(pager->frame_lock), NULL);
+  pager->free_versions = NULL;
+  memset(&(pager->stats), 0, sizeof(PagerStats));
+  pager->wal_file_descriptor = wal_fd;
+  pager->wal_path = wal_path;
+  pager->wal_num_frames = 0;
+  pager->durable_seq = 0;
+  pager->checkpoint_seq = 0;
+  memset(&(pager->unsynced_pages), 0, sizeof(PageList));
+  memset(&(pager->unwritten_pages), 0, sizeof(PageList));
+  pager->num_writers = 0;
+  pager->exclusive_writer = false;
+  pthread_mutex_init(&(pager->writer_lock), NULL);
+  pthread_cond_init(&(pager->writer_cond), NULL);
+  pager->file_descriptor = fd;
+  io_backend_open(&(pager->io), fd);
+  pager->readaheads = malloc(READAHEAD_SLOTS * sizeof(Readahead));
+  pager->free_readaheads = NULL;
+  for (uint32_t i = 0; i < READAHEAD_SLOTS; i++) {
+    pager->readaheads[i].next_free = pager->free_readaheads;
+    pager->free_readaheads = &(pager->readaheads[i]);
+  }
+  pager->file_length = file_length;
+  pager->num_pages = (file_length / PAGE_SIZE);
+
+  if (file_length % PAGE_SIZE != 0) {
+    printf("Db file is not a whole number of pages. Corrupt file.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // 页表只分配根目录，中间目录和页表块在访问到对应的页时再分配
+  pager->page_table = calloc(
+      (size_t)1 << (32 - PAGE_TABLE_CHUNK_BITS - PAGE_TABLE_DIRECTORY_BITS),
+      sizeof(PageEntry**));
+  pager->page_table_limit = 0;
+  pthread_mutex_init(&(pager->page_table_lock), NULL);
+  pthread_mutex_init(&(pager->lock), NULL);
+  pthread_cond_init(&(pager->readahead_done), NULL);
+  pager->commit_seq = 0;
+  pager->vacuum_position = 0;
+  pager->vacuum_seq = 0;
+  pager->cache_pages = PAGE_CACHE_PAGES;
+  pager->num_cached_pages = 0;
+  pager->clock_hand = 0;
+  pager->evict_epoch = 0;
+  pager->epoch_transactions[0] = 0;
+  pager->epoch_transactions[1] = 0;
+  for (uint32_t i = 0; i < 2; i++) {
+    pager->evicted_frames[i] = NULL;
+    pager->num_evicted_frames[i] = 0;
+    pager->evicted_frames_capacity[i] = 0;
+  }
+  pthread_mutex_init(&(pager->evict_lock), NULL);
+  pager->snapshots_head = NULL;
+  pager->snapshots_tail = NULL;
+  pager->retired_head = NULL;
+  pager->retired_tail = NULL;
+  pthread_mutex_init(&(pager->version_lock), NULL);
+
+  if (shared) {
+    shared_memory_open(pager, first_opener);
+  }
+
+  return pager;
+}
+
+/*
+ * 打开数据库文件，将其封装成Pager对象
+ * 再将Pager对象封装成Table对象
+ */
+Table* table_open(const char* filename, bool shared, bool direct) {
+  Pager* pager = pager_open(filename, shared, direct);
+
+  Table* table = malloc(sizeof(Table));
+  table->pager = pager;
+  table->root_page_num = 0;
+  table->transaction = NULL;
+  table->named_statements = NULL;
+  table->arena = arena_new();
+  table->statement_stats = calloc(1, sizeof(StatementStats));
+  table->timer = false;
+  table->nowait = false;
+  table->profile = NULL;
+  table->num_scan_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (table->num_scan_threads < 1) {
+    table->num_scan_threads = 1;
+  }
+
+  if (pager->num_pages == 0) {
+    //如果是一个空文件则自动创建一页作为BTree的根节点
+    void* root_node = get_page(pager, 0);
+    initialize_leaf_node(root_node);
+    set_node_root(root_node, true);
+    // 算作一次提交，写回时根节点和其他修改过的页一样写入文件
+    pager->commit_seq += 1;
+    pager_track_page(pager, 0, page_entry(pager, 0)->seq);
+    page_entry(pager, 0)->seq = pager->commit_seq;
+
+    // 共享模式下只有第一个进程会看到空文件，马上写入根节点，之后打开的进程都能读到
+    if (shared) {
+      uint32_t root_page_num = 0;
+      pager_publish(pager, &root_page_num, 1);
+    }
+  }
+
+  return table;
+}
+
+Table* db_open(const char* filename, bool shared) {
+  return table_open(filename, shared, false);
+}
+
+Table* db_open_direct(const char* filename, bool shared) {
+  return table_open(filename, shared, true);
+}
+
+/*
+ * 把一组按页号排好序的页写入数据库文件，物理上连续的页合并成一个请求，整批交给I/O后端
+ */
+void pager_write_pages(Pager* pager, uint32_t* page_nums, void** pages,
+                       uint32_t count) {
+  if (count == 0) {
+    return;
+  }
+  IoRequest* requests = malloc(count * sizeof(IoRequest));
+  struct iovec* iov = malloc(count * sizeof(struct iovec));
+  uint32_t num_requests = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    off_t page_num = page_nums[i];
+    iov[i].iov_base = pages[i];
+    iov[i].iov_len = PAGE_SIZE;
+    IoRequest* last = num_requests > 0 ? &(requests[num_requests - 1]) : NULL;
+    if (last != NULL && last->num_iov < IO_MAX_REQUEST_PAGES &&
+        last->offset + (off_t)last->num_iov * PAGE_SIZE ==
+            page_num * PAGE_SIZE) {
+      last->num_iov += 1;
+    } else {
+      IoRequest request = {true, page_num * PAGE_SIZE, &(iov[i]), 1, 0};
+      requests[num_requests] = request;
+      num_requests += 1;
+    }
+  }
+
+  uint64_t probe_start = DB_PROBE_CLOCK(page__flush);
+  pager_submit(pager, requests, num_requests);
+  for (uint32_t i = 0; i < num_requests; i++) {
+    IoRequest* request = &(requests[i]);
+    if (request->result != (ssize_t)request->num_iov * PAGE_SIZE) {
+      printf("Error writing: %d\n",
+             request->result < 0 ? (int)-request->result : 0);
+      exit(EXIT_FAILURE);
+    }
+    pager_count(&(pager->stats.file_writes), 1);
+    pager_count(&(pager->stats.file_write_bytes), request->result);
+    DB_PROBE2(page__flush, request->offset / PAGE_SIZE,
+              DB_PROBE_ELAPSED(probe_start));
+  }
+  free(requests);
+  free(iov);
+}
+
+/*
+ * 把上次写回之后提交过的页(unwritten_pages)写回数据库文件，从文件读入后没有修改过的页不用再写
+ * 没有写回的页不会被淘汰，都还在缓存中
+ */
+void pager_write_back(Pager* pager) {
+  // 按页号排序，相邻的页合并成一次写
+  PageList* list = &(pager->unwritten_pages);
+  qsort(list->page_nums, list->count, sizeof(uint32_t), compare_keys);
+  uint32_t* page_nums = malloc(list->count * sizeof(uint32_t));
+  void** pages = malloc(list->count * sizeof(void*));
+  uint32_t num_dirty = 0;
+  for (uint32_t i = 0; i < list->count; i++) {
+    uint32_t page_num = list->page_nums[i];
+    PageEntry* entry = page_entry(pager, page_num);
+    if (entry->page == NULL || page_num >= pager->num_pages ||
+        entry->seq <= pager->checkpoint_seq) {
+      continue;
+    }
+    page_nums[num_dirty] = page_num;
+    pages[num_dirty] = entry->page;
+    num_dirty += 1;
+  }
+  pager_write_pages(pager, page_nums, pages, num_dirty);
+  free(page_nums);
+  free(pages);
+  list->count = 0;
+  pager->checkpoint_seq = pager->commit_seq;
+  // 写回的页在文件中了，淘汰后可以重新读入
+  if (pager->file_length < (off_t)pager->num_pages * PAGE_SIZE) {
+    pager->file_length = (off_t)pager->num_pages * PAGE_SIZE;
+  }
+}
+
+/*
+ * 检查点: 把所有已经提交的页写回数据库文件并同步，之后预写日志就可以清空了
+ * 调用时没有其他写操作在进行
+ */
+void pager_checkpoint(Pager* pager) {
+  // 共享模式下每次提交都已经写回了数据库文件，只需要同步
+  if (!pager->shared) {
+    pager_write_back(pager);
+  }
+  fsync(pager->file_descriptor);
+  pager_count(&(pager->stats.syncs), 1);
+
+  if (ftruncate(pager->wal_file_descriptor, 0) == -1) {
+    printf("Error truncating write-ahead log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  lseek(pager->wal_file_descriptor, 0, SEEK_SET);
+  pager->wal_num_frames = 0;
+  pager->unsynced_pages.count = 0;
+  pager->durable_seq = pager->commit_seq;
+}
+
+/*
+ * 写出缓冲区中的帧，帧的页数据在放入之后才填写，所以校验和在这里计算
+ */
+void wal_batch_flush(WalBatch* batch) {
+  Pager* pager = batch->pager;
+  size_t frame_size = sizeof(WalFrameHeader) + PAGE_SIZE;
+  for (uint32_t i = 0; i < batch->num_frames; i++) {
+    uint8_t* frame = batch->frames + i * frame_size;
+    WalFrameHeader* header = (WalFrameHeader*)frame;
+    header->checksum = wal_checksum(header, frame + sizeof(WalFrameHeader));
+  }
+
+  ssize_t bytes_written = write(pager->wal_file_descriptor, batch->frames,
+                                batch->num_frames * frame_size);
+  if (bytes_written != (ssize_t)(batch->num_frames * frame_size)) {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pager_count(&(pager->stats.wal_writes), batch->num_frames);
+  pager_count(&(pager->stats.wal_write_bytes), bytes_written);
+  batch->num_frames = 0;
+}
+
+void wal_batch_begin(WalBatch* batch, Pager* pager, uint32_t num_frames) {
+  batch->pager = pager;
+  batch->frames =
+      malloc(WAL_BATCH_FRAMES * (sizeof(WalFrameHeader) + PAGE_SIZE));
+  batch->num_frames = 0;
+  batch->num_remaining = num_frames;
+}
+
+/*
+ * 放入一帧，返回帧中页数据的位置，由调用者填写
+ */
+void* wal_batch_add(WalBatch* batch, uint32_t page_num) {
+  if (batch->num_frames == WAL_BATCH_FRAMES) {
+    wal_batch_flush(batch);
+  }
+  uint8_t* frame =
+      batch->frames + batch->num_frames * (sizeof(WalFrameHeader) + PAGE_SIZE);
+  WalFrameHeader* header = (WalFrameHeader*)frame;
+  batch->num_remaining -= 1;
+  header->page_num = page_num;
+  header->commit = (batch->num_remaining == 0);
+  batch->num_frames += 1;
+  return frame + sizeof(WalFrameHeader);
+}
+
+/*
+ * 写出剩下的帧，同步一次
+ */
+void wal_batch_end(WalBatch* batch) {
+  Pager* pager = batch->pager;
+  if (batch->num_frames > 0) {
+    wal_batch_flush(batch);
+  }
+  free(batch->frames);
+  fsync(pager->wal_file_descriptor);
+  pager_count(&(pager->stats.syncs), 1);
+  // 共享模式下其他进程也会追加，以文件大小为准
+  pager->wal_num_frames = lseek(pager->wal_file_descriptor, 0, SEEK_END) /
+                          (sizeof(WalFrameHeader) + PAGE_SIZE);
+}
+
+/*
+ * 显式事务提交后持久化: 把上次持久化之后提交过的页(包括之前自动提交的语句改过的页)
+ * 作为一个事务写入预写日志，只同步一次；这些页记在unsynced_pages中，开销和提交的页数成正比，和缓存大小无关
+ * 每次write最多WAL_BATCH_FRAMES帧，不会为了提交很多页把它们全部复制一份
+ * 调用时持有独占的写权限，pages中都是已经提交的版本
+ */
+void pager_sync(Pager* pager) {
+  PageList* list = &(pager->unsynced_pages);
+  uint32_t num_frames = 0;
+  for (uint32_t i = 0; i < list->count; i++) {
+    uint32_t page_num = list->page_nums[i];
+    PageEntry* entry = page_entry(pager, page_num);
+    // 不再需要的页从列表中去掉，num_frames之前的都要写入日志
+    if (entry->page != NULL && page_num < pager->num_pages &&
+        entry->seq > pager->durable_seq) {
+      list->page_nums[num_frames] = page_num;
+      num_frames += 1;
+    }
+  }
+  list->count = 0;
+  if (num_frames == 0) {
+    pager->durable_seq = pager->commit_seq;
+    return;
+  }
+
+  WalBatch batch;
+  wal_batch_begin(&batch, pager, num_frames);
+  for (uint32_t i = 0; i < num_frames; i++) {
+    uint32_t page_num = list->page_nums[i];
+    memcpy(wal_batch_add(&batch, page_num), page_entry(pager, page_num)->page,
+           PAGE_SIZE);
+  }
+  wal_batch_end(&batch);
+  pager->durable_seq = pager->commit_seq;
+}
+
+void print_tree(FILE* output, Pager* pager, uint32_t page_num,
+                uint32_t indentation_level){
+  pager_latch(pager, page_num, LATCH_SHARED);
+  void* node = get_page(pager, page_num);
+  uint32_t num_keys, child;
+
+  switch (get_node_type(node)) {
+    case (NODE_LEAF):
+      num_keys = *leaf_node_num_cells(node);
+      indent(output, indentation_level);
+      fprintf(output, "- leaf (size %d)\n", num_keys);
+      for (uint32_t i = 0; i < num_keys; i++) {
+        indent(output, indentation_level + 1);
+        fprintf(output, "- %d\n", *leaf_node_key(node, i));
+      }
+      break;
+    case (NODE_INTERNAL):
+      num_keys = *internal_node_num_keys(node);
+      indent(output, indentation_level);
+      fprintf(output, "- internal (size %d)\n", num_keys);
+      for (uint32_t i = 0; i < num_keys; i++) {
+        child = *internal_node_child(node, i);
+        print_tree(output, pager, child, indentation_level + 1);
+
+        indent(output, indentation_level + 1);
+        fprintf(output, "- key %d\n", *internal_node_key(node, i));
+      }
+      child = *internal_node_right_child(node);
+      print_tree(output, pager, child, indentation_level + 1);
+      break;
+  }
+  pager_unlatch(pager, page_num);
+}
+
+/*
+ * 对外接口的读操作
+ * 显式事务中直接读事务自己的草稿，否则开一个只读事务固定快照
+ * reader是读操作使用的Table副本，游标从会话的arena分配，由调用者退回
+ */
+void db_read_begin(Table* table, Table* reader, Transaction* transaction) {
+  pager_lock_shared(table->pager);
+  *reader = *table;
+  if (table->transaction == NULL) {
+    transaction_begin(table, transaction, true);
+    reader->transaction = transaction;
+  }
+}
+
+void db_read_end(Table* table, Table* reader) {
+  if (table->transaction == NULL) {
+    transaction_end(table, reader->transaction);
+  }
+  pager_unlock_shared(table->pager);
+}
+
+/*
+ * .analyze的结果
+ * num_levels       树的层数，根是第0层
+ * pages_per_level  每层的页数，leaf_level标记哪一层是叶节点
+ * leaf_fill        叶节点填充率的分布，第i项是填充率在[i*10%, (i+1)*10%)的叶节点数，最后一项是全满的
+ * num_rows         总行数
+ * num_leaves       叶节点链表上的叶节点数
+ * leaf_jumps       叶节点链表中下一个叶节点不是物理上紧跟着的下一页的次数
+ * leaf_jump_pages  叶节点链表中相邻叶节点页号之差的绝对值之和
+ * tree_pages       树中的页数，文件中的其他页没有被使用
+ * leftmost_leaf    叶节点链表的第一个叶节点
+ */
+typedef struct TreeAnalysis {
+  uint32_t num_levels;
+  uint64_t pages_per_level[BTREE_MAX_DEPTH];
+  bool leaf_level[BTREE_MAX_DEPTH];
+  uint64_t leaf_fill[11];
+  uint64_t num_rows;
+  uint64_t num_leaves;
+  uint64_t leaf_jumps;
+  uint64_t leaf_jump_pages;
+  uint64_t tree_pages;
+  uint32_t leftmost_leaf;
+}TreeAnalysis;
+
+void analyze_node(Table* reader, uint32_t page_num, uint32_t level,
+                  TreeAnalysis* analysis) {
+  if (level >= BTREE_MAX_DEPTH) {
+    return;
+  }
+  void* node = table_get_page(reader, page_num);
+  analysis->tree_pages += 1;
+  analysis->pages_per_level[level] += 1;
+  if (level + 1 > analysis->num_levels) {
+    analysis->num_levels = level + 1;
+  }
+
+  if (get_node_type(node) == NODE_LEAF) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    analysis->leaf_level[level] = true;
+    analysis->num_rows += num_cells;
+    analysis->leaf_fill[num_cells * 10 / LEAF_NODE_MAX_CELLS] += 1;
+    // 深度优先遍历遇到的第一个叶节点是最左边的叶节点
+    if (analysis->pages_per_level[level] == 1) {
+      analysis->leftmost_leaf = page_num;
+    }
+    return;
+  }
+
+  uint32_t num_keys = *internal_node_num_keys(node);
+  for (uint32_t i = 0; i < num_keys; i++) {
+    analyze_node(reader, *internal_node_child(node, i), level + 1, analysis);
+  }
+  analyze_node(reader, *internal_node_right_child(node), level + 1, analysis);
+}
+
+/*
+ * .analyze: 在一个快照上遍历一次整棵树，不输出key
+ * 报告每层的页数、叶节点填充率分布、叶节点链表的物理顺序和空闲页，
+ * 用来判断什么时候需要整理(vacuum)
+ */
+void analyze_tree(FILE* output, Table* table) {
+  Table reader;
+  Transaction transaction;
+  db_read_begin(table, &reader, &transaction);
+
+  TreeAnalysis analysis;
+  memset(&analysis, 0, sizeof(TreeAnalysis));
+  analyze_node(&reader, reader.root_page_num, 0, &analysis);
+
+  // 沿叶节点链表统计物理上不连续的跳转
+  Cursor cursor;
+  cursor_init(&cursor, &reader, analysis.leftmost_leaf);
+  uint32_t page_num = analysis.leftmost_leaf;
+  while (true) {
+    analysis.num_leaves += 1;
+    uint32_t next_page_num = cursor_next_leaf(&cursor);
+    if (next_page_num == 0) {
+      break;
+    }
+    if (next_page_num != page_num + 1) {
+      analysis.leaf_jumps += 1;
+    }
+    analysis.leaf_jump_pages += next_page_num > page_num
+                                    ? next_page_num - page_num
+                                    : page_num - next_page_num;
+    page_num = next_page_num;
+  }
+  uint32_t num_pages = table->pager->num_pages;
+  db_read_end(table, &reader);
+
+  fprintf(output, "Tree analysis:\n");
+  fprintf(output, "depth: %u\n", analysis.num_levels);
+  for (uint32_t i = 0; i < analysis.num_levels; i++) {
+    fprintf(output, "level %u: %llu %s\n", i,
+            (unsigned long long)analysis.pages_per_level[i],
+            analysis.leaf_level[i] ? "leaf" : "internal");
+  }
+  fprintf(output, "rows: %llu\n", (unsigned long long)analysis.num_rows);
+
+  uint64_t leaf_pages = analysis.num_leaves;
+  fprintf(output, "leaf fill: avg %.1f%%\n",
+          leaf_pages == 0 ? 0.0
+                          : 100.0 * analysis.num_rows /
+                                (leaf_pages * LEAF_NODE_MAX_CELLS));
+  for (uint32_t i = 0; i < 10; i++) {
+    if (analysis.leaf_fill[i] > 0) {
+      fprintf(output, "leaf fill %u-%u%%: %llu\n", i * 10, i * 10 + 9,
+              (unsigned long long)analysis.leaf_fill[i]);
+    }
+  }
+  if (analysis.leaf_fill[10] > 0) {
+    fprintf(output, "leaf fill 100%%: %llu\n",
+            (unsigned long long)analysis.leaf_fill[10]);
+  }
+
+  uint64_t num_links = analysis.num_leaves - 1;
+  fprintf(output,
+          "leaf chain: %llu leaves, %llu out-of-order links, avg distance "
+          "%.1f pages\n",
+          (unsigned long long)analysis.num_leaves,
+          (unsigned long long)analysis.leaf_jumps,
+          num_links == 0 ? 0.0 : (double)analysis.leaf_jump_pages / num_links);
+  fprintf(output, "free pages: %llu of %u\n",
+          (unsigned long long)(num_pages - analysis.tree_pages), num_pages);
+  fprintf(output, "bytes per row: %.1f (row size %u)\n",
+          analysis.num_rows == 0
+              ? 0.0
+              : (double)num_pages * PAGE_SIZE / analysis.num_rows,
+          ROW_SIZE);
+}
+
+/*
+ * 释放会话中用prepare命名的预编译语句
+ */
+void free_named_statements(Table* table) {
+  NamedStatement* named = table->named_statements;
+  while (named != NULL) {
+    NamedStatement* next = named->next;
+    free(named->name);
+    free(named->prepared);
+    free(named);
+    named = next;
+  }
+  table->named_statements = NULL;
+}
+
+/*
+ * 写入数据到磁盘并释放
+ * 关闭数据库文件
+ * 释放pager和table
+ */
+void db_close(Table* table) {
+  Pager* pager = table->pager;
+
+  // 没有提交的显式事务直接丢弃
+  if (table->transaction != NULL) {
+    transaction_rollback(table);
+  }
+
+  // 共享模式下所有提交都已经写回文件，私有缓存可能比文件旧，不能再写回
+  if (!pager->shared) {
+    pager_write_back(pager);
+  }
+  // I/O线程退出前会做完队列中的异步预读
+  io_backend_close(&(pager->io));
+  free(pager->readaheads);
+
+  // 共享模式下最后一个关闭的进程负责清理预写日志和共享内存
+  bool last_closer = !pager->shared ||
+                     file_lock(pager->file_descriptor, LOCK_OPEN_BYTE, F_WRLCK, false);
+
+  // 删除预写日志之前，日志中的修改必须已经落盘
+  if (last_closer && (pager->wal_num_frames > 0 || pager->shared)) {
+    fsync(pager->file_descriptor);
+    pager_count(&(pager->stats.syncs), 1);
+  }
+
+  int result = close(pager->file_descriptor);
+  if (result == -1) {
+    printf("Error closing db file.\n");
+    exit(EXIT_FAILURE);
+  }
+  uint32_t chunk_pages = 1 << PAGE_TABLE_CHUNK_BITS;
+  for (uint64_t first = 0; first < pager->page_table_limit;
+       first += chunk_pages) {
+    PageEntry* chunk = page_table_chunk(pager, first);
+    for (uint32_t i = 0; chunk != NULL && i < chunk_pages; i++) {
+      frame_free(pager, chunk[i].page);
+      chunk[i].page = NULL;
+    }
+  }
+  // 关闭时已经没有活跃快照，所有旧版本都可以回收
+  pager_collect_versions(pager);
+  while (pager->free_versions != NULL) {
+    PageVersion* version = pager->free_versions;
+    pager->free_versions = version->older;
+    free(version);
+  }
+  page_table_free(pager);
+  for (uint32_t i = 0; i < pager->num_frame_chunks; i++) {
+    munmap(pager->frame_chunks[i], (size_t)FRAME_CHUNK_PAGES * PAGE_SIZE);
+  }
+  free(pager->frame_chunks);
+  free(pager->evicted_frames[0]);
+  free(pager->evicted_frames[1]);
+  free(pager->unsynced_pages.page_nums);
+  free(pager->unwritten_pages.page_nums);
+  pthread_mutex_destroy(&(pager->frame_lock));
+  pthread_mutex_destroy(&(pager->evict_lock));
+  pthread_mutex_destroy(&(pager->lock));
+  pthread_cond_destroy(&(pager->readahead_done));
+  pthread_mutex_destroy(&(pager->version_lock));
+  pthread_mutex_destroy(&(pager->writer_lock));
+  pthread_cond_destroy(&(pager->writer_cond));
+
+  // 所有页都已经写回数据库文件，预写日志不再需要
+  close(pager->wal_file_descriptor);
+  if (last_closer) {
+    unlink(pager->wal_path);
+  }
+  free(pager->wal_path);
+  if (pager->shared) {
+    size_t header_size = (sizeof(SharedHeader) + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    munmap(pager->shared_header,
+           header_size + (size_t)SHARED_CACHE_PAGES * PAGE_SIZE);
+    if (last_closer) {
+      shm_unlink(pager->shm_name);
+    }
+    free(pager->shm_name);
+  }
+  pthread_mutex_destroy(&(pager->data_lock));
+  pthread_mutex_destroy(&(pager->file_writer_lock));
+  free(pager);
+  free_named_statements(table);
+  arena_free(table->arena);
+  free(table->statement_stats);
+  free(table);
+}
+
+/*
+ * 读取页管理器计数的快照，各项分别原子读取，并发写入时彼此之间可能差几次操作
+ */
+void db_pager_stats(Table* table, PagerStats* stats) {
+  uint64_t* source = (uint64_t*)&(table->pager->stats);
+  uint64_t* target = (uint64_t*)stats;
+  for (size_t i = 0; i < sizeof(PagerStats) / sizeof(uint64_t); i++) {
+    target[i] = __atomic_load_n(&(source[i]), __ATOMIC_RELAXED);
+  }
+}
+
+void db_pager_stats_reset(Table* table) {
+  uint64_t* counters = (uint64_t*)&(table->pager->stats);
+  for (size_t i = 0; i < sizeof(PagerStats) / sizeof(uint64_t); i++) {
+    __atomic_store_n(&(counters[i]), 0, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+ * 修改页缓存的上限，超出的干净页马上淘汰
+ */
+void db_set_cache_pages(Table* table, uint32_t num_pages) {
+  Pager* pager = table->pager;
+  pthread_mutex_lock(&(pager->lock));
+  pager->cache_pages = num_pages;
+  // 扫描两圈，第一圈清除的referenced不会让页逃过第二圈
+  pager_evict(pager, 2 * (uint64_t)pager->num_cached_pages);
+  pthread_mutex_unlock(&(pager->lock));
+}
+
+void print_pager_stats(FILE* output, PagerStats* stats) {
+  uint64_t lookups = stats->cache_hits + stats->cache_misses;
+  fprintf(output, "Pager stats:\n");
+  fprintf(output, "cache hits: %llu\n", (unsigned long long)stats->cache_hits);
+  fprintf(output, "cache misses: %llu\n",
+          (unsigned long long)stats->cache_misses);
+  fprintf(output, "cache hit ratio: %.1f%%\n",
+          lookups == 0 ? 0.0 : 100.0 * stats->cache_hits / lookups);
+  fprintf(output, "cache evictions: %llu\n",
+          (unsigned long long)stats->cache_evictions);
+  fprintf(output, "file reads: %llu (%llu bytes)\n",
+          (unsigned long long)stats->file_reads,
+          (unsigned long long)stats->file_read_bytes);
+  fprintf(output, "readahead pages: %llu\n",
+          (unsigned long long)stats->readahead_pages);
+  fprintf(output, "file writes: %llu (%llu bytes)\n",
+          (unsigned long long)stats->file_writes,
+          (unsigned long long)stats->file_write_bytes);
+  fprintf(output, "wal writes: %llu (%llu bytes)\n",
+          (unsigned long long)stats->wal_writes,
+          (unsigned long long)stats->wal_write_bytes);
+  fprintf(output, "syncs: %llu\n", (unsigned long long)stats->syncs);
+  fprintf(output, "leaf splits: %llu\n",
+          (unsigned long long)stats->leaf_splits);
+  fprintf(output, "root splits: %llu\n",
+          (unsigned long long)stats->root_splits);
+  fprintf(output, "pages allocated: %llu\n",
+          (unsigned long long)stats->pages_allocated);
+}
+
+/*
+ * 解析器Parser 
+ */
+MetaCommandResult do_meta_command(char* input, Table* table, FILE* output) {
+  if (strcmp(input, ".exit") == 0) {
+    return META_COMMAND_EXIT;
+  } else if (strcmp(input, ".btree") == 0) {
+    fprintf(output, "Tree:\n");
+    pager_lock_shared(table->pager);
+    print_tree(output, table->pager, 0, 0);
+    pager_unlock_shared(table->pager);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input, ".threads", 8) == 0) {
+    // .threads [n] 查看或设置全表扫描使用的线程数
+    char* saveptr;
+    strtok_r(input, " ", &saveptr);
+    char* threads_string = strtok_r(NULL, " ", &saveptr);
+    if (threads_string != NULL) {
+      int num_threads = atoi(threads_string);
+      if (num_threads < 1) {
+        return META_COMMAND_UNRECOGNIZED_COMMAND;
+      }
+      table->num_scan_threads = num_threads;
+    }
+    fprintf(output, "Scan threads: %d\n", table->num_scan_threads);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input, ".cachesize", 10) == 0) {
+    // .cachesize [n] 查看或设置页缓存最多保存的页数
+    char* saveptr;
+    strtok_r(input, " ", &saveptr);
+    char* pages_string = strtok_r(NULL, " ", &saveptr);
+    if (pages_string != NULL) {
+      int num_pages = atoi(pages_string);
+      if (num_pages < 1) {
+        return META_COMMAND_UNRECOGNIZED_COMMAND;
+      }
+      db_set_cache_pages(table, num_pages);
+    }
+    fprintf(output, "Cache pages: %u (%u cached)\n", table->pager->cache_pages,
+            __atomic_load_n(&(table->pager->num_cached_pages), __ATOMIC_RELAXED));
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input, ".analyze") == 0) {
+    analyze_tree(output, table);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input, ".constants") == 0) {
+    fprintf(output, "Constants:\n");
+    print_constants(output);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input, ".timer on") == 0) {
+    table->timer = true;
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input, ".timer off") == 0) {
+    table->timer = false;
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input, ".pagerstats") == 0) {
+    PagerStats stats;
+    db_pager_stats(table, &stats);
+    print_pager_stats(output, &stats);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input, ".pagerstats reset") == 0) {
+    db_pager_stats_reset(table);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input, ".stats") == 0) {
+    print_statement_stats(output, table->statement_stats);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input, ".stats reset") == 0) {
+    // 和正在记录的会话并发时可能留下个别计数，不影响之后的统计
+    memset(table->statement_stats, 0, sizeof(StatementStats));
+    return META_COMMAND_SUCCESS;
+  } else {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+}
+
+/*
+ * 记录语句中的一个参数(?)，按出现的顺序编号
+ * 超过上限的参数只计数不记录，由prepare_template报语法错误
+ */
+void statement_add_parameter(Statement* statement, ParameterType type,
+                             uint32_t key_index) {
+  if (statement->num_parameters < STATEMENT_MAX_PARAMETERS) {
+    statement->parameters[statement->num_parameters].type = type;
+    statement->parameters[statement->num_parameters].key_index = key_index;
+  }
+  statement->num_parameters += 1;
+}
+
+/*
+ * 解析一个id，end指向数字后面的位置
+ * 不是数字、超出uint32_t的范围时是语法错误，不会截断成别的id
+ */
+PrepareResult parse_id(char* string, char** end, uint32_t* id) {
+  errno = 0;
+  long long value = strtoll(string, end, 10);
+  if (*end == string || errno == ERANGE || value > UINT32_MAX) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (value < 0) {
+    return PREPARE_NEGATIVE_ID;
+  }
+  *id = value;
+  return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_insert(char* input, Statement* statement) {
+  statement->type = STATEMENT_INSERT;
+  statement->replace = false;
+
+  char* saveptr;
+  strtok_r(input, " ", &saveptr);
+  char* id_string = strtok_r(NULL, " ", &saveptr);
+  // insert or replace: 主键已存在时直接覆盖原来的行
+  if (id_string != NULL && strcmp(id_string, "or") == 0) {
+    char* replace = strtok_r(NULL, " ", &saveptr);
+    if (replace == NULL || strcmp(replace, "replace") != 0) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    statement->replace = true;
+    id_string = strtok_r(NULL, " ", &saveptr);
+  }
+  char* username = strtok_r(NULL, " ", &saveptr);
+  char* email = strtok_r(NULL, " ", &saveptr);
+
+  if (id_string == NULL || username == NULL || email == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  memset(&(statement->row_to_insert), 0, sizeof(Row));
+
+  if (strcmp(id_string, "?") == 0) {
+    statement_add_parameter(statement, PARAMETER_ID, 0);
+  } else {
+    char* end;
+    PrepareResult result =
+        parse_id(id_string, &end, &(statement->row_to_insert.id));
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    if (*end != '\0') {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+  if (strcmp(username, "?") == 0) {
+    statement_add_parameter(statement, PARAMETER_USERNAME, 0);
+  } else if (strlen(username) > COLUMN_USERNAME_SIZE) {
+    return PREPARE_STRING_TOO_LONG;
+  } else {
+    strcpy(statement->row_to_insert.username, username);
+  }
+  if (strcmp(email, "?") == 0) {
+    statement_add_parameter(statement, PARAMETER_EMAIL, 0);
+  } else if (strlen(email) > COLUMN_EMAIL_SIZE) {
+    return PREPARE_STRING_TOO_LONG;
+  } else {
+    strcpy(statement->row_to_insert.email, email);
+  }
+
+  return PREPARE_SUCCESS;
+}
+
+/*
+ * 解析更新语句: update set username=<name>, email=<email> where id = N
+ */
+PrepareResult prepare_update(char* input, Statement* statement) {
+  statement->type = STATEMENT_UPDATE;
+  statement->update_username = false;
+  statement->update_email = false;
+
+  char* saveptr;
+  strtok_r(input, " ", &saveptr);
+  char* set = strtok_r(NULL, " ", &saveptr);
+  if (set == NULL || strcmp(set, "set") != 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  char* assignment = strtok_r(NULL, " ,", &saveptr);
+  while (assignment != NULL && strcmp(assignment, "where") != 0) {
+    char* value = strchr(assignment, '=');
+    if (value == NULL) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    *value = '\0';
+    value += 1;
+
+    // 去掉两边的引号
+    size_t length = strlen(value);
+    if (length >= 2 && value[0] == '\'' && value[length - 1] == '\'') {
+      value[length - 1] = '\0';
+      value += 1;
+      length -= 2;
+    }
+
+    bool parameter = (strcmp(value, "?") == 0);
+    if (strcmp(assignment, "username") == 0) {
+      if (parameter) {
+        statement_add_parameter(statement, PARAMETER_USERNAME, 0);
+      } else if (length > COLUMN_USERNAME_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+      } else {
+        strcpy(statement->row_to_insert.username, value);
+      }
+      statement->update_username = true;
+    } else if (strcmp(assignment, "email") == 0) {
+      if (parameter) {
+        statement_add_parameter(statement, PARAMETER_EMAIL, 0);
+      } else if (length > COLUMN_EMAIL_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+      } else {
+        strcpy(statement->row_to_insert.email, value);
+      }
+      statement->update_email = true;
+    } else {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    assignment = strtok_r(NULL, " ,", &saveptr);
+  }
+
+  if (assignment == NULL ||
+      !(statement->update_username || statement->update_email)) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  char* column = strtok_r(NULL, " ", &saveptr);
+  char* operator = strtok_r(NULL, " ", &saveptr);
+  char* id_string = strtok_r(NULL, " ", &saveptr);
+  if (column == NULL || operator == NULL || id_string == NULL ||
+      strtok_r(NULL, " ", &saveptr) != NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (strcmp(column, "id") != 0 || strcmp(operator, "=") != 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  if (strcmp(id_string, "?") == 0) {
+    statement_add_parameter(statement, PARAMETER_ID, 0);
+    return PREPARE_SUCCESS;
+  }
+  char* end;
+  PrepareResult result =
+      parse_id(id_string, &end, &(statement->row_to_insert.id));
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+  if (*end != '\0') {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  return PREPARE_SUCCESS;
+}
+
+/*
+ * 解析主键条件: where id = N 或 where id in (a, b, c)
+ * in的列表必须用括号括起来，值之间用逗号分隔；=后面只能有一个值
+ */
+PrepareResult prepare_where_id(Statement* statement, char** saveptr) {
+  char* operator = strtok_r(NULL, " ", saveptr);
+  char* list = strtok_r(NULL, "", saveptr);
+
+  if (operator == NULL || list == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  bool in = (strcmp(operator, "in") == 0);
+  if (strcmp(operator, "=") != 0 && !in) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  Predicate* predicate = &(statement->predicate);
+  predicate->type = PREDICATE_ID_IN;
+  predicate->num_keys = 0;
+
+  char* position = list + strspn(list, " ");
+  if (in) {
+    if (*position != '(') {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    position += 1;
+  }
+  while (true) {
+    position += strspn(position, " ");
+    if (predicate->num_keys == PREDICATE_MAX_KEYS) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    if (*position == '?') {
+      statement_add_parameter(statement, PARAMETER_KEY, predicate->num_keys);
+      predicate->keys[predicate->num_keys] = 0;
+      position += 1;
+    } else {
+      PrepareResult result = parse_id(position, &position,
+                                      &(predicate->keys[predicate->num_keys]));
+      if (result != PREPARE_SUCCESS) {
+        return result;
+      }
+    }
+    predicate->num_keys += 1;
+
+    position += strspn(position, " ");
+    if (!in) {
+      break;
+    }
+    if (*position == ')') {
+      position += 1;
+      break;
+    }
+    if (*position != ',') {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    position += 1;
+  }
+
+  position += strspn(position, " ");
+  if (*position != '\0') {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return PREPARE_SUCCESS;
+}
+
+/*
+ * 设置username/email条件的比较内容，like时按两端的%确定匹配方式
+ */
+PrepareResult predicate_set_pattern(Predicate* predicate, const char* literal,
+                                    size_t length) {
+  predicate->type = PREDICATE_EQUALS;
+  if (predicate->like) {
+    bool leading = (length > 0 && literal[0] == '%');
+    bool trailing = (length > (leading ? 1 : 0) && literal[length - 1] == '%');
+    if (leading) {
+      literal += 1;
+      length -= 1;
+    }
+    if (trailing) {
+      length -= 1;
+    }
+    if (leading && trailing) {
+      predicate->type = PREDICATE_CONTAINS;
+    } else if (leading) {
+      predicate->type = PREDICATE_SUFFIX;
+    } else if (trailing) {
+      predicate->type = PREDICATE_PREFIX;
+    }
+  }
+
+  if (length >= predicate->column_size) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  memcpy(predicate->pattern, literal, length);
+  predicate->pattern[length] = '\0';
+  predicate->pattern_length = length;
+
+  return PREPARE_SUCCESS;
+}
+
+/*
+ * 解析where子句: where <username|email> <=|like> '<pattern>'，比较内容也可以是参数?
+ * like只支持开头和/或结尾的%通配符
+ */
+PrepareResult prepare_where(Statement* statement, char** saveptr) {
+  char* column = strtok_r(NULL, " ", saveptr);
+  if (column != NULL && strcmp(column, "id") == 0) {
+    return prepare_where_id(statement, saveptr);
+  }
+
+  char* operator = strtok_r(NULL, " ", saveptr);
+  char* literal = strtok_r(NULL, " ", saveptr);
+
+  if (column == NULL || operator == NULL || literal == NULL ||
+      strtok_r(NULL, " ", saveptr) != NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  Predicate* predicate = &(statement->predicate);
+  if (strcmp(column, "username") == 0) {
+    predicate->column_offset = USERNAME_OFFSET;
+    predicate->column_size = USERNAME_SIZE;
+  } else if (strcmp(column, "email") == 0) {
+    predicate->column_offset = EMAIL_OFFSET;
+    predicate->column_size = EMAIL_SIZE;
+  } else {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  if (strcmp(operator, "=") == 0) {
+    predicate->like = false;
+  } else if (strcmp(operator, "like") == 0) {
+    predicate->like = true;
+  } else {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  // 比较内容是参数时先当作空串，绑定时再设置
+  if (strcmp(literal, "?") == 0) {
+    statement_add_parameter(statement, PARAMETER_PATTERN, 0);
+    return predicate_set_pattern(predicate, "", 0);
+  }
+
+  // 去掉两边的引号
+  size_t length = strlen(literal);
+  if (length >= 2 && literal[0] == '\'' && literal[length - 1] == '\'') {
+    literal += 1;
+    length -= 2;
+  }
+  return predicate_set_pattern(predicate, literal, length);
+}
+
+PrepareResult prepare_select(char* input, Statement* statement) {
+  statement->type = STATEMENT_SELECT;
+  statement->aggregate = AGGREGATE_NONE;
+  statement->predicate.type = PREDICATE_NONE;
+
+  char* saveptr;
+  strtok_r(input, " ", &saveptr);
+  char* token = strtok_r(NULL, " ", &saveptr);
+  if (token == NULL) {
+    return PREPARE_SUCCESS;
+  }
+
+  if (strcmp(token, "where") != 0) {
+    if (strcmp(token, "count(*)") == 0) {
+      statement->aggregate = AGGREGATE_COUNT;
+    } else if (strcmp(token, "min(id)") == 0) {
+      statement->aggregate = AGGREGATE_MIN;
+    } else if (strcmp(token, "max(id)") == 0) {
+      statement->aggregate = AGGREGATE_MAX;
+    } else if (strcmp(token, "sum(id)") == 0) {
+      statement->aggregate = AGGREGATE_SUM;
+    } else {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    token = strtok_r(NULL, " ", &saveptr);
+  }
+
+  if (token == NULL) {
+    return PREPARE_SUCCESS;
+  }
+  if (strcmp(token, "where") != 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  return prepare_where(statement, &saveptr);
+}
+
+/*
+ * 输入是否以关键字开头，关键字后面必须是空格或者输入结束，selectfoo不是select
+ */
+bool starts_with_keyword(const char* input, const char* keyword) {
+  size_t length = strlen(keyword);
+  return strncmp(input, keyword, length) == 0 &&
+         (input[length] == '\0' || input[length] == ' ');
+}
+
+/*
+ * 解析器
+ * SQL Command Processor
+ */
+PrepareResult prepare_statement(char* input, Statement* statement) {
+  statement->num_parameters = 0;
+  if (starts_with_keyword(input, "insert")) {
+    return prepare_insert(input, statement); 
+  }
+  if (starts_with_keyword(input, "select")) {
+    return prepare_select(input, statement);
+  }
+  if (starts_with_keyword(input, "update")) {
+    return prepare_update(input, statement);
+  }
+  if (strcmp(input, "begin") == 0) {
+    statement->type = STATEMENT_BEGIN;
+    return PREPARE_SUCCESS;
+  }
+  if (strcmp(input, "commit") == 0) {
+    statement->type = STATEMENT_COMMIT;
+    return PREPARE_SUCCESS;
+  }
+  if (strcmp(input, "rollback") == 0) {
+    statement->type = STATEMENT_ROLLBACK;
+    return PREPARE_SUCCESS;
+  }
+  if (starts_with_keyword(input, "vacuum")) {
+    // vacuum重建整棵树，vacuum <n>最多搬动n次页
+    statement->type = STATEMENT_VACUUM;
+    statement->max_relocations = 0;
+    if (input[6] == ' ') {
+      int max_relocations = atoi(input + 7);
+      if (max_relocations < 1) {
+        return PREPARE_SYNTAX_ERROR;
+      }
+      statement->max_relocations = max_relocations;
+    }
+    return PREPARE_SUCCESS;
+  }
+
+  return PREPARE_UNRECOGNIZED_STATEMENT;
+}
+
+/*
+ * 解析预编译语句的模板，参数个数不能超过上限
+ */
+PrepareResult prepare_template(char* input, Statement* statement) {
+  PrepareResult result = prepare_statement(input, statement);
+  if (result == PREPARE_SUCCESS &&
+      statement->num_parameters > STATEMENT_MAX_PARAMETERS) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return result;
+}
+
+NamedStatement* find_named_statement(Table* table, const char* name) {
+  for (NamedStatement* named = table->named_statements; named != NULL;
+       named = named->next) {
+    if (strcmp(named->name, name) == 0) {
+      return named;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * prepare <name> as <statement>: 解析语句模板并以name保存在会话中，同名的会被替换
+ */
+PrepareResult prepare_named_statement(Table* table, char* input) {
+  char* saveptr;
+  strtok_r(input, " ", &saveptr);
+  char* name = strtok_r(NULL, " ", &saveptr);
+  char* as = strtok_r(NULL, " ", &saveptr);
+  char* sql = strtok_r(NULL, "", &saveptr);
+  if (name == NULL || as == NULL || strcmp(as, "as") != 0 || sql == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  sql += strspn(sql, " ");
+
+  PreparedStatement* prepared = malloc(sizeof(PreparedStatement));
+  PrepareResult result = prepare_template(sql, &(prepared->statement));
+  if (result != PREPARE_SUCCESS) {
+    free(prepared);
+    return result;
+  }
+
+  NamedStatement* named = find_named_statement(table, name);
+  if (named != NULL) {
+    free(named->prepared);
+  } else {
+    named = malloc(sizeof(NamedStatement));
+    named->name = strdup(name);
+    named->next = table->named_statements;
+    table->named_statements = named;
+  }
+  named->prepared = prepared;
+  return PREPARE_SUCCESS;
+}
+
+/*
+ * execute <name> <value> ...: 按顺序把文本形式的值绑定到name的参数上
+ */
+PrepareResult bind_named_statement(Table* table, char* input,
+                                   PreparedStatement** prepared) {
+  char* saveptr;
+  strtok_r(input, " ", &saveptr);
+  char* name = strtok_r(NULL, " ", &saveptr);
+  if (name == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  NamedStatement* named = find_named_statement(table, name);
+  if (named == NULL) {
+    return PREPARE_UNKNOWN_PREPARED_STATEMENT;
+  }
+
+  Statement* statement = &(named->prepared->statement);
+  for (uint32_t i = 0; i < statement->num_parameters; i++) {
+    char* value = strtok_r(NULL, " ", &saveptr);
+    if (value == NULL) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    ParameterType type = statement->parameters[i].type;
+    if (type == PARAMETER_ID || type == PARAMETER_KEY) {
+      char* end;
+      uint32_t id;
+      PrepareResult result = parse_id(value, &end, &id);
+      if (result != PREPARE_SUCCESS) {
+        return result;
+      }
+      if (*end != '\0') {
+        return PREPARE_SYNTAX_ERROR;
+      }
+      db_bind_int(named->prepared, i, id);
+    } else if (!db_bind_text(named->prepared, i, value)) {
+      return PREPARE_STRING_TOO_LONG;
+    }
+  }
+  if (strtok_r(NULL, " ", &saveptr) != NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  *prepared = named->prepared;
+  return PREPARE_SUCCESS;
+}
+
+/*
+ * 分割节点并且创建新的子节点 
+ * latches是写操作持有的页锁，分割一直传到上层时要把被移动的子节点也加进去
+ */
+void leaf_node_split_and_insert(Cursor* cursor, LatchSet* latches, uint32_t key,
+                                Row* value) {
+  /*
+  创建一个新的节点， 插入新数据到对应的节点中然后更新父节点。
+  */
+ 
+  void* old_node = table_get_page_for_write(cursor->table, cursor->page_num);
+  uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
+  pager_count(&(cursor->table->pager->stats.leaf_splits), 1);
+  DB_PROBE2(leaf__split, cursor->page_num, new_page_num);
+  void* new_node = table_get_page_for_write(cursor->table, new_page_num);
+  initialize_leaf_node(new_node);
+  *node_parent(new_node) = *node_parent(old_node);
+  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+  *leaf_node_next_leaf(old_node) = new_page_num;
+
+  /*
+  整理节点位置，旧节点放在左边，新节点放在右边
+  */
+  for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
+    void* destination_node;
+    if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
+      destination_node = new_node;
+    } else {
+      destination_node = old_node;
+    }
+    uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
+    void* destination = leaf_node_cell(destination_node, index_within_node);
+
+    if (i == cursor->cell_num) {
+      serialize_row(value, leaf_node_value(destination_node, index_within_node));
+      *leaf_node_key(destination_node, index_within_node) = key;
+    } else if (i > cursor->cell_num) {
+      memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
+    } else {
+      memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+    }
+  }
+  
+  *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
+  *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+
+  if (is_node_root(old_node)) {
+    return create_new_root(cursor->table, latches, get_node_max_key(old_node),
+                           new_page_num);
+  } else {
+    internal_node_insert(cursor->table, latches, *node_parent(old_node),
+                         cursor->page_num, get_node_max_key(old_node),
+                         new_page_num);
+    return;
+  }
+}
+
+/*
+ *  插入页节点
+ */
+void leaf_node_insert(Cursor* cursor, LatchSet* latches, uint32_t key,
+                      Row* value) {
+  void* node = table_get_page(cursor->table, cursor->page_num);
+
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  // 分割节点产生新的子节点
+  if (num_cells >= LEAF_NODE_MAX_CELLS) {
+    leaf_node_split_and_insert(cursor, latches, key, value);
+    return;
+  }
+  node = table_get_page_for_write(cursor->table, cursor->page_num);
+  
+  // 如果插入的数据位置不在最后面，则腾出空间并将后面的数据往后移
+  if (cursor->cell_num < num_cells) {
+    for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
+      memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1),
+             LEAF_NODE_CELL_SIZE);
+    }
+  }
+
+  // 更新节点数据，插入新数据
+  *(leaf_node_num_cells(node)) += 1;
+  //将key赋值给leaf_node_key返回值的指针变量的值
+  *(leaf_node_key(node, cursor->cell_num)) = key;
+  serialize_row(value, leaf_node_value(node, cursor->cell_num));
+}
+
+ExecuteResult execute_insert(Statement* statement, Table* table) {
+  Row* row_to_insert = &(statement->row_to_insert);
+  uint32_t key_to_insert = row_to_insert->id;
+
+  // 先用乐观模式查找，叶节点满了需要分割时再用悲观模式重新查找
+  LatchSet latches;
+  bool pessimistic = false;
+  while (true) {
+    Cursor* cursor =
+        table_find_for_write(table, key_to_insert, &latches, pessimistic);
+
+    void* node = table_get_page(table, cursor->page_num);
+    uint32_t num_cells = (*leaf_node_num_cells(node));
+
+    if (cursor->cell_num < num_cells) {
+      uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
+      if (key_at_index == key_to_insert) {
+        if (!statement->replace) {
+          latch_set_release(table->pager, &latches);
+          return EXECUTE_DUPLICATE_KEY;
+        }
+        // 行是定长的，直接在叶节点中原地覆盖，不需要移动或分割
+        node = table_get_page_for_write(table, cursor->page_num);
+        serialize_row(row_to_insert, leaf_node_value(node, cursor->cell_num));
+        release_write_latches(table, &latches);
+        return EXECUTE_SUCCESS;
+      }
+    }
+
+    if (!pessimistic && num_cells >= LEAF_NODE_MAX_CELLS) {
+      latch_set_release(table->pager, &latches);
+      pessimistic = true;
+      continue;
+    }
+
+    leaf_node_insert(cursor, &latches, row_to_insert->id, row_to_insert);
+
+    release_write_latches(table, &latches);
+    return EXECUTE_SUCCESS;
+  }
+}
+
+/*
+ * 从指定页往下一直走最左(右)边的子节点，返回到达的叶节点页码
+ * 聚合查询只需要沿着这一条路径往下走，不用遍历整棵树
+ * 返回时持有该叶节点的读锁
+ */
+uint32_t leftmost_leaf_page_num(Table* table, uint32_t page_num) {
+  table_latch(table, page_num, LATCH_SHARED);
+  void* node = table_get_page(table, page_num);
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_num = *internal_node_child(node, 0);
+    table_latch(table, child_num, LATCH_SHARED);
+    table_unlatch(table, page_num);
+    page_num = child_num;
+    node = table_get_page(table, page_num);
+  }
+  return page_num;
+}
+
+uint32_t rightmost_leaf_page_num(Table* table, uint32_t page_num) {
+  table_latch(table, page_num, LATCH_SHARED);
+  void* node = table_get_page(table, page_num);
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_num = *internal_node_right_child(node);
+    table_latch(table, child_num, LATCH_SHARED);
+    table_unlatch(table, page_num);
+    page_num = child_num;
+    node = table_get_page(table, page_num);
+  }
+  return page_num;
+}
+
+/*
+ * 聚合查询
+ * count  沿叶节点链表只读取每个叶节点的leaf_node_num_cells
+ * min    最左边叶节点的第一个key
+ * max    最右边叶节点的get_node_max_key
+ * sum需要访问每个叶节点，由execute_scan并行计算
+ */
+ExecuteResult execute_aggregate(Statement* statement, Table* table,
+                                FILE* output) {
+  uint32_t page_num;
+  uint32_t num_cells;
+  void* node;
+  Cursor cursor;
+  uint64_t result = 0;
+
+  switch (statement->aggregate) {
+    case (AGGREGATE_COUNT):
+      page_num = leftmost_leaf_page_num(table, table->root_page_num);
+      cursor_init(&cursor, table, page_num);
+      while (true) {
+        node = table_get_page(table, page_num);
+        result += *leaf_node_num_cells(node);
+        uint32_t next_page_num = cursor_next_leaf(&cursor);
+        if (next_page_num == 0) {
+          table_unlatch(table, page_num);
+          break;
+        }
+        table_latch(table, next_page_num, LATCH_SHARED);
+        table_unlatch(table, page_num);
+        page_num = next_page_num;
+      }
+      break;
+    case (AGGREGATE_MIN):
+    case (AGGREGATE_MAX):
+      if (statement->aggregate == AGGREGATE_MIN) {
+        page_num = leftmost_leaf_page_num(table, table->root_page_num);
+      } else {
+        page_num = rightmost_leaf_page_num(table, table->root_page_num);
+      }
+      node = table_get_page(table, page_num);
+      num_cells = *leaf_node_num_cells(node);
+      if (num_cells > 0) {
+        result = (statement->aggregate == AGGREGATE_MIN)
+                     ? *leaf_node_key(node, 0)
+                     : get_node_max_key(node);
+      }
+      table_unlatch(table, page_num);
+      if (num_cells == 0) {
+        fprintf(output, "(NULL)\n");
+        return EXECUTE_SUCCESS;
+      }
+      break;
+    case (AGGREGATE_SUM):
+    case (AGGREGATE_NONE):
+      break;
+  }
+
+  fprintf(output, "(%llu)\n", (unsigned long long)result);
+  return EXECUTE_SUCCESS;
+}
+
+/*
+ * 直接在页中序列化后的行上判断过滤条件，不需要反序列化
+ * 字段是以'\0'结尾的定长数组，用memcmp/memchr比较，libc中这两个函数都是向量化实现的
+ */
+bool predicate_matches(Predicate* predicate, void* value) {
+  const char* field = value + predicate->column_offset;
+  uint32_t pattern_length = predicate->pattern_length;
+
+  switch (predicate->type) {
+    case (PREDICATE_EQUALS):
+      return field[pattern_length] == '\0' &&
+             memcmp(field, predicate->pattern, pattern_length) == 0;
+    case (PREDICATE_PREFIX):
+      return memcmp(field, predicate->pattern, pattern_length) == 0;
+    case (PREDICATE_SUFFIX): {
+      const char* end = memchr(field, '\0', predicate->column_size);
+      uint32_t field_length = end - field;
+      return field_length >= pattern_length &&
+             memcmp(end - pattern_length, predicate->pattern,
+                    pattern_length) == 0;
+    }
+    case (PREDICATE_CONTAINS): {
+      if (pattern_length == 0) {
+        return true;
+      }
+      const char* end = memchr(field, '\0', predicate->column_size);
+      // 用memchr跳到下一个可能的起始字符，再用memcmp比较剩下的部分
+      const char* start = field;
+      while (end - start >= pattern_length) {
+        start = memchr(start, predicate->pattern[0],
+                       end - start - pattern_length + 1);
+        if (start == NULL) {
+          return false;
+        }
+        if (memcmp(start, predicate->pattern, pattern_length) == 0) {
+          return true;
+        }
+        start += 1;
+      }
+      return false;
+    }
+    case (PREDICATE_ID_IN): {
+      uint32_t id;
+      memcpy(&id, value + ID_OFFSET, ID_SIZE);
+      for (uint32_t i = 0; i < predicate->num_keys; i++) {
+        if (predicate->keys[i] == id) {
+          return true;
+        }
+      }
+      return false;
+    }
+    case (PREDICATE_NONE):
+      return true;
+  }
+  return true;
+}
+
+/*
+ * 并行扫描中一个线程负责的范围
+ * start_page_num  从哪个叶节点开始
+ * end_page_num    扫描到哪个叶节点为止(不包含)，0表示一直扫描到叶节点链表末尾
+ * num_matches     满足条件的行数
+ * result          聚合结果
+ * rows            非聚合查询时缓存满足条件的行，合并时按顺序打印
+ * print_rows      只有一个线程时直接打印到output，不需要缓存
+ */
+typedef struct ScanPartition {
+  Statement* statement;
+  Table* table;
+  uint32_t start_page_num;
+  uint32_t end_page_num;
+  uint64_t num_matches;
+  uint64_t result;
+  Row* rows;
+  uint64_t rows_capacity;
+  bool print_rows;
+  FILE* output;
+}ScanPartition;
+
+void scan_partition_accumulate(ScanPartition* partition, void* value) {
+  uint32_t id;
+  memcpy(&id, value + ID_OFFSET, ID_SIZE);
+  switch (partition->statement->aggregate) {
+    case (AGGREGATE_MIN):
+      if (partition->num_matches == 0 || id < partition->result) {
+        partition->result = id;
+      }
+      break;
+    case (AGGREGATE_MAX):
+      if (partition->num_matches == 0 || id > partition->result) {
+        partition->result = id;
+      }
+      break;
+    case (AGGREGATE_SUM):
+      partition->result += id;
+      break;
+    case (AGGREGATE_COUNT):
+      break;
+    case (AGGREGATE_NONE):
+      if (partition->print_rows) {
+        Row row;
+        deserialize_row(value, &row);
+        print_row(partition->output, &row);
+        break;
+      }
+      if (partition->num_matches == partition->rows_capacity) {
+        partition->rows_capacity =
+            partition->rows_capacity ? partition->rows_capacity * 2 : 64;
+        partition->rows =
+            realloc(partition->rows, partition->rows_capacity * sizeof(Row));
+      }
+      deserialize_row(value, &(partition->rows[partition->num_matches]));
+      break;
+  }
+  partition->num_matches += 1;
+}
+
+/*
+ * 工作线程：用自己的游标从start_page_num沿叶节点链表扫描到end_page_num
+ */
+void* scan_partition(void* argument) {
+  ScanPartition* partition = argument;
+  Predicate* predicate = &(partition->statement->predicate);
+
+  Cursor cursor;
+  cursor.table = partition->table;
+  cursor.page_num = partition->start_page_num;
+  cursor.cell_num = 0;
+  cursor.readahead_marker = 0;
+  table_latch(partition->table, cursor.page_num, LATCH_SHARED);
+  void* node = table_get_page(partition->table, cursor.page_num);
+  cursor.end_of_table = (*leaf_node_num_cells(node) == 0);
+
+  while (!cursor.end_of_table && (partition->end_page_num == 0 ||
+                                  cursor.page_num != partition->end_page_num)) {
+    // 没有过滤条件的sum直接按叶节点累加key
+    if (predicate->type == PREDICATE_NONE &&
+        partition->statement->aggregate == AGGREGATE_SUM) {
+      node = table_get_page(partition->table, cursor.page_num);
+      uint32_t num_cells = *leaf_node_num_cells(node);
+      uint64_t leaf_sum = 0;
+      for (uint32_t i = 0; i < num_cells; i++) {
+        leaf_sum += *leaf_node_key(node, i);
+      }
+      partition->result += leaf_sum;
+      partition->num_matches += num_cells;
+      if (partition->table->profile != NULL) {
+        __atomic_add_fetch(&(partition->table->profile->rows_examined),
+                           num_cells, __ATOMIC_RELAXED);
+      }
+      cursor.cell_num = num_cells - 1;
+      cursor_advance(&cursor);
+      continue;
+    }
+
+    void* value = cursor_value(&cursor);
+    if (predicate_matches(predicate, value)) {
+      scan_partition_accumulate(partition, value);
+    }
+    cursor_advance(&cursor);
+  }
+  table_unlatch(partition->table, cursor.page_num);
+
+  return NULL;
+}
+
+/*
+ * 全表扫描
+ * 从根往下逐层展开，直到某一层的子树数不少于扫描线程数(或者到了叶节点)，
+ * 按这一层的子树把叶节点链表分成若干段，每个线程扫描一段，
+ * 最后按顺序合并各线程的结果: 非聚合查询按顺序打印，聚合查询做归约
+ */
+ExecuteResult execute_scan(Statement* statement, Table* table,
+                           FILE* output) {
+  // 展开前的一层不到num_scan_threads个节点，展开后不会超过capacity
+  uint32_t capacity =
+      table->num_scan_threads * (INTERNAL_NODE_MAX_CELLS + 1) + 1;
+  uint32_t* subtrees = arena_alloc(table->arena, capacity * sizeof(uint32_t));
+  uint32_t* next_subtrees =
+      arena_alloc(table->arena, capacity * sizeof(uint32_t));
+  uint32_t num_subtrees = 1;
+  subtrees[0] = table->root_page_num;
+  while (num_subtrees < table->num_scan_threads) {
+    uint32_t num_next = 0;
+    bool leaf = false;
+    for (uint32_t i = 0; i < num_subtrees && !leaf; i++) {
+      table_latch(table, subtrees[i], LATCH_SHARED);
+      void* node = table_get_page(table, subtrees[i]);
+      // 叶节点都在同一层，遇到一个就说明已经展开到底
+      leaf = (get_node_type(node) == NODE_LEAF);
+      uint32_t num_keys = leaf ? 0 : *internal_node_num_keys(node);
+      for (uint32_t j = 0; !leaf && j <= num_keys; j++) {
+        next_subtrees[num_next++] = *internal_node_child(node, j);
+      }
+      table_unlatch(table, subtrees[i]);
+    }
+    if (leaf) {
+      break;
+    }
+    uint32_t* swap = subtrees;
+    subtrees = next_subtrees;
+    next_subtrees = swap;
+    num_subtrees = num_next;
+  }
+  uint32_t num_partitions = table->num_scan_threads;
+  if (num_partitions > num_subtrees) {
+    num_partitions = num_subtrees;
+  }
+
+  // 把这一层的子树平均分给每个线程，记下每段第一个子树的页码
+  uint32_t* first_children =
+      arena_alloc(table->arena, num_partitions * sizeof(uint32_t));
+  for (uint32_t i = 0; i < num_partitions; i++) {
+    first_children[i] = subtrees[i * num_subtrees / num_partitions];
+  }
+
+  // 每段从第一个子树最左边的叶节点开始，到下一段的开始为止
+  // 分割只会在叶节点链表中已有节点的后面插入新节点，所以这些边界在扫描期间一直有效
+  ScanPartition* partitions =
+      arena_alloc(table->arena, num_partitions * sizeof(ScanPartition));
+  memset(partitions, 0, num_partitions * sizeof(ScanPartition));
+  for (uint32_t i = 0; i < num_partitions; i++) {
+    partitions[i].statement = statement;
+    partitions[i].table = table;
+    partitions[i].print_rows = (num_partitions == 1);
+    partitions[i].output = output;
+    partitions[i].start_page_num =
+        leftmost_leaf_page_num(table, first_children[i]);
+    table_unlatch(table, partitions[i].start_page_num);
+    if (i > 0) {
+      partitions[i - 1].end_page_num = partitions[i].start_page_num;
+    }
+  }
+
+  if (num_partitions == 1) {
+    scan_partition(&partitions[0]);
+  } else {
+    pthread_t* threads =
+        arena_alloc(table->arena, num_partitions * sizeof(pthread_t));
+    for (uint32_t i = 0; i < num_partitions; i++) {
+      pthread_create(&threads[i], NULL, scan_partition, &partitions[i]);
+    }
+    for (uint32_t i = 0; i < num_partitions; i++) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+
+  // 合并各线程的结果
+  uint64_t num_matches = 0;
+  uint64_t result = 0;
+  for (uint32_t i = 0; i < num_partitions; i++) {
+    ScanPartition* partition = &partitions[i];
+    switch (statement->aggregate) {
+      case (AGGREGATE_NONE):
+        if (!partition->print_rows) {
+          for (uint64_t j = 0; j < partition->num_matches; j++) {
+            print_row(output, &(partition->rows[j]));
+          }
+        }
+        break;
+      case (AGGREGATE_MIN):
+        if (partition->num_matches > 0 &&
+            (num_matches == 0 || partition->result < result)) {
+          result = partition->result;
+        }
+        break;
+      case (AGGREGATE_MAX):
+        if (partition->num_matches > 0 &&
+            (num_matches == 0 || partition->result > result)) {
+          result = partition->result;
+        }
+        break;
+      case (AGGREGATE_SUM):
+        result += partition->result;
+        break;
+      case (AGGREGATE_COUNT):
+        break;
+    }
+    num_matches += partition->num_matches;
+    free(partition->rows);
+  }
+
+  if (statement->aggregate == AGGREGATE_NONE) {
+    return EXECUTE_SUCCESS;
+  }
+  if (statement->aggregate == AGGREGATE_COUNT) {
+    result = num_matches;
+  } else if (num_matches == 0 && statement->aggregate != AGGREGATE_SUM) {
+    fprintf(output, "(NULL)\n");
+    return EXECUTE_SUCCESS;
+  }
+
+  fprintf(output, "(%llu)\n", (unsigned long long)result);
+  return EXECUTE_SUCCESS;
+}
+
+/*
+ * 更新一行：查找一次后直接在叶节点中覆盖要修改的字段
+ */
+ExecuteResult execute_update(Statement* statement, Table* table) {
+  Row* new_values = &(statement->row_to_insert);
+  // 原地更新不会分割叶节点，乐观模式就够了
+  LatchSet latches;
+  Cursor* cursor = table_find_for_write(table, new_values->id, &latches, false);
+
+  void* node = table_get_page(table, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (cursor->cell_num >= num_cells ||
+      *leaf_node_key(node, cursor->cell_num) != new_values->id) {
+    latch_set_release(table->pager, &latches);
+    return EXECUTE_KEY_NOT_FOUND;
+  }
+
+  node = table_get_page_for_write(table, cursor->page_num);
+  void* value = leaf_node_value(node, cursor->cell_num);
+  if (statement->update_username) {
+    memcpy(value + USERNAME_OFFSET, &(new_values->username), USERNAME_SIZE);
+  }
+  if (statement->update_email) {
+    memcpy(value + EMAIL_OFFSET, &(new_values->email), EMAIL_SIZE);
+  }
+
+  release_write_latches(table, &latches);
+  return EXECUTE_SUCCESS;
+}
+
+/*
+ * 按主键批量查找，结果按id从小到大打印
+ */
+ExecuteResult execute_multi_get(Statement* statement, Table* table,
+                                FILE* output) {
+  Predicate* predicate = &(statement->predicate);
+  Row* rows = arena_alloc(table->arena, predicate->num_keys * sizeof(Row));
+  uint32_t num_found =
+      table_multi_get(table, predicate->keys, predicate->num_keys, rows);
+
+  uint64_t result = 0;
+  switch (statement->aggregate) {
+    case (AGGREGATE_NONE):
+      for (uint32_t i = 0; i < num_found; i++) {
+        print_row(output, &rows[i]);
+      }
+      return EXECUTE_SUCCESS;
+    case (AGGREGATE_COUNT):
+      result = num_found;
+      break;
+    case (AGGREGATE_MIN):
+      result = (num_found > 0) ? rows[0].id : 0;
+      break;
+    case (AGGREGATE_MAX):
+      result = (num_found > 0) ? rows[num_found - 1].id : 0;
+      break;
+    case (AGGREGATE_SUM):
+      for (uint32_t i = 0; i < num_found; i++) {
+        result += rows[i].id;
+      }
+      break;
+  }
+
+  if (num_found == 0 && (statement->aggregate == AGGREGATE_MIN ||
+                         statement->aggregate == AGGREGATE_MAX)) {
+    fprintf(output, "(NULL)\n");
+    return EXECUTE_SUCCESS;
+  }
+  fprintf(output, "(%llu)\n", (unsigned long long)result);
+  return EXECUTE_SUCCESS;
+}
+
+/*
+ * 打印节点中全部数据
+ * 有where子句时只有满足条件的行才会被反序列化并打印，并且可以多线程扫描
+ */
+ExecuteResult execute_select(Statement* statement, Table* table,
+                             FILE* output) {
+  if (statement->predicate.type == PREDICATE_ID_IN) {
+    return execute_multi_get(statement, table, output);
+  }
+  if (statement->predicate.type != PREDICATE_NONE ||
+      statement->aggregate == AGGREGATE_SUM) {
+    return execute_scan(statement, table, output);
+  }
+  if (statement->aggregate != AGGREGATE_NONE) {
+    return execute_aggregate(statement, table, output);
+  }
+
+  Cursor* cursor = table_start(table);
+  
+  // 通过游标一条一条往下走来打印数据，直到走到节点末尾
+  Row row;
+  while (!(cursor->end_of_table)) {
+    deserialize_row(cursor_value(cursor), &row);
+    print_row(output, &row);
+    cursor_advance(cursor);
+  }
+
+  cursor_close(cursor);
+
+  return EXECUTE_SUCCESS;
+}
+
+/*
+ * begin: 开始显式事务，等其他写操作结束后独占写权限
+ */
+ExecuteResult execute_begin(Table* table) {
+  if (table->transaction != NULL) {
+    return EXECUTE_TRANSACTION_ACTIVE;
+  }
+  if (!writer_enter(table->pager, true, !table->nowait)) {
+    return EXECUTE_BUSY;
+  }
+  Transaction* transaction = malloc(sizeof(Transaction));
+  pager_lock_writer(table->pager);
+  transaction_begin(table, transaction, false);
+  transaction->autocommit = false;
+  // 共享模式下先确认私有缓存没有过期，页数才是准确的
+  pager_lock_shared(table->pager);
+  transaction->num_pages_at_begin = table->pager->num_pages;
+  pager_unlock_shared(table->pager);
+  table->transaction = transaction;
+  return EXECUTE_SUCCESS;
+}
+
+/*
+ * commit: 发布事务中的所有草稿，写入预写日志并同步一次
+ */
+ExecuteResult execute_commit(Table* table) {
+  if (table->transaction == NULL) {
+    return EXECUTE_NO_TRANSACTION;
+  }
+  // 先写预写日志再写回数据库文件，发布到一半时崩溃也能从日志恢复
+  Transaction* transaction = table->transaction;
+  transaction_commit(table, transaction);
+  pager_sync(table->pager);
+  pager_publish(table->pager, transaction->dirty_pages,
+                transaction->num_dirty_pages);
+  if (table->pager->wal_num_frames >= WAL_CHECKPOINT_FRAMES) {
+    pager_checkpoint(table->pager);
+  }
+
+  pager_unlock_writer(table->pager);
+  writer_exit(table->pager, true);
+  transaction_end(table, table->transaction);
+  free(table->transaction);
+  table->transaction = NULL;
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_rollback(Table* table) {
+  if (table->transaction == NULL) {
+    return EXECUTE_NO_TRANSACTION;
+  }
+  transaction_rollback(table);
+  return EXECUTE_SUCCESS;
+}
+
+/*
+ * 最左边的叶节点，调用时持有独占的写权限
+ */
+uint32_t vacuum_first_leaf(Table* table) {
+  uint32_t page_num = table->root_page_num;
+  void* node = table_get_page(table, page_num);
+  while (get_node_type(node) == NODE_INTERNAL) {
+    page_num = *internal_node_child(node, 0);
+    node = table_get_page(table, page_num);
+  }
+  return page_num;
 }
 
 /*
- * 分割节点并且创建新的子节点 
+ * 重建的树中第level层第index个节点的父节点页号
+ * 子节点平均分给上一层的节点，第k个父节点的子节点是[k*n/m, (k+1)*n/m)，n、m是两层的节点数
+ * level_first是每层第一个节点的页号
  */
-void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
-  /*
-  创建一个新的节点， 插入新数据到对应的节点中然后更新父节点。
-  */
- 
-  void* old_node = get_page(cursor->table->pager, cursor->page_num);
-  uint32_t old_max = get_node_max_key(old_node);
-  uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-  void* new_node = get_page(cursor->table->pager, new_page_num);
-  initialize_leaf_node(new_node);
-  *node_parent(new_node) = *node_parent(old_node);
-  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-  *leaf_node_next_leaf(old_node) = new_page_num;
+uint32_t vacuum_parent_page(uint32_t* level_first, uint32_t* level_sizes,
+                            uint32_t level, uint32_t index) {
+  uint64_t num_children = level_sizes[level];
+  uint64_t num_nodes = level_sizes[level + 1];
+  uint64_t k = ((index + 1) * num_nodes + num_children - 1) / num_children - 1;
+  return level_first[level + 1] + k;
+}
 
-  /*
-  整理节点位置，旧节点放在左边，新节点放在右边
-  */
-  for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-    void* destination_node;
-    if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
-      destination_node = new_node;
+/*
+ * vacuum: 按key顺序把整棵树重建成紧凑的新布局，作为一个事务提交
+ * 根仍然在第0页，叶节点装满后从第1页开始连续存放，内部节点逐层放在叶节点后面，
+ * 全表扫描沿叶节点链表就是顺序读；树不再使用的页清零，独占模式下检查点之后截断文件
+ * 和显式事务一样独占写权限，只读快照继续读旧版本
+ * 新树的页按顺序生成，每页的位置和父节点都可以直接算出来，生成后马上放进预写日志的缓冲区，
+ * 每WAL_BATCH_FRAMES帧写出一次，最后一帧标记commit并同步，崩溃后看到的要么是旧树要么是新树；
+ * 之后再分批从预写日志读回来替换缓存中的页，整个过程只多用固定大小的缓冲区，不为新树另外占一份内存
+ */
+ExecuteResult execute_vacuum(Table* table) {
+  ExecuteResult result = execute_begin(table);
+  if (result != EXECUTE_SUCCESS) {
+    return result;
+  }
+  Pager* pager = table->pager;
+  pager_lock_shared(pager);
+
+  // 旧树从最新提交的版本读，新树的页只写进预写日志，不会改动旧树
+  Table committed = *table;
+  committed.transaction = NULL;
+  Cursor cursor;
+  uint32_t old_num_pages = pager->num_pages;
+  uint32_t old_page_num = vacuum_first_leaf(table);
+  uint64_t num_rows = 0;
+  cursor_init(&cursor, &committed, old_page_num);
+  do {
+    num_rows += *leaf_node_num_cells(get_page(pager, cursor.page_num));
+  } while (cursor_next_leaf(&cursor) != 0);
+
+  // 每层的节点数，从叶节点往上直到只剩一个根
+  uint32_t level_sizes[BTREE_MAX_DEPTH];
+  uint32_t num_levels = 1;
+  level_sizes[0] = (num_rows + LEAF_NODE_MAX_CELLS - 1) / LEAF_NODE_MAX_CELLS;
+  if (level_sizes[0] == 0) {
+    level_sizes[0] = 1;
+  }
+  while (level_sizes[num_levels - 1] > 1 && num_levels < BTREE_MAX_DEPTH) {
+    uint32_t children = level_sizes[num_levels - 1];
+    level_sizes[num_levels] = (children + INTERNAL_NODE_MAX_CELLS) /
+                              (INTERNAL_NODE_MAX_CELLS + 1);
+    num_levels += 1;
+  }
+
+  // 每层第一个节点的页号: 根在第0页，叶节点从第1页开始，内部节点逐层接在后面
+  uint32_t level_first[BTREE_MAX_DEPTH];
+  uint32_t num_pages = 1;
+  for (uint32_t level = 0; level + 1 < num_levels; level++) {
+    level_first[level] = num_pages;
+    num_pages += level_sizes[level];
+  }
+  level_first[num_levels - 1] = 0;
+  uint32_t num_frames = num_pages > old_num_pages ? num_pages : old_num_pages;
+
+  size_t frame_size = sizeof(WalFrameHeader) + PAGE_SIZE;
+  off_t wal_start = lseek(pager->wal_file_descriptor, 0, SEEK_END);
+  WalBatch batch;
+  wal_batch_begin(&batch, pager, num_frames);
+
+  // 当前层每个节点的最大key，逐层往上构造
+  uint32_t* max_keys = malloc(level_sizes[0] * sizeof(uint32_t));
+  uint32_t old_cell_num = 0;
+  cursor_init(&cursor, &committed, old_page_num);
+  void* old_node = get_page(pager, old_page_num);
+  for (uint32_t i = 0; i < level_sizes[0]; i++) {
+    uint32_t page_num = level_first[0] + i;
+    void* leaf = wal_batch_add(&batch, page_num);
+    memset(leaf, 0, PAGE_SIZE);
+    initialize_leaf_node(leaf);
+    uint32_t num_cells = 0;
+    while (num_cells < LEAF_NODE_MAX_CELLS) {
+      while (old_cell_num == *leaf_node_num_cells(old_node) &&
+             cursor_next_leaf(&cursor) != 0) {
+        old_node = get_page(pager, cursor.page_num);
+        old_cell_num = 0;
+      }
+      if (old_cell_num == *leaf_node_num_cells(old_node)) {
+        break;
+      }
+      memcpy(leaf_node_cell(leaf, num_cells),
+             leaf_node_cell(old_node, old_cell_num), LEAF_NODE_CELL_SIZE);
+      num_cells += 1;
+      old_cell_num += 1;
+    }
+    *leaf_node_num_cells(leaf) = num_cells;
+    *leaf_node_next_leaf(leaf) = (i + 1 < level_sizes[0]) ? page_num + 1 : 0;
+    if (num_levels == 1) {
+      set_node_root(leaf, true);
     } else {
-      destination_node = old_node;
+      *node_parent(leaf) = vacuum_parent_page(level_first, level_sizes, 0, i);
     }
-    uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-    void* destination = leaf_node_cell(destination_node, index_within_node);
+    max_keys[i] = num_cells > 0 ? *leaf_node_key(leaf, num_cells - 1) : 0;
+  }
 
-    if (i == cursor->cell_num) {
-      serialize_row(value, leaf_node_value(destination_node, index_within_node));
-      *leaf_node_key(destination_node, index_within_node) = key;
-    } else if (i > cursor->cell_num) {
-      memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
-    } else {
-      memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+  // 每个内部节点至少有两个子节点
+  for (uint32_t level = 1; level < num_levels; level++) {
+    uint32_t num_children = level_sizes[level - 1];
+    uint32_t num_nodes = level_sizes[level];
+    for (uint32_t k = 0; k < num_nodes; k++) {
+      void* parent = wal_batch_add(&batch, level_first[level] + k);
+      memset(parent, 0, PAGE_SIZE);
+      initialize_internal_node(parent);
+      uint32_t first = (uint64_t)k * num_children / num_nodes;
+      uint32_t last = (uint64_t)(k + 1) * num_children / num_nodes;
+      *internal_node_num_keys(parent) = last - first - 1;
+      for (uint32_t j = first; j < last; j++) {
+        uint32_t child_page_num = level_first[level - 1] + j;
+        if (j + 1 < last) {
+          *internal_node_child(parent, j - first) = child_page_num;
+          *internal_node_key(parent, j - first) = max_keys[j];
+        } else {
+          *internal_node_right_child(parent) = child_page_num;
+        }
+      }
+      if (level == num_levels - 1) {
+        set_node_root(parent, true);
+      } else {
+        *node_parent(parent) =
+            vacuum_parent_page(level_first, level_sizes, level, k);
+      }
+      max_keys[k] = max_keys[last - 1];
     }
   }
-  
-  *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-  *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+  free(max_keys);
 
-  if (is_node_root(old_node)) {
-    return create_new_root(cursor->table, new_page_num);
-  } else {
-    uint32_t parent_page_num = *node_parent(old_node);
-    uint32_t new_max = get_node_max_key(old_node);
-    void* parent = get_page(cursor->table->pager, parent_page_num);
+  // 树不再使用的页清零，旧快照仍然可以从旧版本链读到原来的内容
+  for (uint32_t i = num_pages; i < old_num_pages; i++) {
+    memset(wal_batch_add(&batch, i), 0, PAGE_SIZE);
+  }
+  wal_batch_end(&batch);
+
+  // 新树已经持久化，分批读回来替换缓存中的页
+  // 和显式事务的提交一样在version_lock内一次完成，新开始的快照要么全看到旧树，要么全看到新树
+  // 独占模式下没有快照时，不在缓存中的页直接写入数据库文件，新树不会把页缓存撑到超出上限；
+  // 共享模式下要等其他进程的语句结束才能写文件，有快照时旧页要留给快照，这两种情况都放进缓存
+  uint32_t* page_nums = malloc(num_frames * sizeof(uint32_t));
+  uint32_t num_cached = 0;
+  uint8_t* frames = malloc(WAL_BATCH_FRAMES * frame_size);
+  uint32_t write_page_nums[WAL_BATCH_FRAMES];
+  void* write_pages[WAL_BATCH_FRAMES];
+  pthread_mutex_lock(&(pager->version_lock));
+  bool keep_old = pager->shared || pager->snapshots_tail != NULL;
+  pager->commit_seq += 1;
+  uint64_t seq = pager->commit_seq;
+  for (uint32_t first = 0; first < num_frames; first += WAL_BATCH_FRAMES) {
+    uint32_t count = num_frames - first < WAL_BATCH_FRAMES
+                         ? num_frames - first
+                         : WAL_BATCH_FRAMES;
+    if (pread(pager->wal_file_descriptor, frames, count * frame_size,
+              wal_start + (off_t)first * frame_size) !=
+        (ssize_t)(count * frame_size)) {
+      printf("Error reading write-ahead log: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    uint32_t num_writes = 0;
+    for (uint32_t i = 0; i < count; i++) {
+      uint8_t* frame = frames + i * frame_size;
+      uint32_t page_num = ((WalFrameHeader*)frame)->page_num;
+      PageEntry* entry = page_entry(pager, page_num);
+      void* page = frame_alloc(pager);
+      memcpy(page, frame + sizeof(WalFrameHeader), PAGE_SIZE);
+
+      // 和table_get_page_for_write一样先在lock内登记成草稿，替换之前旧页不会被淘汰
+      // 不放进缓存的页在写文件之前先更新seq，还在进行的预读读到旧内容时按seq不符丢掉
+      pthread_mutex_lock(&(pager->lock));
+      bool cached = keep_old || entry->page != NULL;
+      if (cached) {
+        entry->draft = page;
+      } else {
+        __atomic_store_n(&(entry->seq), seq, __ATOMIC_RELEASE);
+      }
+      pthread_mutex_unlock(&(pager->lock));
+      if (!cached) {
+        write_page_nums[num_writes] = page_num;
+        write_pages[num_writes] = page;
+        num_writes += 1;
+        continue;
+      }
+      // 快照还可能读旧页，没有缓存的旧页先读进来挂到旧版本链上
+      if (keep_old && page_num < old_num_pages) {
+        get_page(pager, page_num);
+      }
+      pager_commit_page(pager, page_num, page, seq);
+      __atomic_store_n(&(entry->draft), NULL, __ATOMIC_RELEASE);
+      page_nums[num_cached] = page_num;
+      num_cached += 1;
+    }
 
-    update_internal_node_key(parent, old_max, new_max);
-    internal_node_insert(cursor->table, parent_page_num, new_page_num);
-    return;
+    pager_write_pages(pager, write_page_nums, write_pages, num_writes);
+    pthread_mutex_lock(&(pager->lock));
+    for (uint32_t i = 0; i < num_writes; i++) {
+      frame_free(pager, write_pages[i]);
+    }
+    pthread_mutex_unlock(&(pager->lock));
   }
+  pager_collect_versions(pager);
+  pthread_mutex_unlock(&(pager->version_lock));
+  free(frames);
+  pager->unsynced_pages.count = 0;
+  pager->durable_seq = seq;
+
+  // 共享模式下其他进程按自己的页数分配新页，不缩小页数，清零的页留作空闲页
+  if (!pager->shared || num_pages > pager->num_pages) {
+    pager->num_pages = num_pages;
+  }
+  pager_unlock_shared(pager);
+
+  pager_publish(pager, page_nums, num_cached);
+  free(page_nums);
+  if (!pager->shared) {
+    pager_checkpoint(pager);
+    if (ftruncate(pager->file_descriptor, (off_t)num_pages * PAGE_SIZE) == -1) {
+      printf("Error truncating db file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    pager->file_length = (off_t)num_pages * PAGE_SIZE;
+  } else if (pager->wal_num_frames >= WAL_CHECKPOINT_FRAMES) {
+    pager_checkpoint(pager);
+  }
+  // 叶节点已经按链表顺序排好，vacuum <n>不用再从头检查
+  pager->vacuum_position = level_sizes[0];
+  pager->vacuum_seq = seq;
+
+  pager_unlock_writer(pager);
+  writer_exit(pager, true);
+  transaction_end(table, table->transaction);
+  free(table->transaction);
+  table->transaction = NULL;
+  return EXECUTE_SUCCESS;
 }
 
 /*
- *  插入页节点
+ * 叶节点链表中page_num前面的叶节点，0表示它是第一个叶节点
+ * 沿父节点指针往上找到左边还有兄弟的那一层，再从左边的兄弟一直往右下走，只访问O(树高)个节点
  */
-void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
-  void* node = get_page(cursor->table->pager, cursor->page_num);
-
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  // 分割节点产生新的子节点
-  if (num_cells >= LEAF_NODE_MAX_CELLS) {
-    leaf_node_split_and_insert(cursor, key, value);
-    return;
-  }
-  
-  // 如果插入的数据位置不在最后面，则腾出空间并将后面的数据往后移
-  if (cursor->cell_num < num_cells) {
-    for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-      memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1),
-             LEAF_NODE_CELL_SIZE);
+uint32_t vacuum_prev_leaf(Table* table, uint32_t page_num) {
+  void* node = table_get_page(table, page_num);
+  while (!is_node_root(node)) {
+    uint32_t parent_page_num = *node_parent(node);
+    void* parent = table_get_page(table, parent_page_num);
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    uint32_t child_num = num_keys;
+    for (uint32_t i = 0; i < num_keys; i++) {
+      if (*internal_node_child(parent, i) == page_num) {
+        child_num = i;
+      }
+    }
+    if (child_num > 0) {
+      uint32_t prev = *internal_node_child(parent, child_num - 1);
+      node = table_get_page(table, prev);
+      while (get_node_type(node) == NODE_INTERNAL) {
+        prev = *internal_node_right_child(node);
+        node = table_get_page(table, prev);
+      }
+      return prev;
     }
+    page_num = parent_page_num;
+    node = parent;
   }
-
-  // 更新节点数据，插入新数据
-  *(leaf_node_num_cells(node)) += 1;
-  //将key赋值给leaf_node_key返回值的指针变量的值
-  *(leaf_node_key(node, cursor->cell_num)) = key;
-  serialize_row(value, leaf_node_value(node, cursor->cell_num));
+  return 0;
 }
 
-ExecuteResult execute_insert(Statement* statement, Table* table) {
-  void* node = get_page(table->pager, table->root_page_num);
-  uint32_t num_cells = (*leaf_node_num_cells(node));
+uint32_t swap_page_num(uint32_t page_num, uint32_t a, uint32_t b) {
+  if (page_num == a) {
+    return b;
+  }
+  return page_num == b ? a : page_num;
+}
 
-  Row* row_to_insert = &(statement->row_to_insert);
-  uint32_t key_to_insert = row_to_insert->id;
-  Cursor* cursor = table_find(table, key_to_insert);
+/*
+ * 交换两页(都不是根)的内容，并修正所有指向这两页的引用
+ * 可能引用它们的只有: 父节点的子节点指针、前一个叶节点的next指针、子节点的父节点指针，
+ * 以及这两页自己；交换后对这些节点各执行一次页号对换
+ */
+void vacuum_swap_pages(Table* table, uint32_t a, uint32_t b) {
+  uint32_t affected[2 * (INTERNAL_NODE_MAX_CELLS + 4)];
+  uint32_t num_affected = 0;
+  uint32_t pair[2] = {a, b};
+  for (uint32_t i = 0; i < 2; i++) {
+    void* node = table_get_page(table, pair[i]);
+    affected[num_affected++] = pair[i];
+    affected[num_affected++] = *node_parent(node);
+    if (get_node_type(node) == NODE_LEAF) {
+      uint32_t prev = vacuum_prev_leaf(table, pair[i]);
+      if (prev != 0) {
+        affected[num_affected++] = prev;
+      }
+    } else {
+      uint32_t num_keys = *internal_node_num_keys(node);
+      for (uint32_t j = 0; j < num_keys; j++) {
+        affected[num_affected++] = *internal_node_child(node, j);
+      }
+      affected[num_affected++] = *internal_node_right_child(node);
+    }
+  }
 
-  if (cursor->cell_num < num_cells) {
-    uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-    if (key_at_index == key_to_insert) {
-      return EXECUTE_DUPLICATE_KEY;
+  void* buffer = frame_alloc(table->pager);
+  void* page_a = table_get_page_for_write(table, a);
+  void* page_b = table_get_page_for_write(table, b);
+  memcpy(buffer, page_a, PAGE_SIZE);
+  memcpy(page_a, page_b, PAGE_SIZE);
+  memcpy(page_b, buffer, PAGE_SIZE);
+  frame_free(table->pager, buffer);
+
+  for (uint32_t i = 0; i < num_affected; i++) {
+    uint32_t page_num = swap_page_num(affected[i], a, b);
+    bool seen = false;
+    for (uint32_t j = 0; j < i; j++) {
+      seen = seen || swap_page_num(affected[j], a, b) == page_num;
+    }
+    if (seen) {
+      continue;
+    }
+    void* node = table_get_page_for_write(table, page_num);
+    if (!is_node_root(node)) {
+      *node_parent(node) = swap_page_num(*node_parent(node), a, b);
+    }
+    if (get_node_type(node) == NODE_LEAF) {
+      *leaf_node_next_leaf(node) =
+          swap_page_num(*leaf_node_next_leaf(node), a, b);
+      continue;
     }
+    uint32_t num_keys = *internal_node_num_keys(node);
+    for (uint32_t j = 0; j < num_keys; j++) {
+      *internal_node_child(node, j) =
+          swap_page_num(*internal_node_child(node, j), a, b);
+    }
+    *internal_node_right_child(node) =
+        swap_page_num(*internal_node_right_child(node), a, b);
   }
-  
-  leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+}
 
-  free(cursor);
+/*
+ * vacuum <n>: 在线整理的一步，作为一个短事务提交
+ * 沿叶节点链表把第i个叶节点和第i+1页交换，最多交换max_relocations次，
+ * 反复执行直到输出Relocated 0 leaves.，叶节点就按链表顺序排在第1页开始的连续页中
+ * 上一步停下的位置记在pager->vacuum_position中，中间没有其他提交时从那里继续，
+ * 每一步只走过这一步整理的叶节点，不用每次从头遍历整个链表
+ * 只搬动页，不合并半满的叶节点，需要压紧时用vacuum
+ */
+ExecuteResult execute_vacuum_step(Table* table, uint32_t max_relocations,
+                                  FILE* output) {
+  ExecuteResult result = execute_begin(table);
+  if (result != EXECUTE_SUCCESS) {
+    return result;
+  }
+  Pager* pager = table->pager;
+  pager_lock_shared(pager);
+
+  uint32_t num_relocations = 0;
+  if (get_node_type(table_get_page(table, table->root_page_num)) ==
+      NODE_INTERNAL) {
+    // 第position个叶节点前面的叶节点依次在第1页到第position页
+    uint32_t position = pager->vacuum_position;
+    if (pager->vacuum_seq != pager->commit_seq || position >= pager->num_pages ||
+        get_node_type(table_get_page(table, position)) != NODE_LEAF) {
+      position = 0;
+    }
+    uint32_t page_num =
+        position == 0 ? vacuum_first_leaf(table)
+                      : *leaf_node_next_leaf(table_get_page(table, position));
+    Cursor cursor;
+    cursor_init(&cursor, table, page_num);
+    while (page_num != 0 && num_relocations < max_relocations) {
+      if (page_num != position + 1) {
+        vacuum_swap_pages(table, page_num, position + 1);
+        num_relocations += 1;
+        cursor_init(&cursor, table, position + 1);
+      }
+      position += 1;
+      page_num = cursor_next_leaf(&cursor);
+    }
+    pager->vacuum_position = position;
+  }
+  pager_unlock_shared(pager);
 
+  // 记下这一步提交之后的序号，下一步据此判断中间有没有其他提交
+  pager->vacuum_seq =
+      pager->commit_seq + (table->transaction->num_dirty_pages > 0 ? 1 : 0);
+  execute_commit(table);
+  fprintf(output, "Relocated %u leaves.\n", num_relocations);
   return EXECUTE_SUCCESS;
 }
 
 /*
- * 打印节点中全部数据
+ * 在table->transaction中执行一条读写语句
  */
-ExecuteResult execute_select(Statement* statement, Table* table) {
-  Cursor* cursor = table_start(table);
-  
-  // 通过游标一条一条往下走来打印数据，直到走到节点末尾
-  Row row;
-  while (!(cursor->end_of_table)) {
-    deserialize_row(cursor_value(cursor), &row);
-    print_row(&row);
-    cursor_advance(cursor);
+ExecuteResult execute_in_transaction(Statement* statement, Table* table,
+                                     FILE* output) {
+  switch (statement->type) {
+    case (STATEMENT_INSERT):
+      return execute_insert(statement, table);
+    case (STATEMENT_SELECT):
+      return execute_select(statement, table, output);
+    case (STATEMENT_UPDATE):
+      return execute_update(statement, table);
+    default:
+      return EXECUTE_SUCCESS;
+  }
+}
+
+/*
+ * 虚拟机
+ * table是会话自己的Table副本，显式事务保存在table->transaction中跨语句存在
+ */
+ExecuteResult execute_statement(Statement* statement, Table* table,
+                                FILE* output) {
+  switch (statement->type) {
+    case (STATEMENT_BEGIN):
+      return execute_begin(table);
+    case (STATEMENT_COMMIT):
+      return execute_commit(table);
+    case (STATEMENT_ROLLBACK):
+      return execute_rollback(table);
+    case (STATEMENT_VACUUM):
+      if (statement->max_relocations == 0) {
+        return execute_vacuum(table);
+      }
+      return execute_vacuum_step(table, statement->max_relocations, output);
+    default:
+      break;
   }
 
-  free(cursor);
+  // 语句执行期间从arena分配的游标和临时数组在语句结束时一起退回
+  ArenaMark mark = arena_mark(table->arena);
 
-  return EXECUTE_SUCCESS;
+  // 显式事务中的语句读写事务自己的草稿，select也能看到事务中还没有提交的修改
+  if (table->transaction != NULL) {
+    pager_lock_shared(table->pager);
+    ExecuteResult result = execute_in_transaction(statement, table, output);
+    pager_unlock_shared(table->pager);
+    arena_release(table->arena, mark);
+    return result;
+  }
+
+  // 其他语句各自是一个自动提交的事务，select在开始时固定快照，扫描期间不会看到并发写入的中间状态
+  bool read_only = (statement->type == STATEMENT_SELECT);
+  if (!read_only) {
+    if (!writer_enter(table->pager, false, !table->nowait)) {
+      arena_release(table->arena, mark);
+      return EXECUTE_BUSY;
+    }
+    pager_lock_writer(table->pager);
+  }
+  pager_lock_shared(table->pager);
+
+  Transaction transaction;
+  transaction_begin(table, &transaction, read_only);
+  Table statement_table = *table;
+  statement_table.transaction = &transaction;
+  ExecuteResult result =
+      execute_in_transaction(statement, &statement_table, output);
+  transaction_end(table, &transaction);
+
+  pager_unlock_shared(table->pager);
+  if (!read_only) {
+    pager_unlock_writer(table->pager);
+    writer_exit(table->pager, false);
+  }
+  arena_release(table->arena, mark);
+  return result;
 }
 
 /*
- * 虚拟机
+ * 执行语句，耗时写到execute_time并记入统计
+ */
+ExecuteResult execute_measured(Statement* statement, Table* table,
+                               FILE* output, uint64_t* execute_time) {
+  DB_PROBE1(statement__start, statement->type);
+  uint64_t start = now_nanoseconds();
+  ExecuteResult result = execute_statement(statement, table, output);
+  *execute_time = now_nanoseconds() - start;
+  DB_PROBE3(statement__finish, statement->type, result, *execute_time);
+  histogram_record(&(table->statement_stats->execute[statement->type]),
+                   *execute_time);
+  return result;
+}
+
+ExecuteResult execute_prepared(Table* table, PreparedStatement* prepared,
+                               FILE* output, uint64_t* execute_time) {
+  // 批量查找会把主键列表排序去重，用副本执行，模板中参数的位置保持不变
+  if (prepared->statement.type == STATEMENT_SELECT &&
+      prepared->statement.predicate.type == PREDICATE_ID_IN) {
+    Statement statement = prepared->statement;
+    return execute_measured(&statement, table, output, execute_time);
+  }
+  return execute_measured(&(prepared->statement), table, output, execute_time);
+}
+
+/*
+ * explain: 语句使用的访问路径，和execute_select选择执行函数的顺序一致
+ * 只有主键上的B+树，username和email上的条件总是全表扫描
  */
-ExecuteResult execute_statement(Statement* statement, Table* table) {
+void print_access_path(FILE* output, Statement* statement, Table* table) {
+  Predicate* predicate = &(statement->predicate);
   switch (statement->type) {
     case (STATEMENT_INSERT):
-      return execute_insert(statement, table);
+    case (STATEMENT_UPDATE):
+      fprintf(output, "Access path: point descent on id for write\n");
+      return;
+    case (STATEMENT_BEGIN):
+    case (STATEMENT_COMMIT):
+    case (STATEMENT_ROLLBACK):
+    case (STATEMENT_TYPE_COUNT):
+      fprintf(output, "Access path: none\n");
+      return;
+    case (STATEMENT_VACUUM):
+      fprintf(output, "Access path: leaf chain walk, %s\n",
+              statement->max_relocations == 0
+                  ? "rebuilding every page"
+                  : "relocating leaves into chain order");
+      return;
     case (STATEMENT_SELECT):
-      return execute_select(statement, table);
+      break;
+  }
+
+  if (predicate->type == PREDICATE_ID_IN) {
+    if (predicate->num_keys == 1) {
+      fprintf(output, "Access path: point descent on id\n");
+    } else {
+      fprintf(output, "Access path: batched point descents on id (%u keys)\n",
+              predicate->num_keys);
+    }
+  } else if (predicate->type != PREDICATE_NONE) {
+    fprintf(output,
+            "Access path: full scan with filter on %s (scan threads: %u)\n",
+            predicate->column_offset == USERNAME_OFFSET ? "username" : "email",
+            table->num_scan_threads);
+  } else if (statement->aggregate == AGGREGATE_SUM) {
+    fprintf(output, "Access path: full scan (scan threads: %u)\n",
+            table->num_scan_threads);
+  } else if (statement->aggregate == AGGREGATE_COUNT) {
+    fprintf(output, "Access path: leaf chain walk reading cell counts\n");
+  } else if (statement->aggregate == AGGREGATE_MIN) {
+    fprintf(output, "Access path: leftmost descent\n");
+  } else if (statement->aggregate == AGGREGATE_MAX) {
+    fprintf(output, "Access path: rightmost descent\n");
+  } else {
+    fprintf(output, "Access path: full scan along the leaf chain\n");
   }
 }
 
-int main(int argc, char* argv[]) {
-  if (argc < 2) {
-    printf("Must supply a database filename.\n");
-    exit(EXIT_FAILURE);
+/*
+ * explain analyze的报告
+ * rows_returned是语句输出的行数
+ */
+void print_query_profile(FILE* output, QueryProfile* profile,
+                         uint64_t rows_returned, uint64_t parse_time,
+                         uint64_t execute_time) {
+  uint32_t num_levels = 0;
+  for (uint32_t i = 0; i < BTREE_MAX_DEPTH; i++) {
+    if (profile->pages_per_level[i] > 0) {
+      num_levels = i + 1;
+    }
+  }
+  fprintf(output, "Pages visited:");
+  if (num_levels == 0) {
+    fprintf(output, " 0");
   }
+  for (uint32_t i = 0; i < num_levels; i++) {
+    fprintf(output, "%s level %u: %llu", i == 0 ? "" : ",", i,
+            (unsigned long long)profile->pages_per_level[i]);
+  }
+  fprintf(output, "\n");
+  fprintf(output, "Cache misses: %llu\n",
+          (unsigned long long)profile->cache_misses);
+  fprintf(output, "Rows examined: %llu, returned: %llu\n",
+          (unsigned long long)profile->rows_examined,
+          (unsigned long long)rows_returned);
+  fprintf(output, "Time: parse %.1f us, execute %.1f us\n", parse_time / 1e3,
+          execute_time / 1e3);
+}
 
-  char* filename = argv[1];
-  Table* table = db_open(filename);
+/*
+ * 处理一行输入(元命令或SQL语句)，结果写到output
+ * quiet为true时语句执行成功后不输出Executed.
+ */
+InputResult db_execute(Table* table, char* input, FILE* output, bool quiet) {
+  if (input[0] == '.') {
+    switch (do_meta_command(input, table, output)) {
+      case (META_COMMAND_SUCCESS):
+        return INPUT_SUCCESS;
+      case (META_COMMAND_EXIT):
+        return INPUT_EXIT;
+      case (META_COMMAND_UNRECOGNIZED_COMMAND):
+        fprintf(output, "Unrecognized command '%s'\n", input);
+        return INPUT_ERROR;
+    }
+  }
 
-  InputBuffer* input_buffer = new_input_buffer();
-  while (true) {
-    print_prompt();
-    read_input(input_buffer);
+  // explain [analyze] <语句>: 输出访问路径，analyze时执行语句但不输出结果，只报告统计
+  bool explain = false;
+  bool analyze = false;
+  if (strncmp(input, "explain ", 8) == 0) {
+    explain = true;
+    input += 8;
+    if (strncmp(input, "analyze ", 8) == 0) {
+      analyze = true;
+      input += 8;
+    }
+  }
 
-    if (input_buffer->buffer[0] == '.') {
-      switch (do_meta_command(input_buffer, table)) {
-        case (META_COMMAND_SUCCESS):
-          continue;
-        case (META_COMMAND_UNRECOGNIZED_COMMAND):
-          printf("Unrecognized command '%s'\n", input_buffer->buffer);
-          continue;
-      }
+  Statement statement;
+  PreparedStatement* prepared = NULL;
+  bool define = (strncmp(input, "prepare ", 8) == 0);
+  PrepareResult prepare_result;
+  uint64_t parse_start = now_nanoseconds();
+  if (define && explain) {
+    prepare_result = PREPARE_SYNTAX_ERROR;
+  } else if (define) {
+    prepare_result = prepare_named_statement(table, input);
+  } else if (strncmp(input, "execute ", 8) == 0) {
+    prepare_result = bind_named_statement(table, input, &prepared);
+  } else {
+    prepare_result = prepare_statement(input, &statement);
+    // 参数只能出现在预编译语句中
+    if (prepare_result == PREPARE_SUCCESS && statement.num_parameters > 0) {
+      prepare_result = PREPARE_SYNTAX_ERROR;
     }
+  }
 
-    Statement statement;
-    switch (prepare_statement(input_buffer, &statement)) {
-      case (PREPARE_SUCCESS):
-        break;
-      case (PREPARE_NEGATIVE_ID):
-        printf("ID must be positive.\n");
-        continue;
-      case (PREPARE_STRING_TOO_LONG):
-        printf("String is too long.\n");
-        continue;
-      case (PREPARE_SYNTAX_ERROR):
-        printf("Syntax error. Could not parse statement.\n");
-        continue;
-      case (PREPARE_UNRECOGNIZED_STATEMENT):
-        printf("Unrecognized keyword at start of '%s'.\n",
-               input_buffer->buffer);
-        continue;
+  switch (prepare_result) {
+    case (PREPARE_SUCCESS):
+      break;
+    case (PREPARE_NEGATIVE_ID):
+      fprintf(output, "ID must be positive.\n");
+      return INPUT_ERROR;
+    case (PREPARE_STRING_TOO_LONG):
+      fprintf(output, "String is too long.\n");
+      return INPUT_ERROR;
+    case (PREPARE_SYNTAX_ERROR):
+      fprintf(output, "Syntax error. Could not parse statement.\n");
+      return INPUT_ERROR;
+    case (PREPARE_UNRECOGNIZED_STATEMENT):
+      fprintf(output, "Unrecognized keyword at start of '%s'.\n",
+              input);
+      return INPUT_ERROR;
+    case (PREPARE_UNKNOWN_PREPARED_STATEMENT):
+      fprintf(output, "Error: Unknown prepared statement.\n");
+      return INPUT_ERROR;
+  }
+  // execute <name>的解析时间是查找命名语句和绑定参数的时间
+  uint64_t parse_time = now_nanoseconds() - parse_start;
+  if (!define) {
+    StatementType type =
+        prepared != NULL ? prepared->statement.type : statement.type;
+    histogram_record(&(table->statement_stats->parse[type]), parse_time);
+  }
+
+  if (explain) {
+    print_access_path(output,
+                      prepared != NULL ? &(prepared->statement) : &statement,
+                      table);
+    if (!analyze) {
+      return INPUT_SUCCESS;
     }
+  }
 
-    switch (execute_statement(&statement, table)) {
-      case (EXECUTE_SUCCESS):
-        printf("Executed.\n");
-        break;
-      case (EXECUTE_DUPLICATE_KEY):
-        printf("Error: Duplicate key.\n");
-        break;
-      case (EXECUTE_TABLE_FULL):
-        printf("Error: Table full.\n");
-        break;
+  // explain analyze把结果写到内存中，只数输出了多少行
+  QueryProfile profile;
+  char* result_buffer = NULL;
+  size_t result_size = 0;
+  FILE* result_output = output;
+  if (analyze) {
+    memset(&profile, 0, sizeof(QueryProfile));
+    profile.leaf_level = PROFILE_LEVEL_UNKNOWN;
+    table->profile = &profile;
+    result_output = open_memstream(&result_buffer, &result_size);
+  }
+
+  ExecuteResult result = EXECUTE_SUCCESS;
+  uint64_t execute_time = 0;
+  if (prepared != NULL) {
+    result = execute_prepared(table, prepared, result_output, &execute_time);
+  } else if (!define) {
+    result = execute_measured(&statement, table, result_output, &execute_time);
+  }
+
+  if (analyze) {
+    table->profile = NULL;
+    fclose(result_output);
+    uint64_t rows_returned = 0;
+    for (size_t i = 0; i < result_size; i++) {
+      rows_returned += (result_buffer[i] == '\n');
     }
+    free(result_buffer);
+    print_query_profile(output, &profile, rows_returned, parse_time,
+                        execute_time);
+  }
+  switch (result) {
+    case (EXECUTE_SUCCESS):
+      if (!quiet) {
+        fprintf(output, "Executed.\n");
+      }
+      break;
+    case (EXECUTE_DUPLICATE_KEY):
+      fprintf(output, "Error: Duplicate key.\n");
+      break;
+    case (EXECUTE_KEY_NOT_FOUND):
+      fprintf(output, "Error: Key not found.\n");
+      break;
+    case (EXECUTE_TABLE_FULL):
+      fprintf(output, "Error: Table full.\n");
+      break;
+    case (EXECUTE_NO_TRANSACTION):
+      fprintf(output, "Error: No transaction is active.\n");
+      break;
+    case (EXECUTE_TRANSACTION_ACTIVE):
+      fprintf(output, "Error: Transaction already active.\n");
+      break;
+    case (EXECUTE_BUSY):
+      fprintf(output, "Error: Database is busy.\n");
+      break;
+  }
+  if (table->timer) {
+    fprintf(output, "Run time: parse %.1f us, execute %.1f us\n",
+            parse_time / 1e3, execute_time / 1e3);
+  }
+  return result == EXECUTE_SUCCESS ? INPUT_SUCCESS : INPUT_ERROR;
+}
+
+/*
+ * 对外接口
+ * 写操作构造成语句交给虚拟机执行，和文本语句走同样的事务和页锁
+ */
+Table* db_session_open(Table* table) {
+  Table* session = malloc(sizeof(Table));
+  *session = *table;
+  session->transaction = NULL;
+  session->named_statements = NULL;
+  session->arena = arena_new();
+  session->timer = false;
+  session->nowait = false;
+  session->profile = NULL;
+  return session;
+}
+
+void db_session_set_nowait(Table* session, bool nowait) {
+  session->nowait = nowait;
+}
+
+void db_session_close(Table* session) {
+  if (session->transaction != NULL) {
+    transaction_rollback(session);
+  }
+  free_named_statements(session);
+  arena_free(session->arena);
+  free(session);
+}
+
+ExecuteResult db_begin(Table* table) { return execute_begin(table); }
+
+ExecuteResult db_commit(Table* table) { return execute_commit(table); }
+
+ExecuteResult db_rollback(Table* table) { return execute_rollback(table); }
+
+ExecuteResult db_write(Table* table, StatementType type, const Row* row,
+                       bool replace) {
+  Statement statement;
+  statement.type = type;
+  statement.row_to_insert = *row;
+  statement.row_to_insert.username[COLUMN_USERNAME_SIZE] = '\0';
+  statement.row_to_insert.email[COLUMN_EMAIL_SIZE] = '\0';
+  statement.replace = replace;
+  statement.update_username = true;
+  statement.update_email = true;
+  uint64_t execute_time;
+  return execute_measured(&statement, table, NULL, &execute_time);
+}
+
+ExecuteResult db_insert(Table* table, const Row* row) {
+  return db_write(table, STATEMENT_INSERT, row, false);
+}
+
+ExecuteResult db_replace(Table* table, const Row* row) {
+  return db_write(table, STATEMENT_INSERT, row, true);
+}
+
+ExecuteResult db_update(Table* table, const Row* row) {
+  return db_write(table, STATEMENT_UPDATE, row, false);
+}
+
+ExecuteResult db_find(Table* table, uint32_t id, Row* row) {
+  Table reader;
+  Transaction transaction;
+  ArenaMark mark = arena_mark(table->arena);
+  db_read_begin(table, &reader, &transaction);
+
+  ExecuteResult result = EXECUTE_KEY_NOT_FOUND;
+  Cursor* cursor = table_find(&reader, id);
+  void* node = table_get_page(&reader, cursor->page_num);
+  if (cursor->cell_num < *leaf_node_num_cells(node) &&
+      *leaf_node_key(node, cursor->cell_num) == id) {
+    deserialize_row(leaf_node_value(node, cursor->cell_num), row);
+    result = EXECUTE_SUCCESS;
   }
+  cursor_close(cursor);
+
+  db_read_end(table, &reader);
+  arena_release(table->arena, mark);
+  return result;
+}
+
+/*
+ * 全表扫描的游标
+ * table        打开游标的会话
+ * reader       游标自己的Table副本，cursor通过它读页
+ * transaction  不在显式事务中时游标自己的只读事务
+ * cursor       游标本身，从arena复制出来放在Scan里，
+ *              同一个会话的多个Scan不必按打开的相反顺序关闭
+ */
+struct Scan {
+  Table* table;
+  Table reader;
+  Transaction transaction;
+  Cursor cursor;
+};
+
+Scan* db_scan_open_at(Table* table, uint32_t start_id) {
+  Scan* scan = malloc(sizeof(Scan));
+  scan->table = table;
+  db_read_begin(table, &(scan->reader), &(scan->transaction));
+  ArenaMark mark = arena_mark(table->arena);
+  scan->cursor = *table_seek(&(scan->reader), start_id);
+  arena_release(table->arena, mark);
+  return scan;
+}
+
+Scan* db_scan_open(Table* table) { return db_scan_open_at(table, 0); }
+
+bool db_scan_next(Scan* scan, Row* row) {
+  if (scan->cursor.end_of_table) {
+    return false;
+  }
+  deserialize_row(cursor_value(&(scan->cursor)), row);
+  cursor_advance(&(scan->cursor));
+  return true;
+}
+
+void db_scan_close(Scan* scan) {
+  cursor_close(&(scan->cursor));
+  db_read_end(scan->table, &(scan->reader));
+  free(scan);
+}
+
+/*
+ * 预编译语句
+ * 绑定直接写进语句模板里参数对应的位置，执行时不再解析
+ */
+PreparedStatement* db_prepare(const char* sql) {
+  char* input = strdup(sql);
+  PreparedStatement* prepared = malloc(sizeof(PreparedStatement));
+  PrepareResult result = prepare_template(input, &(prepared->statement));
+  free(input);
+  if (result != PREPARE_SUCCESS) {
+    free(prepared);
+    return NULL;
+  }
+  return prepared;
+}
+
+bool db_bind_int(PreparedStatement* prepared, uint32_t index, uint32_t value) {
+  Statement* statement = &(prepared->statement);
+  if (index >= statement->num_parameters) {
+    return false;
+  }
+  Parameter* parameter = &(statement->parameters[index]);
+  switch (parameter->type) {
+    case (PARAMETER_ID):
+      statement->row_to_insert.id = value;
+      return true;
+    case (PARAMETER_KEY):
+      statement->predicate.keys[parameter->key_index] = value;
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool db_bind_text(PreparedStatement* prepared, uint32_t index,
+                  const char* value) {
+  Statement* statement = &(prepared->statement);
+  if (index >= statement->num_parameters) {
+    return false;
+  }
+  size_t length = strlen(value);
+  switch (statement->parameters[index].type) {
+    case (PARAMETER_USERNAME):
+      if (length > COLUMN_USERNAME_SIZE) {
+        return false;
+      }
+      memcpy(statement->row_to_insert.username, value, length + 1);
+      return true;
+    case (PARAMETER_EMAIL):
+      if (length > COLUMN_EMAIL_SIZE) {
+        return false;
+      }
+      memcpy(statement->row_to_insert.email, value, length + 1);
+      return true;
+    case (PARAMETER_PATTERN):
+      return predicate_set_pattern(&(statement->predicate), value, length) ==
+             PREPARE_SUCCESS;
+    default:
+      return false;
+  }
+}
+
+ExecuteResult db_execute_prepared(Table* table, PreparedStatement* prepared,
+                                  FILE* output) {
+  uint64_t execute_time;
+  return execute_prepared(table, prepared, output, &execute_time);
 }
+
+void db_finalize(PreparedStatement* prepared) { free(prepared); }
@@ -0,0 +1,194 @@
+#ifndef DB_H
+#define DB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * libdb对外接口
+ * 嵌入的程序直接在进程内读写数据库，不需要经过REPL解析文本
+ * 命令行的REPL和服务器模式也只通过这些接口访问数据库
+ */
+
+#define COLUMN_USERNAME_SIZE 32
+#define COLUMN_EMAIL_SIZE 255
+
+/*
+ * 表中的一行
+ * username和email以'\0'结尾
+ */
+struct Row_t {
+  uint32_t id;
+  char username[COLUMN_USERNAME_SIZE + 1];
+  char email[COLUMN_EMAIL_SIZE + 1];
+};
+typedef struct Row_t Row;
+
+typedef enum ExecuteResult {
+  EXECUTE_SUCCESS,
+  EXECUTE_DUPLICATE_KEY,
+  EXECUTE_KEY_NOT_FOUND,
+  EXECUTE_TABLE_FULL,
+  EXECUTE_NO_TRANSACTION,
+  EXECUTE_TRANSACTION_ACTIVE,
+  EXECUTE_BUSY
+}ExecuteResult;
+
+/*
+ * 页管理器的计数，从打开数据库或上次重置开始累计，同一个数据库的所有会话共用
+ * cache_hits/cache_misses        读页时在进程内页缓存中命中/未命中的次数
+ * cache_evictions                页缓存超出上限时淘汰的页
+ * file_reads/file_read_bytes     从数据库文件读页
+ * readahead_pages                顺序扫描和批量查找预读的页
+ * file_writes/file_write_bytes   写回数据库文件
+ * wal_writes/wal_write_bytes     写入预写日志的帧
+ * syncs                          fsync的次数
+ * leaf_splits/root_splits        叶节点分裂和根节点分裂
+ * pages_allocated                新分配的页
+ */
+typedef struct PagerStats {
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint64_t cache_evictions;
+  uint64_t file_reads;
+  uint64_t file_read_bytes;
+  uint64_t readahead_pages;
+  uint64_t file_writes;
+  uint64_t file_write_bytes;
+  uint64_t wal_writes;
+  uint64_t wal_write_bytes;
+  uint64_t syncs;
+  uint64_t leaf_splits;
+  uint64_t root_splits;
+  uint64_t pages_allocated;
+}PagerStats;
+
+/*
+ * Table              打开的数据库，同时也是一个会话，显式事务属于会话
+ * Scan               按id从小到大遍历整张表的游标
+ * PreparedStatement  解析好的语句模板，参数在执行前绑定
+ */
+typedef struct Table Table;
+typedef struct Scan Scan;
+typedef struct PreparedStatement PreparedStatement;
+
+/*
+ * 打开和关闭数据库
+ * shared为true时和其他同样以shared打开的进程共享数据库文件，否则独占
+ * 出错时打印错误信息并退出进程
+ */
+Table* db_open(const char* filename, bool shared);
+
+/*
+ * 和db_open相同，但绕过内核页缓存(O_DIRECT)读写数据库文件，
+ * 每一页只在进程内的页缓存中保存一份，不会在内核页缓存中再占一份内存，
+ * 占用的内存由页缓存上限决定(见db_set_cache_pages)，每次读写都是真实的I/O
+ * 文件系统不支持直接I/O时打印错误信息并退出进程
+ */
+Table* db_open_direct(const char* filename, bool shared);
+void db_close(Table* table);
+
+/*
+ * 会话
+ * 每个线程(或每个客户端连接)使用自己的会话，各自进行显式事务
+ * 语句执行时的临时内存从会话的arena分配，同一个会话不能在多个线程中同时使用
+ * 关闭会话时还没有提交的事务直接回滚
+ */
+Table* db_session_open(Table* table);
+void db_session_close(Table* session);
+
+/*
+ * nowait为true时，其他会话的显式事务进行期间，本会话的写操作和begin
+ * 不等待它提交，直接返回EXECUTE_BUSY
+ * 服务器模式的工作线程由所有连接共用，等待会占住工作线程，提交事务的连接可能再也轮不到执行
+ */
+void db_session_set_nowait(Table* session, bool nowait);
+
+/*
+ * 显式事务，不在事务中时每个操作各自自动提交
+ */
+ExecuteResult db_begin(Table* table);
+ExecuteResult db_commit(Table* table);
+ExecuteResult db_rollback(Table* table);
+
+/*
+ * 按行读写
+ * db_insert   id已经存在时返回EXECUTE_DUPLICATE_KEY
+ * db_replace  id已经存在时覆盖
+ * db_update   更新已经存在的行，不存在时返回EXECUTE_KEY_NOT_FOUND
+ * db_find     按id查找，不存在时返回EXECUTE_KEY_NOT_FOUND
+ */
+ExecuteResult db_insert(Table* table, const Row* row);
+ExecuteResult db_replace(Table* table, const Row* row);
+ExecuteResult db_update(Table* table, const Row* row);
+ExecuteResult db_find(Table* table, uint32_t id, Row* row);
+
+/*
+ * 全表扫描
+ * 游标打开时固定快照，db_scan_next返回false表示已经到表格末尾
+ * db_scan_open_at从第一个id不小于start_id的行开始，用于范围扫描
+ * 游标打开期间不要在同一个会话中写入
+ */
+Scan* db_scan_open(Table* table);
+Scan* db_scan_open_at(Table* table, uint32_t start_id);
+bool db_scan_next(Scan* scan, Row* row);
+void db_scan_close(Scan* scan);
+
+/*
+ * 页管理器计数
+ * db_pager_stats把当前计数复制到stats，db_pager_stats_reset清零
+ */
+void db_pager_stats(Table* table, PagerStats* stats);
+void db_pager_stats_reset(Table* table);
+
+/*
+ * 页缓存最多保存的页数，默认16384页(64MB)，同一个数据库的所有会话共用
+ * 超出后用时钟算法淘汰已经写回文件的页，还没有写回的页、草稿和快照需要的旧版本不算在可淘汰的页中，
+ * 它们多的时候缓存会暂时超出上限
+ */
+void db_set_cache_pages(Table* table, uint32_t num_pages);
+
+/*
+ * 预编译语句
+ * sql中的?是参数，按出现的顺序从0开始编号，可以用在insert的三个值、
+ * update的username/email/id，select where id = ?和id in (?, ...)，
+ * 以及select where username/email = ?或like ?中(like时绑定的值可以带开头和结尾的%)
+ * db_prepare解析出错时返回NULL
+ * db_bind_int绑定id和主键参数，db_bind_text绑定username、email和比较内容参数，
+ * 编号或类型不对、字符串太长时返回false
+ * 绑定的值保留到下次绑定为止，同一个预编译语句可以反复执行，select的结果写到output
+ * 预编译语句不属于任何会话，但不能在多个线程中同时绑定或执行
+ */
+PreparedStatement* db_prepare(const char* sql);
+bool db_bind_int(PreparedStatement* prepared, uint32_t index, uint32_t value);
+bool db_bind_text(PreparedStatement* prepared, uint32_t index,
+                  const char* value);
+ExecuteResult db_execute_prepared(Table* table, PreparedStatement* prepared,
+                                  FILE* output);
+void db_finalize(PreparedStatement* prepared);
+
+/*
+ * db_execute的结果
+ * INPUT_SUCCESS  语句或元命令执行成功
+ * INPUT_ERROR    解析或执行出错，错误信息已经写到output
+ * INPUT_EXIT     输入是.exit
+ */
+typedef enum InputResult {
+  INPUT_SUCCESS,
+  INPUT_ERROR,
+  INPUT_EXIT
+}InputResult;
+
+/*
+ * 执行一行文本形式的语句或元命令，结果写到output
+ * 也支持prepare <name> as <statement>和execute <name> <value> ...，
+ * 命名的预编译语句属于会话
+ * explain <语句>输出访问路径，explain analyze <语句>执行语句，输出访问的页和行数而不是结果
+ * vacuum按key顺序重建整棵树并截断文件，vacuum <n>最多把n个叶节点搬到按链表顺序的位置，
+ * 两者都不能在显式事务中执行
+ * input会被解析过程修改，quiet为true时语句执行成功后不输出Executed.
+ */
+InputResult db_execute(Table* table, char* input, FILE* output, bool quiet);
+
+#endif
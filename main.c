@@ -0,0 +1,771 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "db.h"
+
+/*
+ * 命令行客户端: REPL、批处理模式和服务器模式
+ * 只通过db.h中的接口访问数据库
+ */
+
+/*
+ * 键盘输入缓冲池
+ * buffer        输入内容
+ * buffer_length 缓冲区大小
+ * input_length  输入返回值大小
+ */
+typedef struct InputBuffer {
+  char* buffer;
+  size_t buffer_length;
+  ssize_t input_length;
+}InputBuffer;
+
+InputBuffer* new_input_buffer() {
+  InputBuffer* input_buffer = malloc(sizeof(InputBuffer));
+  input_buffer->buffer = NULL;
+  input_buffer->buffer_length = 0;
+  input_buffer->input_length = 0;
+
+  return input_buffer;
+}
+
+void print_prompt() { printf("db > "); }
+
+/*
+ * 分词器Tokenizer
+ */
+void read_input(InputBuffer* input_buffer) {
+  // 从输入流中读取一行内容
+  ssize_t bytes_read =
+      getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+
+  if (bytes_read <= 0) {
+    printf("Error reading input\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // 去掉换行部分
+  input_buffer->input_length = bytes_read - 1;
+  input_buffer->buffer[bytes_read - 1] = 0;
+}
+
+/*
+ * 批处理模式(--batch读标准输入，-f读脚本文件)
+ * 不输出提示符和每条语句的Executed.，只输出查询结果和错误，最后在标准错误输出一行统计
+ * 输入按大块读进缓冲区，用memchr切分行，不再每行调用一次getline
+ */
+const size_t BATCH_READ_SIZE = 1 << 20;
+
+double elapsed_seconds(struct timespec* start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * 执行fd中的所有语句，返回出错的语句数
+ */
+uint64_t run_batch(Table* table, int fd) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  // 输出也攒成大块再写，终端上也不会每行写一次
+  setvbuf(stdout, NULL, _IOFBF, BATCH_READ_SIZE);
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  size_t capacity = BATCH_READ_SIZE;
+  char* buffer = malloc(capacity);
+  size_t length = 0;
+  uint64_t num_statements = 0;
+  uint64_t num_errors = 0;
+  bool done = false;
+  while (!done) {
+    // 一行比整个缓冲区还长时扩大缓冲区，留一个字节给最后一行补换行符
+    if (capacity - length < 2) {
+      capacity *= 2;
+      buffer = realloc(buffer, capacity);
+    }
+    ssize_t bytes_read = read(fd, buffer + length, capacity - length - 1);
+    if (bytes_read == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Error reading input: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    length += bytes_read;
+    if (bytes_read == 0) {
+      // 最后一行没有换行符时也当作一条完整的语句
+      if (length > 0 && buffer[length - 1] != '\n') {
+        buffer[length++] = '\n';
+      }
+      done = true;
+    }
+
+    size_t consumed = 0;
+    char* newline;
+    while ((newline = memchr(buffer + consumed, '\n', length - consumed)) !=
+           NULL) {
+      char* line = buffer + consumed;
+      consumed = newline - buffer + 1;
+
+      // 去掉换行部分，跳过空行
+      *newline = '\0';
+      if (newline > line && newline[-1] == '\r') {
+        newline[-1] = '\0';
+      }
+      if (line[0] == '\0') {
+        continue;
+      }
+
+      InputResult result = db_execute(table, line, stdout, true);
+      if (result == INPUT_EXIT) {
+        done = true;
+        break;
+      }
+      num_statements += 1;
+      if (result == INPUT_ERROR) {
+        num_errors += 1;
+      }
+    }
+    memmove(buffer, buffer + consumed, length - consumed);
+    length -= consumed;
+  }
+  free(buffer);
+
+  fflush(stdout);
+  fprintf(stderr, "%llu statements, %llu errors, %.3f seconds\n",
+          (unsigned long long)num_statements, (unsigned long long)num_errors,
+          elapsed_seconds(&start));
+  return num_errors;
+}
+
+/*
+ * 服务器模式
+ * 主线程用epoll监听所有连接，读到完整的语句后把连接交给工作线程池执行，
+ * 所有连接共享同一个Pager和页缓存
+ *
+ * 每个连接以EPOLLONESHOT注册，任何时候只属于主线程或一个工作线程:
+ * 主线程收到事件后连接自动解除监听，读完数据交给工作线程，
+ * 工作线程按顺序执行完所有语句并写回结果后再重新注册
+ * 客户端可以连续发送多条语句而不用等待结果(pipelining)，结果按顺序返回
+ */
+const int SERVER_DEFAULT_WORKERS = 4;
+
+#ifdef __linux__
+#define SERVER_MAX_EVENTS 64
+#define SERVER_READ_SIZE 65536
+
+/*
+ * 客户端连接
+ * input          收到但还没有执行的数据
+ * output         执行结果中还没有发送出去的部分
+ * input_closed   客户端已经关闭写端或者发送了.exit，执行完剩下的语句并发送完结果后关闭连接
+ * session        连接自己的会话，保存连接上进行中的显式事务
+ * lock           主线程或工作线程处理连接期间持有，交接连接时保证对方看到最新的状态
+ * next           工作队列中的下一个连接
+ */
+typedef struct Connection {
+  int fd;
+  char* input;
+  size_t input_length;
+  size_t input_capacity;
+  char* output;
+  size_t output_length;
+  size_t output_capacity;
+  bool input_closed;
+  Table* session;
+  pthread_mutex_t lock;
+  struct Connection* next;
+}Connection;
+
+/*
+ * 服务器
+ * queue_head/queue_tail  等待工作线程执行的连接
+ * signal_pipe            收到SIGINT/SIGTERM时写入，让主线程退出事件循环
+ */
+typedef struct Server {
+  Table* table;
+  int epoll_fd;
+  int listen_fd;
+  int signal_pipe[2];
+  pthread_mutex_t queue_lock;
+  pthread_cond_t queue_ready;
+  Connection* queue_head;
+  Connection* queue_tail;
+  bool stopping;
+}Server;
+
+int server_signal_fd = -1;
+
+void server_handle_signal(int signal_number) {
+  char byte = 0;
+  ssize_t result = write(server_signal_fd, &byte, 1);
+  (void)result;
+}
+
+void buffer_append(char** buffer, size_t* length, size_t* capacity,
+                   const char* data, size_t data_length) {
+  if (*length + data_length > *capacity) {
+    size_t new_capacity = *capacity ? *capacity : 4096;
+    while (new_capacity < *length + data_length) {
+      new_capacity *= 2;
+    }
+    *buffer = realloc(*buffer, new_capacity);
+    *capacity = new_capacity;
+  }
+  memcpy(*buffer + *length, data, data_length);
+  *length += data_length;
+}
+
+void connection_free(Connection* connection) {
+  // 断开时还没有提交的事务直接回滚
+  db_session_close(connection->session);
+  pthread_mutex_destroy(&(connection->lock));
+  close(connection->fd);
+  free(connection->input);
+  free(connection->output);
+  free(connection);
+}
+
+/*
+ * 重新注册到epoll，只监听还需要的事件
+ */
+void connection_rearm(Server* server, Connection* connection) {
+  struct epoll_event event;
+  event.events = EPOLLONESHOT;
+  if (!connection->input_closed) {
+    event.events |= EPOLLIN;
+  }
+  if (connection->output_length > 0) {
+    event.events |= EPOLLOUT;
+  }
+  event.data.ptr = connection;
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+}
+
+/*
+ * 把能读到的数据都读进input，返回false表示连接出错需要关闭
+ */
+bool connection_read(Connection* connection) {
+  char data[SERVER_READ_SIZE];
+  while (true) {
+    ssize_t bytes_read = read(connection->fd, data, sizeof(data));
+    if (bytes_read > 0) {
+      buffer_append(&(connection->input), &(connection->input_length),
+                    &(connection->input_capacity), data, bytes_read);
+      continue;
+    }
+    if (bytes_read == 0) {
+      // 最后一行没有换行符时也当作一条完整的语句
+      if (connection->input_length > 0 &&
+          connection->input[connection->input_length - 1] != '\n') {
+        buffer_append(&(connection->input), &(connection->input_length),
+                      &(connection->input_capacity), "\n", 1);
+      }
+      connection->input_closed = true;
+      return true;
+    }
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+  }
+}
+
+/*
+ * 尽可能多地发送output，返回false表示连接出错需要关闭
+ */
+bool connection_flush(Connection* connection) {
+  size_t sent = 0;
+  while (sent < connection->output_length) {
+    ssize_t bytes_written = send(connection->fd, connection->output + sent,
+                                 connection->output_length - sent, MSG_NOSIGNAL);
+    if (bytes_written < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return false;
+    }
+    sent += bytes_written;
+  }
+  memmove(connection->output, connection->output + sent,
+          connection->output_length - sent);
+  connection->output_length -= sent;
+  return true;
+}
+
+bool connection_has_statement(Connection* connection) {
+  return memchr(connection->input, '\n', connection->input_length) != NULL;
+}
+
+void server_enqueue(Server* server, Connection* connection) {
+  pthread_mutex_lock(&(server->queue_lock));
+  connection->next = NULL;
+  if (server->queue_tail == NULL) {
+    server->queue_head = connection;
+  } else {
+    server->queue_tail->next = connection;
+  }
+  server->queue_tail = connection;
+  pthread_cond_signal(&(server->queue_ready));
+  pthread_mutex_unlock(&(server->queue_lock));
+}
+
+/*
+ * 按顺序执行连接中所有完整的语句，结果追加到output
+ */
+void connection_execute(Server* server, Connection* connection) {
+  char* output_buffer = NULL;
+  size_t output_size = 0;
+  FILE* output = open_memstream(&output_buffer, &output_size);
+
+  size_t consumed = 0;
+  while (consumed < connection->input_length) {
+    char* line = connection->input + consumed;
+    char* newline = memchr(line, '\n', connection->input_length - consumed);
+    if (newline == NULL) {
+      break;
+    }
+    consumed = newline - connection->input + 1;
+
+    // 去掉换行部分
+    *newline = '\0';
+    if (newline > line && newline[-1] == '\r') {
+      newline[-1] = '\0';
+    }
+
+    if (db_execute(connection->session, line, output, false) == INPUT_EXIT) {
+      // .exit只关闭当前连接，后面的语句不再执行
+      connection->input_closed = true;
+      consumed = connection->input_length;
+      break;
+    }
+  }
+
+  memmove(connection->input, connection->input + consumed,
+          connection->input_length - consumed);
+  connection->input_length -= consumed;
+
+  fclose(output);
+  buffer_append(&(connection->output), &(connection->output_length),
+                &(connection->output_capacity), output_buffer, output_size);
+  free(output_buffer);
+}
+
+void* server_worker(void* argument) {
+  Server* server = argument;
+  while (true) {
+    pthread_mutex_lock(&(server->queue_lock));
+    while (server->queue_head == NULL && !server->stopping) {
+      pthread_cond_wait(&(server->queue_ready), &(server->queue_lock));
+    }
+    Connection* connection = server->queue_head;
+    if (connection == NULL) {
+      pthread_mutex_unlock(&(server->queue_lock));
+      return NULL;
+    }
+    server->queue_head = connection->next;
+    if (server->queue_head == NULL) {
+      server->queue_tail = NULL;
+    }
+    pthread_mutex_unlock(&(server->queue_lock));
+
+    pthread_mutex_lock(&(connection->lock));
+    connection_execute(server, connection);
+    if (!connection_flush(connection) ||
+        (connection->input_closed && connection->output_length == 0)) {
+      pthread_mutex_unlock(&(connection->lock));
+      connection_free(connection);
+      continue;
+    }
+    connection_rearm(server, connection);
+    pthread_mutex_unlock(&(connection->lock));
+  }
+}
+
+/*
+ * 主线程处理连接上的事件
+ */
+void server_handle_event(Server* server, Connection* connection,
+                         uint32_t events) {
+  pthread_mutex_lock(&(connection->lock));
+  bool ok = true;
+  if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+    if (!connection->input_closed) {
+      ok = connection_read(connection);
+    }
+  }
+  if (ok && (events & EPOLLOUT)) {
+    ok = connection_flush(connection);
+  }
+  if (ok && (events & EPOLLERR)) {
+    ok = false;
+  }
+
+  if (!ok || (!connection_has_statement(connection) &&
+              connection->input_closed && connection->output_length == 0)) {
+    pthread_mutex_unlock(&(connection->lock));
+    connection_free(connection);
+  } else if (connection_has_statement(connection)) {
+    pthread_mutex_unlock(&(connection->lock));
+    server_enqueue(server, connection);
+  } else {
+    connection_rearm(server, connection);
+    pthread_mutex_unlock(&(connection->lock));
+  }
+}
+
+void server_accept(Server* server) {
+  while (true) {
+    int fd = accept(server->listen_fd, NULL, NULL);
+    if (fd == -1) {
+      return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    Connection* connection = calloc(1, sizeof(Connection));
+    connection->fd = fd;
+    connection->session = db_session_open(server->table);
+    db_session_set_nowait(connection->session, true);
+    pthread_mutex_init(&(connection->lock), NULL);
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = connection;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+/*
+ * 监听地址: 全是数字时当作本机的TCP端口，否则当作Unix domain socket的路径
+ */
+int server_listen(const char* address) {
+  int fd;
+  if (strspn(address, "0123456789") == strlen(address)) {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in socket_address;
+    memset(&socket_address, 0, sizeof(socket_address));
+    socket_address.sin_family = AF_INET;
+    socket_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socket_address.sin_port = htons(atoi(address));
+    if (bind(fd, (struct sockaddr*)&socket_address, sizeof(socket_address)) ==
+        -1) {
+      close(fd);
+      return -1;
+    }
+  } else {
+    struct sockaddr_un socket_address;
+    if (strlen(address) >= sizeof(socket_address.sun_path)) {
+      return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&socket_address, 0, sizeof(socket_address));
+    socket_address.sun_family = AF_UNIX;
+    strcpy(socket_address.sun_path, address);
+    unlink(address);
+    if (bind(fd, (struct sockaddr*)&socket_address, sizeof(socket_address)) ==
+        -1) {
+      close(fd);
+      return -1;
+    }
+  }
+
+  if (listen(fd, SOMAXCONN) == -1) {
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+/*
+ * 启动服务器，直到收到SIGINT/SIGTERM才返回
+ */
+int serve(Table* table, const char* address, int num_workers) {
+  Server server;
+  memset(&server, 0, sizeof(server));
+  server.table = table;
+  pthread_mutex_init(&(server.queue_lock), NULL);
+  pthread_cond_init(&(server.queue_ready), NULL);
+
+  server.listen_fd = server_listen(address);
+  if (server.listen_fd == -1) {
+    printf("Unable to listen on %s: %d\n", address, errno);
+    return -1;
+  }
+
+  if (pipe(server.signal_pipe) == -1) {
+    printf("Unable to create signal pipe: %d\n", errno);
+    return -1;
+  }
+  server_signal_fd = server.signal_pipe[1];
+  signal(SIGINT, server_handle_signal);
+  signal(SIGTERM, server_handle_signal);
+  signal(SIGPIPE, SIG_IGN);
+
+  server.epoll_fd = epoll_create1(0);
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = &(server.listen_fd);
+  epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &event);
+  event.events = EPOLLIN;
+  event.data.ptr = &(server.signal_pipe[0]);
+  epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.signal_pipe[0], &event);
+
+  if (num_workers < 1) {
+    num_workers = 1;
+  }
+  pthread_t* workers = malloc(num_workers * sizeof(pthread_t));
+  for (int i = 0; i < num_workers; i++) {
+    pthread_create(&workers[i], NULL, server_worker, &server);
+  }
+
+  printf("Listening on %s\n", address);
+  fflush(stdout);
+
+  struct epoll_event events[SERVER_MAX_EVENTS];
+  bool running = true;
+  while (running) {
+    int num_events = epoll_wait(server.epoll_fd, events, SERVER_MAX_EVENTS, -1);
+    if (num_events == -1 && errno != EINTR) {
+      break;
+    }
+    for (int i = 0; i < num_events; i++) {
+      if (events[i].data.ptr == &(server.listen_fd)) {
+        server_accept(&server);
+      } else if (events[i].data.ptr == &(server.signal_pipe[0])) {
+        running = false;
+      } else {
+        server_handle_event(&server, events[i].data.ptr, events[i].events);
+      }
+    }
+  }
+
+  // 等工作线程执行完队列中的语句后再返回，之后由调用者关闭数据库
+  pthread_mutex_lock(&(server.queue_lock));
+  server.stopping = true;
+  pthread_cond_broadcast(&(server.queue_ready));
+  pthread_mutex_unlock(&(server.queue_lock));
+  for (int i = 0; i < num_workers; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+
+  close(server.listen_fd);
+  if (!(strspn(address, "0123456789") == strlen(address))) {
+    unlink(address);
+  }
+  close(server.epoll_fd);
+  close(server.signal_pipe[0]);
+  close(server.signal_pipe[1]);
+  return 0;
+}
+
+#else
+
+int serve(Table* table, const char* address, int num_workers) {
+  printf("Server mode requires epoll (Linux only).\n");
+  return -1;
+}
+
+#endif
+
+/*
+ * 定期统计(--stats-file)
+ * 后台线程每隔interval秒把页管理器计数作为一行JSON追加到统计文件，关闭数据库前再写最后一行
+ */
+const int STATS_DEFAULT_INTERVAL = 10;
+
+typedef struct StatsDumper {
+  Table* table;
+  FILE* file;
+  int interval;
+  bool stopping;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t stop;
+}StatsDumper;
+
+void stats_dump_write(StatsDumper* dumper) {
+  PagerStats stats;
+  db_pager_stats(dumper->table, &stats);
+  fprintf(dumper->file,
+          "{\"time\": %lld, \"cache_hits\": %llu, \"cache_misses\": %llu, "
+          "\"cache_evictions\": %llu, "
+          "\"file_reads\": %llu, \"file_read_bytes\": %llu, "
+          "\"readahead_pages\": %llu, "
+          "\"file_writes\": %llu, \"file_write_bytes\": %llu, "
+          "\"wal_writes\": %llu, \"wal_write_bytes\": %llu, "
+          "\"syncs\": %llu, \"leaf_splits\": %llu, \"root_splits\": %llu, "
+          "\"pages_allocated\": %llu}\n",
+          (long long)time(NULL), (unsigned long long)stats.cache_hits,
+          (unsigned long long)stats.cache_misses,
+          (unsigned long long)stats.cache_evictions,
+          (unsigned long long)stats.file_reads,
+          (unsigned long long)stats.file_read_bytes,
+          (unsigned long long)stats.readahead_pages,
+          (unsigned long long)stats.file_writes,
+          (unsigned long long)stats.file_write_bytes,
+          (unsigned long long)stats.wal_writes,
+          (unsigned long long)stats.wal_write_bytes,
+          (unsigned long long)stats.syncs,
+          (unsigned long long)stats.leaf_splits,
+          (unsigned long long)stats.root_splits,
+          (unsigned long long)stats.pages_allocated);
+  fflush(dumper->file);
+}
+
+void* stats_dump_worker(void* argument) {
+  StatsDumper* dumper = argument;
+  pthread_mutex_lock(&(dumper->lock));
+  while (!dumper->stopping) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += dumper->interval;
+    while (!dumper->stopping &&
+           pthread_cond_timedwait(&(dumper->stop), &(dumper->lock),
+                                  &deadline) != ETIMEDOUT) {
+    }
+    if (!dumper->stopping) {
+      stats_dump_write(dumper);
+    }
+  }
+  pthread_mutex_unlock(&(dumper->lock));
+  return NULL;
+}
+
+StatsDumper* stats_dump_start(Table* table, const char* path, int interval) {
+  FILE* file = fopen(path, "a");
+  if (file == NULL) {
+    printf("Unable to open stats file %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  StatsDumper* dumper = malloc(sizeof(StatsDumper));
+  dumper->table = table;
+  dumper->file = file;
+  dumper->interval = interval < 1 ? 1 : interval;
+  dumper->stopping = false;
+  pthread_mutex_init(&(dumper->lock), NULL);
+  pthread_cond_init(&(dumper->stop), NULL);
+  pthread_create(&(dumper->thread), NULL, stats_dump_worker, dumper);
+  return dumper;
+}
+
+void stats_dump_stop(StatsDumper* dumper) {
+  if (dumper == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&(dumper->lock));
+  dumper->stopping = true;
+  pthread_cond_signal(&(dumper->stop));
+  pthread_mutex_unlock(&(dumper->lock));
+  pthread_join(dumper->thread, NULL);
+
+  stats_dump_write(dumper);
+  fclose(dumper->file);
+  pthread_mutex_destroy(&(dumper->lock));
+  pthread_cond_destroy(&(dumper->stop));
+  free(dumper);
+}
+
+int main(int argc, char* argv[]) {
+  char* filename = NULL;
+  char* serve_address = NULL;
+  char* script = NULL;
+  bool batch = false;
+  bool shared = false;
+  bool direct = false;
+  int num_workers = SERVER_DEFAULT_WORKERS;
+  char* stats_file = NULL;
+  int stats_interval = STATS_DEFAULT_INTERVAL;
+  int cache_pages = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--batch") == 0) {
+      batch = true;
+    } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+      script = argv[++i];
+      batch = true;
+    } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+      serve_address = argv[++i];
+    } else if (strcmp(argv[i], "--shared") == 0) {
+      shared = true;
+    } else if (strcmp(argv[i], "--direct") == 0) {
+      direct = true;
+    } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+      num_workers = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--stats-file") == 0 && i + 1 < argc) {
+      stats_file = argv[++i];
+    } else if (strcmp(argv[i], "--stats-interval") == 0 && i + 1 < argc) {
+      stats_interval = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--cache-pages") == 0 && i + 1 < argc) {
+      cache_pages = atoi(argv[++i]);
+    } else {
+      filename = argv[i];
+    }
+  }
+
+  if (filename == NULL) {
+    printf("Must supply a database filename.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  Table* table =
+      direct ? db_open_direct(filename, shared) : db_open(filename, shared);
+  if (cache_pages > 0) {
+    db_set_cache_pages(table, cache_pages);
+  }
+  StatsDumper* dumper = NULL;
+  if (stats_file != NULL) {
+    dumper = stats_dump_start(table, stats_file, stats_interval);
+  }
+
+  if (serve_address != NULL) {
+    int result = serve(table, serve_address, num_workers);
+    stats_dump_stop(dumper);
+    db_close(table);
+    exit(result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  if (batch) {
+    int fd = STDIN_FILENO;
+    if (script != NULL) {
+      fd = open(script, O_RDONLY);
+      if (fd == -1) {
+        printf("Unable to open script %s\n", script);
+        exit(EXIT_FAILURE);
+      }
+    }
+    uint64_t num_errors = run_batch(table, fd);
+    stats_dump_stop(dumper);
+    db_close(table);
+    exit(num_errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  InputBuffer* input_buffer = new_input_buffer();
+  while (true) {
+    print_prompt();
+    read_input(input_buffer);
+
+    if (db_execute(table, input_buffer->buffer, stdout, false) == INPUT_EXIT) {
+      stats_dump_stop(dumper);
+      db_close(table);
+      exit(EXIT_SUCCESS);
+    }
+  }
+}
@@ -1,6 +1,8 @@
+require 'json'
+
 describe 'database' do
   before do
-    `rm -rf test.db`
+    `rm -rf test.db test.db-wal`
   end
 
   def run_script(commands)
@@ -57,16 +59,29 @@ describe 'database' do
     ])
   end
 
-  it 'prints error message when table is full' do
-    script = (1..1401).map do |i|
+  it 'splits internal nodes and grows past 100 pages' do
+    ids = (1..1401).to_a.shuffle(random: Random.new(42))
+    script = ids.map do |i|
       "insert #{i} user#{i} person#{i}@example.com"
     end
     script << ".exit"
     result = run_script(script)
     expect(result.last(2)).to eq([
       "db > Executed.",
-      "db > Need to implement splitting internal node",
+      "db > ",
+    ])
+    expect(File.size("test.db") / 4096).to eq(234)
+
+    result = run_script([
+      "select count(*)",
+      "select where id = 1401",
+      "select",
+      ".exit",
     ])
+    expect(result[0]).to eq("db > (1401)")
+    expect(result[2]).to eq("db > (1401, user1401, person1401@example.com)")
+    rows = result[4..-3].map { |line| line.sub("db > ", "")[/^\((\d+),/, 1].to_i }
+    expect(rows).to eq((1..1401).to_a)
   end
 
   it 'allows inserting strings that are the maximum length' do
@@ -116,6 +131,22 @@ describe 'database' do
     ])
   end
 
+  it 'requires a space or end of input after the statement keyword' do
+    script = [
+      "insert 1 user1 person1@example.com",
+      "selectfoo",
+      "insertx 2 user2 person2@example.com",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to eq([
+      "db > Executed.",
+      "db > Unrecognized keyword at start of 'selectfoo'.",
+      "db > Unrecognized keyword at start of 'insertx 2 user2 person2@example.com'.",
+      "db > ",
+    ])
+  end
+
   it 'prints an error message if there is a duplicate id' do
     script = [
       "insert 1 user1 person1@example.com",
@@ -184,7 +215,7 @@ describe 'database' do
       "    - 13",
       "    - 14",
       "    - 15",
-      "db > Executed.",
+      "db > Error: Duplicate key.",
       "db > "
     ])
   end
@@ -317,4 +348,841 @@ describe 'database' do
       "db > ",
     ])
   end
+
+  it 'evaluates aggregate queries over a multi-level tree' do
+    script = (1..15).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select count(*)"
+    script << "select min(id)"
+    script << "select max(id)"
+    script << "select sum(id)"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result[15...(result.length)]).to eq([
+      "db > (15)",
+      "Executed.",
+      "db > (1)",
+      "Executed.",
+      "db > (15)",
+      "Executed.",
+      "db > (120)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'evaluates aggregate queries on an empty table' do
+    script = [
+      "select count(*)",
+      "select min(id)",
+      "select sum(id)",
+      "select avg(id)",
+      ".exit",
+    ]
+    result = run_script(script)
+
+    expect(result).to eq([
+      "db > (0)",
+      "Executed.",
+      "db > (NULL)",
+      "Executed.",
+      "db > (0)",
+      "Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+  end
+
+  it 'filters rows with a where clause on username and email' do
+    script = [
+      "insert 1 alice alice@example.com",
+      "insert 2 bob bob@corp.org",
+      "insert 3 carol carol@example.com",
+      "insert 4 alicia alicia@corp.org",
+      "select where username = 'alice'",
+      "select where email like 'ali%'",
+      "select where email like '%@corp.org'",
+      "select where email like '%ro%'",
+      "select count(*) where email like '%@example.com'",
+      "select max(id) where username = 'nobody'",
+      "select where id like '1%'",
+      ".exit",
+    ]
+    result = run_script(script)
+
+    expect(result[4...(result.length)]).to eq([
+      "db > (1, alice, alice@example.com)",
+      "Executed.",
+      "db > (1, alice, alice@example.com)",
+      "(4, alicia, alicia@corp.org)",
+      "Executed.",
+      "db > (2, bob, bob@corp.org)",
+      "(4, alicia, alicia@corp.org)",
+      "Executed.",
+      "db > (3, carol, carol@example.com)",
+      "Executed.",
+      "db > (2)",
+      "Executed.",
+      "db > (NULL)",
+      "Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+  end
+
+  it 'scans partitions of the tree in parallel and merges them in order' do
+    script = (1..30).map do |i|
+      domain = i.even? ? "even.com" : "odd.com"
+      "insert #{i} user#{i} person#{i}@#{domain}"
+    end
+    script << ".threads 4"
+    script << "select where email like '%@odd.com'"
+    script << "select count(*) where email like '%@even.com'"
+    script << "select sum(id)"
+    script << "select min(id) where username like 'user2%'"
+    script << ".threads 1"
+    script << "select count(*) where email like '%@even.com'"
+    script << ".exit"
+    result = run_script(script)
+
+    odd_rows = (1..30).step(2).map { |i| "(#{i}, user#{i}, person#{i}@odd.com)" }
+    odd_rows[0] = "db > " + odd_rows[0]
+    expect(result[30...(result.length)]).to eq([
+      "db > Scan threads: 4",
+      *odd_rows,
+      "Executed.",
+      "db > (15)",
+      "Executed.",
+      "db > (465)",
+      "Executed.",
+      "db > (2)",
+      "Executed.",
+      "db > Scan threads: 1",
+      "db > (15)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'partitions scans below the root when there are more threads than root children' do
+    ids = (1..1401).to_a.shuffle(random: Random.new(7))
+    script = ids.map do |i|
+      domain = i.even? ? "even.com" : "odd.com"
+      "insert #{i} user#{i} person#{i}@#{domain}"
+    end
+    script << ".threads 16"
+    script << "select sum(id)"
+    script << "select count(*) where email like '%@even.com'"
+    script << "select where email like '%@odd.com'"
+    script << ".exit"
+    result = run_script(script)[1401..-1]
+
+    expect(result[0..4]).to eq([
+      "db > Scan threads: 16",
+      "db > (982101)",
+      "Executed.",
+      "db > (700)",
+      "Executed.",
+    ])
+    rows = result[5..-3].map { |line| line.sub("db > ", "")[/^\((\d+),/, 1].to_i }
+    expect(rows).to eq((1..1401).step(2).to_a)
+  end
+
+  it 'looks up a batch of ids with select where id in' do
+    script = [18, 7, 10, 29, 23, 4, 14, 30, 15, 26, 22, 19, 2, 1, 21,
+              11, 6, 20, 5, 8, 9, 3, 12, 27, 17, 16, 13, 24, 25, 28].map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select where id in (29, 3, 7, 3, 100, 16)"
+    script << "select count(*) where id in (1,2,3,31)"
+    script << "select where id = 22"
+    script << "select max(id) where id in (40, 50)"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result[30...(result.length)]).to eq([
+      "db > (3, user3, person3@example.com)",
+      "(7, user7, person7@example.com)",
+      "(16, user16, person16@example.com)",
+      "(29, user29, person29@example.com)",
+      "Executed.",
+      "db > (3)",
+      "Executed.",
+      "db > (22, user22, person22@example.com)",
+      "Executed.",
+      "db > (NULL)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'rejects out of range ids and malformed id lists' do
+    result = run_script([
+      "insert 1 user1 person1@example.com",
+      "select where id = 4294967297",
+      "select where id = 99999999999999999999",
+      "select where id = (1",
+      "select where id = 1, 2",
+      "select where id in 1 2 3",
+      "select where id in (1 2)",
+      "select where id in (1, 2",
+      "select where id in ( 1 , 2 )",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > (1, user1, person1@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'updates rows in place and upserts with insert or replace' do
+    script = (1..15).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "update set username=renamed, email='new@example.com' where id = 9"
+    script << "update set email=only@example.com where id = 2"
+    script << "update set username=ghost where id = 99"
+    script << "insert 3 dup dup@example.com"
+    script << "insert or replace 3 upserted upserted@example.com"
+    script << "insert or replace 16 user16 person16@example.com"
+    # 4294967297 would wrap onto id 1 if it were truncated to 32 bits
+    script << "insert or replace 4294967297 evil evil@example.com"
+    script << "update set username=evil where id = 4294967297"
+    script << "update set username=evil where id = 1abc"
+    script << "select where id in (1, 2, 3, 9, 16)"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result[15...(result.length)]).to eq([
+      "db > Executed.",
+      "db > Executed.",
+      "db > Error: Key not found.",
+      "db > Error: Duplicate key.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, only@example.com)",
+      "(3, upserted, upserted@example.com)",
+      "(9, renamed, new@example.com)",
+      "(16, user16, person16@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'times statements and reports latency percentiles per statement type' do
+    result = run_script([
+      "insert 1 user1 person1@example.com",
+      "insert 1 user1 person1@example.com",
+      ".timer on",
+      "select",
+      ".timer off",
+      ".stats",
+      ".stats reset",
+      ".stats",
+      ".exit",
+    ])
+    expect(result[2]).to eq("db > db > (1, user1, person1@example.com)")
+    expect(result[3]).to eq("Executed.")
+    expect(result[4]).to match(/^Run time: parse \d+\.\d us, execute \d+\.\d us$/)
+    expect(result[5]).to eq("db > db > Statement latency (us):")
+    expect(result[6]).to match(/^insert parse: count 2, avg [\d.]+, p50 [\d.]+, p90 [\d.]+, p99 [\d.]+, p999 [\d.]+, max [\d.]+$/)
+    expect(result[7]).to match(/^insert execute: count 2, /)
+    expect(result[8]).to match(/^select parse: count 1, /)
+    expect(result[9]).to match(/^select execute: count 1, /)
+    expect(result[10..-1]).to eq([
+      "db > db > Statement latency (us):",
+      "db > ",
+    ])
+  end
+
+  it 'reports tree depth, leaf fill and leaf chain order with .analyze' do
+    script = (1..14).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << ".analyze"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[14..-1]).to eq([
+      "db > Tree analysis:",
+      "depth: 2",
+      "level 0: 1 internal",
+      "level 1: 2 leaf",
+      "rows: 14",
+      "leaf fill: avg 53.8%",
+      "leaf fill 50-59%: 2",
+      # The split copies the old root's rows to a new page, so the chain runs backwards
+      "leaf chain: 2 leaves, 1 out-of-order links, avg distance 1.0 pages",
+      "free pages: 0 of 3",
+      "bytes per row: 877.7 (row size 293)",
+      "db > ",
+    ])
+  end
+
+  it 'relocates leaves with vacuum n and rebuilds a compact tree with vacuum' do
+    script = (1..30).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += [
+      "vacuum 1",
+      "vacuum 1",
+      ".analyze",
+      "vacuum",
+      ".analyze",
+      "select count(*)",
+      "select where id = 14",
+      ".exit",
+    ]
+    result = run_script(script)
+    summary = result.select { |line| line =~ /Relocated|level 1:|leaf chain|free pages|> \(/ }
+    expect(summary).to eq([
+      "db > Relocated 1 leaves.",
+      "db > Relocated 0 leaves.",
+      "level 1: 4 leaf",
+      "leaf chain: 4 leaves, 0 out-of-order links, avg distance 1.0 pages",
+      "free pages: 0 of 5",
+      "level 1: 3 leaf",
+      "leaf chain: 3 leaves, 0 out-of-order links, avg distance 1.0 pages",
+      "free pages: 0 of 4",
+      "db > (30)",
+      "db > (14, user14, person14@example.com)",
+    ])
+    # The pages freed by the rebuild are cut off the end of the file
+    expect(File.size("test.db")).to eq(4 * 4096)
+  end
+
+  it 'continues vacuum n where the previous step stopped' do
+    script = 60.downto(1).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += ["vacuum 2"] * 5
+    script += [
+      "insert 61 user61 person61@example.com",
+      "vacuum 2",
+      ".analyze",
+      "select count(*)",
+      "select where id = 1",
+      ".exit",
+    ]
+    result = run_script(script)
+    summary = result.select { |line| line =~ /Relocated|leaf chain|> \(/ }
+    expect(summary).to eq([
+      "db > Relocated 2 leaves.",
+      "db > Relocated 2 leaves.",
+      "db > Relocated 2 leaves.",
+      "db > Relocated 1 leaves.",
+      "db > Relocated 0 leaves.",
+      # The insert in between sends the next step back to the head of the chain
+      "db > Relocated 0 leaves.",
+      "leaf chain: 8 leaves, 0 out-of-order links, avg distance 1.0 pages",
+      "db > (61)",
+      "db > (1, user1, person1@example.com)",
+    ])
+  end
+
+  it 'reads ahead the leaves of a sequential scan in one coalesced read' do
+    script = (1..30).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += ["vacuum", ".exit"]
+    run_script(script)
+
+    # After vacuum leaves 2 and 3 sit on adjacent pages, so leaving leaf 1
+    # pulls both into the cache with a single read
+    result = run_script([".threads 1", "select where username = 'user30'", ".pagerstats", ".exit"])
+    expect(result).to include(
+      "cache misses: 2",
+      "file reads: 3 (16384 bytes)",
+      "readahead pages: 2",
+    )
+
+    # count(*) walks the leaf chain without reading rows and reads ahead the same way
+    result = run_script(["select count(*)", ".pagerstats", ".exit"])
+    expect(result).to include(
+      "cache misses: 2",
+      "file reads: 3 (16384 bytes)",
+      "readahead pages: 2",
+    )
+  end
+
+  it 'loads the leaves of a multi-key lookup as one batch' do
+    script = 30.downto(1).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << ".exit"
+    run_script(script)
+
+    # Only the root and the first key's leaf are read one at a time
+    result = run_script(["select where id in (1, 9, 17, 25, 30)", ".pagerstats", ".exit"])
+    expect(result[5]).to eq("Executed.")
+    expect(result).to include("cache misses: 2", "readahead pages: 2")
+  end
+
+  it 'reads and writes the database file with direct I/O' do
+    script = 30.downto(1).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += ["vacuum", "select count(*)"]
+    File.write("test.sql", script.join("\n"))
+    written = `./db test.db --direct -f test.sql 2>/dev/null`
+    File.write("test.sql", "select where id in (1, 15, 30)\n.pagerstats\n")
+    direct = `./db test.db --direct -f test.sql 2>/dev/null`
+    `rm -f test.sql`
+
+    expect(written).to eq("(30)\n")
+    expect(direct.lines.first(3)).to eq([
+      "(1, user1, person1@example.com)\n",
+      "(15, user15, person15@example.com)\n",
+      "(30, user30, person30@example.com)\n",
+    ])
+    # Root, first leaf, then the two remaining leaves in one coalesced read
+    expect(direct).to include("file reads: 3 (16384 bytes)\n")
+    expect(File.size("test.db")).to eq(4 * 4096)
+
+    result = run_script(["select where id = 30", ".exit"])
+    expect(result.first).to eq("db > (30, user30, person30@example.com)")
+  end
+
+  it 'evicts clean pages once the page cache is over its limit' do
+    script = (1..30).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += ["vacuum", ".exit"]
+    run_script(script)
+
+    result = run_script([
+      ".cachesize 2",
+      "select count(*)",
+      "select where id = 30",
+      ".cachesize",
+      ".pagerstats",
+      ".cachesize 0",
+      ".exit",
+    ])
+    expect(result).to include(
+      "db > Cache pages: 2 (0 cached)",
+      "db > (30)",
+      "db > (30, user30, person30@example.com)",
+      "db > Cache pages: 2 (2 cached)",
+      "cache evictions: 3",
+      "db > Unrecognized command '.cachesize'",
+    )
+
+    # Pages not yet written back stay cached until the checkpoint, then the data reads back intact
+    script = 200.downto(31).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    File.write("test.sql", script.join("\n"))
+    `./db test.db --cache-pages 2 -f test.sql 2>/dev/null`
+    `rm -f test.sql`
+    result = run_script([".cachesize 2", "select count(*)", "select where id = 123", ".exit"])
+    expect(result[1]).to eq("db > (200)")
+    expect(result[3]).to eq("db > (123, user123, person123@example.com)")
+  end
+
+  it 'explains the access path and profiles pages visited per level' do
+    script = (1..14).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += [
+      ".threads 1",
+      "explain select where id = 3",
+      "explain select where id in (1, 14)",
+      "explain select where username = 'user3'",
+      "explain select count(*)",
+      "explain analyze select where id = 3",
+      "explain analyze select where username = 'user3'",
+      "explain prepare q as select",
+      ".exit",
+    ]
+    result = run_script(script)[15..-1]
+    expect(result[0..4]).to eq([
+      "db > Access path: point descent on id",
+      "db > Access path: batched point descents on id (2 keys)",
+      "db > Access path: full scan with filter on username (scan threads: 1)",
+      "db > Access path: leaf chain walk reading cell counts",
+      "db > Access path: point descent on id",
+    ])
+    expect(result[5..7]).to eq([
+      "Pages visited: level 0: 1, level 1: 1",
+      "Cache misses: 0",
+      "Rows examined: 1, returned: 1",
+    ])
+    expect(result[8]).to match(/^Time: parse \d+\.\d us, execute \d+\.\d us$/)
+    expect(result[9..13]).to eq([
+      "Executed.",
+      "db > Access path: full scan with filter on username (scan threads: 1)",
+      "Pages visited: level 0: 1, level 1: 3",
+      "Cache misses: 0",
+      "Rows examined: 14, returned: 1",
+    ])
+    expect(result[15..-1]).to eq([
+      "Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+  end
+
+  it 'counts page cache hits, splits and allocations' do
+    script = (1..14).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += [".pagerstats", ".pagerstats reset", ".pagerstats"]
+    File.write("test.sql", script.join("\n"))
+    stdout = `./db test.db -f test.sql --stats-file test.stats 2>/dev/null`
+    dumps = File.readlines("test.stats").map { |line| JSON.parse(line) }
+    `rm -f test.sql test.stats`
+
+    report = stdout.split("Pager stats:\n")
+    expect(report[1]).to match(/\Acache hits: \d+\ncache misses: 3\ncache hit ratio: \d+\.\d%\n/)
+    expect(report[1]).to include("leaf splits: 1\n", "root splits: 1\n", "pages allocated: 2\n")
+    expect(report[2]).to include("cache hits: 0\n", "leaf splits: 0\n", "pages allocated: 0\n")
+
+    # The last line is written on exit, after the counters were reset
+    expect(dumps.last["leaf_splits"]).to eq(0)
+    expect(dumps.last.keys).to include("time", "cache_hits", "file_write_bytes", "wal_write_bytes", "syncs")
+  end
+
+  it 'runs a script in batch mode printing only results, errors and a summary' do
+    script = (1..30).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += ["", "insert 1 user1 person1@example.com", "select where id in (2, 30)", "select count(*)"]
+    File.write("test.sql", script.join("\n"))
+    stdout = `./db test.db -f test.sql 2>test.err`
+    status = $?.exitstatus
+    summary = File.read("test.err")
+    `rm -f test.sql test.err`
+
+    expect(stdout.split("\n")).to eq([
+      "Error: Duplicate key.",
+      "(2, user2, person2@example.com)",
+      "(30, user30, person30@example.com)",
+      "(30)",
+    ])
+    expect(summary).to match(/\A33 statements, 1 errors, \d+\.\d{3} seconds\n\z/)
+    expect(status).to eq(1)
+
+    piped = `echo "select count(*)" | ./db test.db --batch 2>/dev/null`
+    expect(piped).to eq("(30)\n")
+  end
+
+  it 'reports busy instead of blocking a worker while another client holds a transaction' do
+    require 'socket'
+    socket_path = "test.sock"
+    server = IO.popen(["./db", "test.db", "--serve", socket_path, "--workers", "1"], "r")
+    expect(server.gets).to eq("Listening on #{socket_path}\n")
+
+    a = UNIXSocket.new(socket_path)
+    b = UNIXSocket.new(socket_path)
+    responses = []
+    a.write("begin\n")
+    responses << a.gets
+    b.write("insert 2 user2 person2@example.com\n")
+    responses << b.gets
+    b.write("begin\n")
+    responses << b.gets
+    b.write("select count(*)\n")
+    responses << b.gets << b.gets
+    a.write("insert 1 user1 person1@example.com\ncommit\n")
+    responses << a.gets << a.gets
+    b.write("insert 2 user2 person2@example.com\nselect count(*)\n")
+    responses << b.gets << b.gets << b.gets
+    a.close
+    b.close
+
+    Process.kill("TERM", server.pid)
+    server.close
+
+    expect(responses.map(&:chomp)).to eq([
+      "Executed.",
+      "Error: Database is busy.",
+      "Error: Database is busy.",
+      "(0)",
+      "Executed.",
+      "Executed.",
+      "Executed.",
+      "Executed.",
+      "(2)",
+      "Executed.",
+    ])
+  end
+
+  it 'serves pipelined statements from several clients over a socket' do
+    require 'socket'
+    socket_path = "test.sock"
+    server = IO.popen(["./db", "test.db", "--serve", socket_path, "--workers", "2"], "r")
+    expect(server.gets).to eq("Listening on #{socket_path}\n")
+
+    clients = (0...2).map { UNIXSocket.new(socket_path) }
+    clients.each_with_index do |client, c|
+      (1..10).each do |i|
+        id = c * 10 + i
+        client.write("insert #{id} user#{id} person#{id}@example.com\n")
+      end
+      client.close_write
+    end
+    responses = clients.map { |client| client.read.split("\n") }
+    clients.each(&:close)
+
+    client = UNIXSocket.new(socket_path)
+    client.write("select count(*)\ninsert 1 a b\n.exit\nselect\n")
+    result = client.read.split("\n")
+    client.close
+
+    Process.kill("TERM", server.pid)
+    server.close
+
+    expect(responses).to eq([["Executed."] * 10] * 2)
+    expect(result).to eq([
+      "(20)",
+      "Executed.",
+      "Error: Duplicate key.",
+    ])
+  end
+
+  it 'prepares statements once and executes them with bound values' do
+    result = run_script([
+      "prepare ins as insert ? ? ?",
+      "prepare get as select where id in (?, ?)",
+      "prepare rename as update set username=? where id = ?",
+      "prepare find as select where email like ?",
+      "execute ins 2 bob bob@example.com",
+      "execute ins 1 alice alice@example.com",
+      "execute ins 1 alice alice@example.com",
+      "execute rename alicia 1",
+      "execute get 2 1",
+      "execute get 3 1",
+      "execute find alice%",
+      "execute find %@example.com",
+      "execute ins 3 bob",
+      "execute ins -3 bob b@x",
+      "execute missing 1",
+      "insert ? a b",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Error: Duplicate key.",
+      "db > Executed.",
+      "db > (1, alicia, alice@example.com)",
+      "(2, bob, bob@example.com)",
+      "Executed.",
+      "db > (1, alicia, alice@example.com)",
+      "Executed.",
+      "db > (1, alicia, alice@example.com)",
+      "Executed.",
+      "db > (1, alicia, alice@example.com)",
+      "(2, bob, bob@example.com)",
+      "Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ID must be positive.",
+      "db > Error: Unknown prepared statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+  end
+
+  it 'reads and writes typed rows through the library' do
+    File.write("test_api.c", <<~'C')
+      #include <stdio.h>
+      #include <string.h>
+      #include "db.h"
+
+      int main(void) {
+        Table* table = db_open("test.db", false);
+        Row row;
+        memset(&row, 0, sizeof(row));
+        for (uint32_t id = 3; id >= 1; id--) {
+          row.id = id;
+          snprintf(row.username, sizeof(row.username), "user%u", id);
+          snprintf(row.email, sizeof(row.email), "person%u@example.com", id);
+          db_insert(table, &row);
+        }
+        printf("duplicate: %d\n", db_insert(table, &row) == EXECUTE_DUPLICATE_KEY);
+
+        strcpy(row.username, "renamed");
+        db_update(table, &row);
+        printf("missing: %d\n", db_find(table, 4, &row) == EXECUTE_KEY_NOT_FOUND);
+
+        Table* session = db_session_open(table);
+        db_begin(session);
+        row.id = 4;
+        db_insert(session, &row);
+        db_rollback(session);
+        db_session_close(session);
+
+        PreparedStatement* lookup = db_prepare("select where id = ?");
+        db_bind_int(lookup, 0, 2);
+        db_execute_prepared(table, lookup, stdout);
+        printf("bad bind: %d\n", db_bind_text(lookup, 0, "x"));
+        db_finalize(lookup);
+
+        Scan* first = db_scan_open(table);
+        Scan* scan = db_scan_open(table);
+        db_scan_next(first, &row);
+        db_scan_close(first);
+        db_find(table, 3, &row);
+        while (db_scan_next(scan, &row)) {
+          printf("(%u, %s, %s)\n", row.id, row.username, row.email);
+        }
+        db_scan_close(scan);
+        scan = db_scan_open_at(table, 2);
+        while (db_scan_next(scan, &row)) {
+          printf("from 2: %u\n", row.id);
+        }
+        db_scan_close(scan);
+        scan = db_scan_open_at(table, 4);
+        printf("from 4: %d\n", db_scan_next(scan, &row));
+        db_scan_close(scan);
+        db_close(table);
+        return 0;
+      }
+    C
+    expect(system("make -s libdb.a && gcc test_api.c libdb.a -I. -o test_api -pthread")).to eq(true)
+    output = `./test_api`
+    `rm -f test_api.c test_api`
+
+    expect(output.split("\n")).to eq([
+      "duplicate: 1",
+      "missing: 1",
+      "(2, user2, person2@example.com)",
+      "bad bind: 0",
+      "(1, renamed, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "(3, user3, person3@example.com)",
+      "from 2: 2",
+      "from 2: 3",
+      "from 4: 0",
+    ])
+    expect(run_script(["select count(*)", ".exit"])).to eq([
+      "db > (3)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'runs the benchmark workloads and reports latencies as JSON' do
+    expect(system("make -s dbbench")).to eq(true)
+    output = `./dbbench --rows 10,20 --ops 200 --file test.db`
+    expect($?.success?).to eq(true)
+
+    report = JSON.parse(output)
+    expect(report["seed"]).to eq(42)
+    results = report["results"]
+    expect(results.map { |r| [r["workload"], r["rows"], r["ops"]] }).to eq([
+      ["seq_insert", 10, 10],
+      ["random_insert", 10, 10],
+      ["point_lookup", 10, 200],
+      ["range_scan", 10, 20],
+      ["full_scan", 10, 20],
+      ["mixed", 10, 200],
+      ["seq_insert", 20, 20],
+      ["random_insert", 20, 20],
+      ["point_lookup", 20, 200],
+      ["range_scan", 20, 10],
+      ["full_scan", 20, 10],
+      ["mixed", 20, 200],
+    ])
+    results.each do |r|
+      expect(r["p50_ns"] <= r["p99_ns"] && r["p99_ns"] <= r["p999_ns"]).to eq(true)
+    end
+    # The benchmark cleans up its database files
+    expect(File.exist?("test.db")).to eq(false)
+  end
+
+  it 'commits and rolls back explicit transactions' do
+    result = run_script([
+      "commit",
+      "begin",
+      "insert 1 user1 person1@example.com",
+      "insert 2 user2 person2@example.com",
+      "begin",
+      "select",
+      "rollback",
+      "select",
+      "begin",
+      "insert 3 user3 person3@example.com",
+      "commit",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > Error: No transaction is active.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Error: Transaction already active.",
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > ",
+    ])
+
+    result = run_script([
+      "select",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > (3, user3, person3@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'locks the database against a second process unless both open it shared' do
+    IO.popen("./db test.db --shared", "r+") do |pipe|
+      pipe.puts "insert 1 user1 person1@example.com"
+      pipe.flush
+      # Shared mode writes each commit back to the file; once it shows up the database is open
+      sleep 0.01 until File.size?("test.db")
+
+      locked = `echo .exit | ./db test.db`
+      expect(locked).to eq("Database is locked by another process.\n")
+
+      other = `printf 'insert 2 user2 person2@example.com\n.exit\n' | ./db test.db --shared`
+      expect(other).to eq("db > Executed.\ndb > ")
+
+      pipe.puts "select"
+      pipe.puts ".exit"
+      pipe.close_write
+      expect(pipe.gets(nil).split("\n")).to eq([
+        "db > Executed.",
+        "db > (1, user1, person1@example.com)",
+        "(2, user2, person2@example.com)",
+        "Executed.",
+        "db > ",
+      ])
+    end
+  end
+
+  it 'recovers committed transactions from the write-ahead log after a crash' do
+    IO.popen("./db test.db", "r+") do |pipe|
+      pipe.puts "begin"
+      (1..20).each do |i|
+        pipe.puts "insert #{i} user#{i} person#{i}@example.com"
+      end
+      pipe.puts "commit"
+      pipe.puts "begin"
+      pipe.puts "insert 21 user21 person21@example.com"
+      pipe.flush
+      # The commit writes the log in one go; crash as soon as it shows up
+      sleep 0.01 until File.size?("test.db-wal")
+      Process.kill("KILL", pipe.pid)
+    end
+
+    result = run_script([
+      "select count(*)",
+      "select max(id)",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > (20)",
+      "Executed.",
+      "db > (20)",
+      "Executed.",
+      "db > ",
+    ])
+  end
 end